@@ -2,6 +2,8 @@ import EventEmitter from "events";
 import assert from "assert";
 import fs from "fs-extra";
 import path from "path";
+import type { HeaderCache } from "./HeaderCache";
+import type { PumpData } from "./PumpData";
 import type { VM } from "./VM";
 import type { VMCompileFinished } from "./VMMessage";
 
@@ -12,12 +14,21 @@ export class CompileJob extends EventEmitter {
     startCompile?: number;
     fd?: number;
 
-    constructor(readonly commandLine: string[], readonly argv0: string, readonly id: number, readonly vm: VM) {
+    constructor(
+        readonly commandLine: string[],
+        readonly argv0: string,
+        readonly id: number,
+        readonly vm: VM,
+        readonly pump?: PumpData,
+        readonly headerCache?: HeaderCache
+    ) {
         super();
         this.dir = path.join(vm.root, "compiles", String(this.id));
         this.vmDir = path.join("/", "compiles", String(this.id));
         fs.mkdirpSync(this.dir);
-        this.fd = fs.openSync(path.join(this.dir, "sourcefile"), "w");
+        if (!pump) {
+            this.fd = fs.openSync(path.join(this.dir, "sourcefile"), "w");
+        }
         this.cppSize = 0;
         this.startCompile = undefined;
     }
@@ -39,6 +50,11 @@ export class CompileJob extends EventEmitter {
     }
 
     feed(data: Buffer): void {
+        if (this.pump) {
+            // data went into the header cache already
+            this.feedPump(this.pump);
+            return;
+        }
         assert(this.fd !== undefined, "Must have fd");
         fs.writeSync(this.fd, data);
         this.cppSize += data.length;
@@ -51,6 +67,29 @@ export class CompileJob extends EventEmitter {
         );
     }
 
+    private feedPump(pump: PumpData): void {
+        assert(this.headerCache, "Must have headerCache");
+        try {
+            this.headerCache.materialize(pump, path.join(this.dir, "root"));
+        } catch (err) {
+            this.sendCallback(err as Error);
+            return;
+        }
+        this.cppSize = pump.files.reduce((size: number, file) => size + file.size, 0);
+        this.startCompile = Date.now();
+        this.vm.child.send(
+            {
+                type: "compile",
+                commandLine: this.commandLine,
+                argv0: this.argv0,
+                id: this.id,
+                dir: this.vmDir,
+                pump: { cwd: pump.cwd, systemIncludes: pump.systemIncludes, preinclude: pump.preinclude }
+            },
+            this.sendCallback.bind(this)
+        );
+    }
+
     cancel(): void {
         this.vm.child.send({ type: "cancel", id: this.id }, this.sendCallback.bind(this));
     }
@@ -0,0 +1,667 @@
+// Where the client has to patch an object file it gets from the object cache
+// when its source path differs from the one the object was built with. This
+// is worked out once, when the object is added to the cache, so the client
+// can rewrite the bytes while they stream in rather than patching the file
+// after it's been written. It mirrors the client's in place patcher in
+// DwarfPatcher.cpp: only the string offsets of DW_AT_name/DW_AT_comp_dir and
+// of the DWARF 5 line table's paths change, whether they're in .debug_info,
+// .debug_line or, for the strx forms, .debug_str_offsets, along with the
+// section headers of .debug_str and .debug_line_str. The new strings go at
+// the end of the file. Anything it doesn't understand returns undefined and
+// the client falls back to patching the file once it's written.
+
+export interface DwarfRef {
+    // File offset and width of a string offset, either where the DWARF has it
+    // or in the addend of the relocation pointing at it
+    offset: number;
+    size: number;
+    // DW_AT_name or a file name, otherwise DW_AT_comp_dir or a directory
+    name: boolean;
+}
+
+export interface DwarfStrings {
+    // File offset of the string section's header
+    header: number;
+    // Its contents
+    offset: number;
+    size: number;
+    align: number;
+    refs: DwarfRef[];
+}
+
+export interface DwarfPatch {
+    elfClass: number;
+    // .debug_str and .debug_line_str, when something points into them
+    sections: DwarfStrings[];
+}
+
+interface Section {
+    name: string;
+    type: number;
+    flags: number;
+    offset: number;
+    size: number;
+    link: number;
+    info: number;
+    align: number;
+    entsize: number;
+    header: number;
+}
+
+interface Cursor {
+    pos: number;
+}
+
+interface Location {
+    // Relative to .debug_info, or .debug_line for the line table's paths
+    offset: number;
+    name: boolean;
+    form: number;
+    // Width of a section offset in its unit
+    size: number;
+    // For the string index forms
+    index: number;
+}
+
+interface UnitAttributes {
+    offsetSize: number;
+    // Relative to .debug_info, units in .dwo files don't have one
+    strOffsetsBase: number | undefined;
+    locations: Location[];
+}
+
+const SHT_RELA = 4;
+const SHT_NOBITS = 8;
+const SHT_REL = 9;
+const SHF_COMPRESSED = 0x800;
+
+const DW_AT_name = 0x03;
+const DW_AT_comp_dir = 0x1b;
+const DW_AT_str_offsets_base = 0x72;
+
+const DW_UT_type = 0x02;
+const DW_UT_skeleton = 0x04;
+const DW_UT_split_compile = 0x05;
+const DW_UT_split_type = 0x06;
+
+const DW_LNCT_path = 0x1;
+
+const DW_FORM_addr = 0x01;
+const DW_FORM_block2 = 0x03;
+const DW_FORM_block4 = 0x04;
+const DW_FORM_data2 = 0x05;
+const DW_FORM_data4 = 0x06;
+const DW_FORM_data8 = 0x07;
+const DW_FORM_string = 0x08;
+const DW_FORM_block = 0x09;
+const DW_FORM_block1 = 0x0a;
+const DW_FORM_data1 = 0x0b;
+const DW_FORM_flag = 0x0c;
+const DW_FORM_sdata = 0x0d;
+const DW_FORM_strp = 0x0e;
+const DW_FORM_udata = 0x0f;
+const DW_FORM_ref_addr = 0x10;
+const DW_FORM_ref1 = 0x11;
+const DW_FORM_ref2 = 0x12;
+const DW_FORM_ref4 = 0x13;
+const DW_FORM_ref8 = 0x14;
+const DW_FORM_ref_udata = 0x15;
+const DW_FORM_sec_offset = 0x17;
+const DW_FORM_exprloc = 0x18;
+const DW_FORM_flag_present = 0x19;
+const DW_FORM_strx = 0x1a;
+const DW_FORM_addrx = 0x1b;
+const DW_FORM_ref_sup4 = 0x1c;
+const DW_FORM_strp_sup = 0x1d;
+const DW_FORM_data16 = 0x1e;
+const DW_FORM_line_strp = 0x1f;
+const DW_FORM_ref_sig8 = 0x20;
+const DW_FORM_implicit_const = 0x21;
+const DW_FORM_loclistx = 0x22;
+const DW_FORM_rnglistx = 0x23;
+const DW_FORM_ref_sup8 = 0x24;
+const DW_FORM_strx1 = 0x25;
+const DW_FORM_strx2 = 0x26;
+const DW_FORM_strx3 = 0x27;
+const DW_FORM_strx4 = 0x28;
+const DW_FORM_addrx1 = 0x29;
+const DW_FORM_addrx2 = 0x2a;
+const DW_FORM_addrx3 = 0x2b;
+const DW_FORM_addrx4 = 0x2c;
+const DW_FORM_GNU_addr_index = 0x1f01;
+const DW_FORM_GNU_str_index = 0x1f02;
+const DW_FORM_GNU_ref_alt = 0x1f20;
+const DW_FORM_GNU_strp_alt = 0x1f21;
+
+// No BigInt in our lib, objects are nowhere near 2^53 bytes
+function readU64(data: Buffer, pos: number): number {
+    return data.readUInt32LE(pos) + data.readUInt32LE(pos + 4) * 0x100000000;
+}
+
+function readOffset(data: Buffer, pos: number, size: number): number {
+    return size === 8 ? readU64(data, pos) : data.readUInt32LE(pos);
+}
+
+function readULEB128(data: Buffer, cursor: Cursor): number {
+    let result = 0;
+    let multiplier = 1;
+    let byte;
+    do {
+        byte = data[cursor.pos++];
+        result += (byte & 0x7f) * multiplier;
+        multiplier *= 128;
+    } while (byte & 0x80);
+    return result;
+}
+
+function skipLEB128(data: Buffer, cursor: Cursor): void {
+    while (data[cursor.pos++] & 0x80) {
+        // continuation bytes
+    }
+}
+
+// Advances past an attribute value, returns false for forms we don't know
+function skipForm(data: Buffer, cursor: Cursor, form: number, addressSize: number, offsetSize: number): boolean {
+    switch (form) {
+        case DW_FORM_addr:
+            cursor.pos += addressSize;
+            return true;
+        case DW_FORM_data1:
+        case DW_FORM_ref1:
+        case DW_FORM_flag:
+        case DW_FORM_strx1:
+        case DW_FORM_addrx1:
+            cursor.pos += 1;
+            return true;
+        case DW_FORM_data2:
+        case DW_FORM_ref2:
+        case DW_FORM_strx2:
+        case DW_FORM_addrx2:
+            cursor.pos += 2;
+            return true;
+        case DW_FORM_strx3:
+        case DW_FORM_addrx3:
+            cursor.pos += 3;
+            return true;
+        case DW_FORM_data4:
+        case DW_FORM_ref4:
+        case DW_FORM_ref_sup4:
+        case DW_FORM_strx4:
+        case DW_FORM_addrx4:
+            cursor.pos += 4;
+            return true;
+        case DW_FORM_data8:
+        case DW_FORM_ref8:
+        case DW_FORM_ref_sig8:
+        case DW_FORM_ref_sup8:
+            cursor.pos += 8;
+            return true;
+        case DW_FORM_data16:
+            cursor.pos += 16;
+            return true;
+        case DW_FORM_strp:
+        case DW_FORM_line_strp:
+        case DW_FORM_sec_offset:
+        case DW_FORM_ref_addr:
+        case DW_FORM_strp_sup:
+        case DW_FORM_GNU_ref_alt:
+        case DW_FORM_GNU_strp_alt:
+            cursor.pos += offsetSize;
+            return true;
+        case DW_FORM_flag_present:
+        case DW_FORM_implicit_const:
+            return true;
+        case DW_FORM_sdata:
+        case DW_FORM_udata:
+        case DW_FORM_ref_udata:
+        case DW_FORM_loclistx:
+        case DW_FORM_rnglistx:
+        case DW_FORM_strx:
+        case DW_FORM_addrx:
+        case DW_FORM_GNU_str_index:
+        case DW_FORM_GNU_addr_index:
+            skipLEB128(data, cursor);
+            return true;
+        case DW_FORM_string:
+            cursor.pos = data.indexOf(0, cursor.pos) + 1;
+            return cursor.pos > 0;
+        case DW_FORM_block1:
+            cursor.pos += 1 + data[cursor.pos];
+            return true;
+        case DW_FORM_block2:
+            cursor.pos += 2 + data.readUInt16LE(cursor.pos);
+            return true;
+        case DW_FORM_block4:
+            cursor.pos += 4 + data.readUInt32LE(cursor.pos);
+            return true;
+        case DW_FORM_block:
+        case DW_FORM_exprloc: {
+            const size = readULEB128(data, cursor);
+            cursor.pos += size;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+function isStringIndex(form: number): boolean {
+    switch (form) {
+        case DW_FORM_strx:
+        case DW_FORM_strx1:
+        case DW_FORM_strx2:
+        case DW_FORM_strx3:
+        case DW_FORM_strx4:
+        case DW_FORM_GNU_str_index:
+            return true;
+        default:
+            return false;
+    }
+}
+
+function isStringForm(form: number): boolean {
+    return form === DW_FORM_strp || form === DW_FORM_line_strp || isStringIndex(form);
+}
+
+function readStringIndex(data: Buffer, pos: number, form: number): number {
+    switch (form) {
+        case DW_FORM_strx1:
+        case DW_FORM_strx2:
+        case DW_FORM_strx3:
+        case DW_FORM_strx4:
+            return data.readUIntLE(pos, form - DW_FORM_strx1 + 1);
+        default:
+            return readULEB128(data, { pos });
+    }
+}
+
+function readSections(data: Buffer, is64: boolean): Section[] | undefined {
+    const shoff = is64 ? readU64(data, 0x28) : data.readUInt32LE(0x20);
+    const shentsize = data.readUInt16LE(is64 ? 0x3a : 0x2e);
+    const shnum = data.readUInt16LE(is64 ? 0x3c : 0x30);
+    const shstrndx = data.readUInt16LE(is64 ? 0x3e : 0x32);
+    if (shentsize !== (is64 ? 64 : 40) || !shnum || shstrndx >= shnum || shoff + shnum * shentsize > data.length) {
+        return undefined;
+    }
+
+    const sections: Section[] = [];
+    for (let i = 0; i < shnum; ++i) {
+        const header = shoff + i * shentsize;
+        const section: Section = is64
+            ? {
+                  name: "",
+                  type: data.readUInt32LE(header + 4),
+                  flags: readU64(data, header + 8),
+                  offset: readU64(data, header + 24),
+                  size: readU64(data, header + 32),
+                  link: data.readUInt32LE(header + 40),
+                  info: data.readUInt32LE(header + 44),
+                  align: readU64(data, header + 48),
+                  entsize: readU64(data, header + 56),
+                  header
+              }
+            : {
+                  name: "",
+                  type: data.readUInt32LE(header + 4),
+                  flags: data.readUInt32LE(header + 8),
+                  offset: data.readUInt32LE(header + 16),
+                  size: data.readUInt32LE(header + 20),
+                  link: data.readUInt32LE(header + 24),
+                  info: data.readUInt32LE(header + 28),
+                  align: data.readUInt32LE(header + 32),
+                  entsize: data.readUInt32LE(header + 36),
+                  header
+              };
+        if (section.type !== SHT_NOBITS && section.offset + section.size > data.length) {
+            return undefined;
+        }
+        sections.push(section);
+    }
+
+    const shstrtab = sections[shstrndx];
+    for (let i = 0; i < shnum; ++i) {
+        const start = shstrtab.offset + data.readUInt32LE(sections[i].header);
+        const end = data.indexOf(0, start);
+        if (end !== -1 && end < shstrtab.offset + shstrtab.size) {
+            sections[i].name = data.toString("latin1", start, end);
+        }
+    }
+    return sections;
+}
+
+// The .debug_info offsets of DW_AT_name/DW_AT_comp_dir in the first DIE of
+// the first unit, when they're one of the string forms
+function findAttributes(data: Buffer, info: Section, abbrev: Section): UnitAttributes | undefined {
+    const cursor: Cursor = { pos: info.offset };
+    const offsetSize = data.readUInt32LE(cursor.pos) === 0xffffffff ? 8 : 4;
+    cursor.pos += offsetSize === 8 ? 12 : 4;
+    const version = data.readUInt16LE(cursor.pos);
+    cursor.pos += 2;
+    let abbrevOffset;
+    let addressSize;
+    if (version >= 5) {
+        const unitType = data[cursor.pos++];
+        addressSize = data[cursor.pos++];
+        abbrevOffset = readOffset(data, cursor.pos, offsetSize);
+        cursor.pos += offsetSize;
+        if (unitType === DW_UT_skeleton || unitType === DW_UT_split_compile) {
+            cursor.pos += 8; // dwo_id
+        } else if (unitType === DW_UT_type || unitType === DW_UT_split_type) {
+            cursor.pos += 8 + offsetSize; // type_signature, type_offset
+        }
+    } else {
+        abbrevOffset = readOffset(data, cursor.pos, offsetSize);
+        cursor.pos += offsetSize;
+        addressSize = data[cursor.pos++];
+    }
+    if (abbrevOffset >= abbrev.size) {
+        return undefined;
+    }
+
+    const abbrevCode = readULEB128(data, cursor);
+    if (!abbrevCode) {
+        return undefined;
+    }
+
+    const abbrevCursor: Cursor = { pos: abbrev.offset + abbrevOffset };
+    const abbrevEnd = abbrev.offset + abbrev.size;
+    while (abbrevCursor.pos < abbrevEnd) {
+        const code = readULEB128(data, abbrevCursor);
+        if (!code) {
+            break;
+        }
+        skipLEB128(data, abbrevCursor); // tag
+        ++abbrevCursor.pos; // has_children
+
+        const found: UnitAttributes = { offsetSize, strOffsetsBase: undefined, locations: [] };
+        while (abbrevCursor.pos < abbrevEnd) {
+            const attrName = readULEB128(data, abbrevCursor);
+            const attrForm = readULEB128(data, abbrevCursor);
+            if (attrForm === DW_FORM_implicit_const) {
+                skipLEB128(data, abbrevCursor);
+            }
+            if (!attrName && !attrForm) {
+                break;
+            }
+            if (code !== abbrevCode) {
+                continue;
+            }
+            if ((attrName === DW_AT_name || attrName === DW_AT_comp_dir) && isStringForm(attrForm)) {
+                found.locations.push({
+                    offset: cursor.pos - info.offset,
+                    name: attrName === DW_AT_name,
+                    form: attrForm,
+                    size: offsetSize,
+                    index: isStringIndex(attrForm) ? readStringIndex(data, cursor.pos, attrForm) : 0
+                });
+            } else if (attrName === DW_AT_str_offsets_base && attrForm === DW_FORM_sec_offset) {
+                found.strOffsetsBase = cursor.pos - info.offset;
+            }
+            if (!skipForm(data, cursor, attrForm, addressSize, offsetSize) || cursor.pos > info.offset + info.size) {
+                return undefined;
+            }
+        }
+        if (code === abbrevCode) {
+            return found;
+        }
+    }
+    return undefined;
+}
+
+// The paths in the directory and file tables of every DWARF 5 line table,
+// earlier versions have the strings inline
+function findLinePaths(data: Buffer, line: Section, locations: Location[]): boolean {
+    const sectionEnd = line.offset + line.size;
+    const cursor: Cursor = { pos: line.offset };
+    while (sectionEnd - cursor.pos >= 4) {
+        let unitLength = data.readUInt32LE(cursor.pos);
+        cursor.pos += 4;
+        const offsetSize = unitLength === 0xffffffff ? 8 : 4;
+        if (offsetSize === 8) {
+            if (sectionEnd - cursor.pos < 8) {
+                return false;
+            }
+            unitLength = readU64(data, cursor.pos);
+            cursor.pos += 8;
+        }
+        if (unitLength > sectionEnd - cursor.pos) {
+            return false;
+        }
+        const end = cursor.pos + unitLength;
+
+        if (data.readUInt16LE(cursor.pos) !== 5) {
+            cursor.pos = end;
+            continue;
+        }
+        // version, address_size, segment_selector_size, header_length,
+        // minimum_instruction_length, maximum_operations_per_instruction,
+        // default_is_stmt, line_base, line_range
+        cursor.pos += 4 + offsetSize + 5;
+        const opcodeBase = data[cursor.pos++];
+        if (opcodeBase) {
+            cursor.pos += opcodeBase - 1;
+        }
+
+        for (const name of [false, true]) {
+            if (cursor.pos >= end) {
+                return false;
+            }
+            const formats: Array<[number, number]> = [];
+            for (let formatCount = data[cursor.pos++]; formatCount > 0; --formatCount) {
+                const contentType = readULEB128(data, cursor);
+                formats.push([contentType, readULEB128(data, cursor)]);
+            }
+            const count = readULEB128(data, cursor);
+            for (let i = 0; i < count; ++i) {
+                for (const [contentType, form] of formats) {
+                    if (cursor.pos >= end) {
+                        return false;
+                    }
+                    if (contentType === DW_LNCT_path && isStringForm(form)) {
+                        locations.push({
+                            offset: cursor.pos - line.offset,
+                            name,
+                            form,
+                            size: offsetSize,
+                            index: isStringIndex(form) ? readStringIndex(data, cursor.pos, form) : 0
+                        });
+                    }
+                    if (!skipForm(data, cursor, form, 0, offsetSize)) {
+                        return false;
+                    }
+                }
+            }
+        }
+        cursor.pos = end;
+    }
+    return true;
+}
+
+function describe(data: Buffer, sourcePath: string): DwarfPatch | undefined {
+    // Little endian only, the client writes the values in its own byte order
+    if (data.length < 64 || data.readUInt32BE(0) !== 0x7f454c46 || data[5] !== 1 || (data[4] !== 1 && data[4] !== 2)) {
+        return undefined;
+    }
+    const is64 = data[4] === 2;
+    const sections = readSections(data, is64);
+    if (!sections) {
+        return undefined;
+    }
+
+    const find = (names: string[]): number => sections.findIndex((section) => names.includes(section.name));
+    const infoIdx = find([".debug_info", ".debug_info.dwo"]);
+    const abbrevIdx = find([".debug_abbrev", ".debug_abbrev.dwo"]);
+    const strIdx = find([".debug_str", ".debug_str.dwo"]);
+    const lineStrIdx = find([".debug_line_str"]);
+    const lineIdx = find([".debug_line", ".debug_line.dwo"]);
+    const strOffsetsIdx = find([".debug_str_offsets", ".debug_str_offsets.dwo"]);
+    if (infoIdx <= 0 || abbrevIdx <= 0) {
+        return undefined;
+    }
+    const present = [infoIdx, abbrevIdx, strIdx, lineStrIdx, lineIdx, strOffsetsIdx].filter((idx) => idx > 0);
+    if (present.some((idx) => sections[idx].flags & SHF_COMPRESSED)) {
+        return undefined;
+    }
+
+    // The relocations for the sections that hold string offsets
+    const rels = new Map<number, Section>();
+    const relocated = [infoIdx, lineIdx, strOffsetsIdx].filter((idx) => idx > 0);
+    for (const section of sections) {
+        if ((section.type !== SHT_REL && section.type !== SHT_RELA) || !relocated.includes(section.info)) {
+            continue;
+        }
+        const entsize = is64 ? (section.type === SHT_RELA ? 24 : 16) : section.type === SHT_RELA ? 12 : 8;
+        if (section.flags & SHF_COMPRESSED || section.entsize !== entsize || !sections[section.link]) {
+            return undefined;
+        }
+        rels.set(section.info, section);
+    }
+
+    // Where the offset into target that's at offset in container lives, the
+    // addend of its relocation with RELA, the bytes themselves otherwise
+    const locate = (containerIdx: number, offset: number, size: number, targetIdx: number): DwarfRef | undefined => {
+        const container = sections[containerIdx];
+        if (offset + size > container.size) {
+            return undefined;
+        }
+        const rel = rels.get(containerIdx);
+        if (!rel) {
+            return { offset: container.offset + offset, size, name: false };
+        }
+        const rela = rel.type === SHT_RELA;
+        const entsize = rel.entsize;
+        const symtab = sections[rel.link];
+        for (let pos = rel.offset; pos + entsize <= rel.offset + rel.size; pos += entsize) {
+            if ((is64 ? readU64(data, pos) : data.readUInt32LE(pos)) !== offset) {
+                continue;
+            }
+            const symbol = is64 ? data.readUInt32LE(pos + 12) : data.readUInt32LE(pos + 4) >>> 8;
+            const sym = symtab.offset + symbol * (is64 ? 24 : 16);
+            if (sym + (is64 ? 24 : 16) > symtab.offset + symtab.size) {
+                return undefined;
+            }
+            const shndx = data.readUInt16LE(sym + (is64 ? 6 : 14));
+            const value = is64 ? readU64(data, sym + 8) : data.readUInt32LE(sym + 4);
+            if (shndx !== targetIdx || value) {
+                return undefined;
+            }
+            if (rela) {
+                return { offset: pos + (is64 ? 16 : 8), size: is64 ? 8 : 4, name: false };
+            }
+            return { offset: container.offset + offset, size, name: false };
+        }
+        return undefined;
+    };
+
+    const unit = findAttributes(data, sections[infoIdx], sections[abbrevIdx]);
+    if (!unit) {
+        return undefined;
+    }
+    const locations = unit.locations.slice();
+    if (lineIdx > 0 && !findLinePaths(data, sections[lineIdx], locations)) {
+        locations.length = unit.locations.length;
+    }
+
+    let strOffsetsBase: number | undefined;
+    if (strOffsetsIdx > 0) {
+        const strOffsets = sections[strOffsetsIdx];
+        const pos = strOffsets.offset;
+        if (unit.strOffsetsBase !== undefined) {
+            const value = locate(infoIdx, unit.strOffsetsBase, unit.offsetSize, strOffsetsIdx);
+            strOffsetsBase = value ? readOffset(data, value.offset, value.size) : undefined;
+        } else if (
+            strOffsets.size >= 8 &&
+            data.readUInt32LE(pos) === strOffsets.size - 4 &&
+            data.readUInt16LE(pos + 4) === 5
+        ) {
+            // A .dwo has a single contribution and no DW_AT_str_offsets_base
+            strOffsetsBase = 8;
+        } else if (
+            strOffsets.size >= 16 &&
+            data.readUInt32LE(pos) === 0xffffffff &&
+            readU64(data, pos + 4) === strOffsets.size - 12 &&
+            data.readUInt16LE(pos + 12) === 5
+        ) {
+            strOffsetsBase = 16;
+        } else {
+            // GCC leaves the header out
+            strOffsetsBase = 0;
+        }
+    }
+
+    // The entry in .debug_str_offsets for a string index
+    const locateIndex = (index: number, targetIdx: number): DwarfRef | undefined => {
+        if (strOffsetsBase === undefined || strOffsetsBase > sections[strOffsetsIdx].size) {
+            return undefined;
+        }
+        if (index >= Math.floor((sections[strOffsetsIdx].size - strOffsetsBase) / unit.offsetSize)) {
+            return undefined;
+        }
+        return locate(strOffsetsIdx, strOffsetsBase + index * unit.offsetSize, unit.offsetSize, targetIdx);
+    };
+
+    const slash = sourcePath.lastIndexOf("/");
+    const dir = slash === -1 ? "" : sourcePath.substring(0, slash);
+    const strings: DwarfStrings[] = [strIdx, lineStrIdx].map((idx) => {
+        const section = sections[Math.max(idx, 0)];
+        return {
+            header: section.header,
+            offset: section.offset,
+            size: section.size,
+            align: Math.max(section.align, 1),
+            refs: []
+        };
+    });
+    locations.forEach((location, i) => {
+        if (!location.name && !dir) {
+            return;
+        }
+        const containerIdx = i < unit.locations.length ? infoIdx : lineIdx;
+        const targetIdx = location.form === DW_FORM_line_strp ? lineStrIdx : strIdx;
+        if (targetIdx <= 0) {
+            return;
+        }
+        const ref = isStringIndex(location.form)
+            ? locateIndex(location.index, targetIdx)
+            : locate(containerIdx, location.offset, location.size, targetIdx);
+        if (!ref) {
+            return;
+        }
+
+        const str = sections[targetIdx];
+        const strOffset = readOffset(data, ref.offset, ref.size);
+        if (strOffset >= str.size) {
+            return;
+        }
+        const end = data.indexOf(0, str.offset + strOffset);
+        if (end === -1 || end >= str.offset + str.size) {
+            return;
+        }
+        if (data.toString("utf8", str.offset + strOffset, end) !== (location.name ? sourcePath : dir)) {
+            return;
+        }
+        // Several string indexes can share an entry in .debug_str_offsets
+        const refs = strings[targetIdx === lineStrIdx ? 1 : 0].refs;
+        if (!refs.some((existing) => existing.offset === ref.offset)) {
+            refs.push({ offset: ref.offset, size: ref.size, name: location.name });
+        }
+    });
+
+    const used = strings.filter((section) => section.refs.length > 0);
+    if (!used.length) {
+        return undefined;
+    }
+    return { elfClass: is64 ? 64 : 32, sections: used };
+}
+
+export function dwarfPatch(data: Buffer, sourcePath: string | undefined): DwarfPatch | undefined {
+    if (!sourcePath) {
+        return undefined;
+    }
+    try {
+        return describe(data, sourcePath);
+    } catch (err: unknown) {
+        // A truncated or otherwise odd object, the client can still patch it itself
+        return undefined;
+    }
+}
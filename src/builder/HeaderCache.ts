@@ -0,0 +1,165 @@
+import crypto from "crypto";
+import fs from "fs-extra";
+import path from "path";
+import prettybytes from "pretty-bytes";
+import type { PumpData } from "./PumpData";
+
+// Sources and headers sent by clients in pump mode and segments of
+// preprocessed output, stored by the hash of their contents so each one only
+// crosses the network once. Files a job is going to use are pinned until the
+// job is done so they can't be purged between telling the client what to send
+// and setting up the compile.
+
+const HASH_LENGTH = 64;
+
+export interface CachedFile {
+    // sha256 of the contents
+    hash: string;
+    size: number;
+}
+
+export class HeaderCache {
+    // Least recently used first
+    private readonly files: Map<string, number> = new Map<string, number>();
+    private readonly pinned: Map<string, number> = new Map<string, number>();
+
+    size: number;
+
+    constructor(readonly dir: string, readonly maxSize: number) {
+        fs.mkdirpSync(dir);
+        this.size = 0;
+        try {
+            fs.readdirSync(this.dir)
+                .filter((fileName: string) => fileName.length === HASH_LENGTH)
+                .map((fileName: string) => {
+                    const stat = fs.statSync(path.join(this.dir, fileName));
+                    return { hash: fileName, size: stat.size, atime: stat.atimeMs };
+                })
+                .sort((a, b) => a.atime - b.atime)
+                .forEach((item) => {
+                    this.files.set(item.hash, item.size);
+                    this.size += item.size;
+                });
+        } catch (err) {
+            console.error(`Got error reading directory ${dir}:`, err);
+        }
+        this.purge();
+        console.log(
+            "initializing header cache with",
+            this.dir,
+            "maxSize",
+            prettybytes(maxSize),
+            "size",
+            prettybytes(this.size)
+        );
+    }
+
+    // Pins the files and returns the hashes we don't have
+    acquire(files: CachedFile[]): string[] {
+        const need: string[] = [];
+        for (const hash of this.unique(files)) {
+            this.pinned.set(hash, (this.pinned.get(hash) || 0) + 1);
+            const size = this.files.get(hash);
+            if (size === undefined) {
+                need.push(hash);
+            } else {
+                this.files.delete(hash);
+                this.files.set(hash, size);
+            }
+        }
+        return need;
+    }
+
+    release(files: CachedFile[]): void {
+        for (const hash of this.unique(files)) {
+            const count = this.pinned.get(hash) || 0;
+            if (count <= 1) {
+                this.pinned.delete(hash);
+            } else {
+                this.pinned.set(hash, count - 1);
+            }
+        }
+        this.purge();
+    }
+
+    // data is the contents of the files in need, in that order. Returns an
+    // error message if it doesn't match.
+    receive(files: CachedFile[], need: string[], data: Buffer): string | undefined {
+        const sizes = new Map<string, number>();
+        for (const file of files) {
+            sizes.set(file.hash, file.size);
+        }
+        let offset = 0;
+        for (const hash of need) {
+            const size = sizes.get(hash);
+            if (size === undefined || offset + size > data.length) {
+                return `Bad upload for ${hash}`;
+            }
+            const contents = data.subarray(offset, offset + size);
+            offset += size;
+            if (crypto.createHash("sha256").update(contents).digest("hex") !== hash) {
+                return `Hash mismatch for ${hash}`;
+            }
+            if (!this.files.has(hash)) {
+                fs.writeFileSync(path.join(this.dir, hash), contents);
+                this.files.set(hash, size);
+                this.size += size;
+            }
+        }
+        if (offset !== data.length) {
+            return `Got ${data.length} bytes, expected ${offset}`;
+        }
+        this.purge();
+        return undefined;
+    }
+
+    // Lays the files out under root the way they were on the client
+    materialize(pump: PumpData, root: string): void {
+        fs.mkdirpSync(root + pump.cwd);
+        for (const dir of pump.dirs) {
+            fs.mkdirpSync(root + dir);
+        }
+        for (const file of pump.files) {
+            const source = path.join(this.dir, file.hash);
+            const target = root + file.path;
+            fs.mkdirpSync(path.dirname(target));
+            try {
+                fs.linkSync(source, target);
+            } catch (err) {
+                // The cache may be on a different file system
+                fs.copyFileSync(source, target);
+            }
+        }
+    }
+
+    // The files back to back, that's how segments turn back into the
+    // preprocessed output
+    read(files: CachedFile[]): Buffer {
+        return Buffer.concat(files.map((file: CachedFile) => fs.readFileSync(path.join(this.dir, file.hash))));
+    }
+
+    private unique(files: CachedFile[]): Set<string> {
+        return new Set<string>(files.map((file: CachedFile) => file.hash));
+    }
+
+    private purge(): void {
+        if (this.size <= this.maxSize) {
+            return;
+        }
+        for (const [hash, size] of this.files) {
+            if (this.size <= this.maxSize) {
+                break;
+            }
+            if (this.pinned.has(hash)) {
+                continue;
+            }
+            try {
+                fs.unlinkSync(path.join(this.dir, hash));
+            } catch (err) {
+                console.error("Failed to remove", hash, "from the header cache", err);
+            }
+            this.files.delete(hash);
+            this.size -= size;
+        }
+    }
+}
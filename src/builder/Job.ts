@@ -1,6 +1,8 @@
 import EventEmitter from "events";
 import WebSocket from "ws";
+import type { CachedFile } from "./HeaderCache";
 import type { JobData } from "./JobData";
+import type { PumpData } from "./PumpData";
 
 export class Job extends EventEmitter implements JobData {
     ws: WebSocket;
@@ -22,6 +24,9 @@ export class Job extends EventEmitter implements JobData {
     connectTime?: number;
     wait?: boolean;
     objectcache?: boolean;
+    pump?: PumpData;
+    // Preprocessed output sent as segments, in order
+    segments?: CachedFile[];
     supportsCompressedResponse?: boolean;
     heartbeatTimer?: NodeJS.Timeout;
 
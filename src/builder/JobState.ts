@@ -14,6 +14,8 @@ export interface JobState {
     buffer?: Buffer;
     objectCache?: boolean;
     op?: CompileJob;
+    // Pump mode and segmented uploads, the hashes the client has to upload
+    need?: string[];
     webSocketError?: string;
 
     cancel: () => void;
@@ -1,5 +1,6 @@
 import { ObjectCacheItem } from "./ObjectCacheItem";
 import { ObjectCachePendingItem } from "./ObjectCachePendingItem";
+import { isCacheKey } from "../common/HashAlgorithms";
 import EventEmitter from "events";
 import fs from "fs-extra";
 import path from "path";
@@ -56,7 +57,7 @@ export class ObjectCache extends EventEmitter {
             fs.readdirSync(this.dir)
                 .map((fileName) => {
                     const ret: FileType = { path: path.join(this.dir, fileName) };
-                    if (fileName.length === 40) {
+                    if (isCacheKey(fileName)) {
                         try {
                             const stat = fs.statSync(ret.path);
                             if (stat.isFile()) {
@@ -109,7 +110,7 @@ export class ObjectCache extends EventEmitter {
         let fd;
         let jsonBuffer;
         try {
-            if (fileName.length === 40) {
+            if (isCacheKey(fileName)) {
                 const headerSizeBuffer = Buffer.allocUnsafe(4);
                 fd = fs.openSync(filePath, "r");
                 const stat = fs.statSync(filePath);
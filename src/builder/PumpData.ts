@@ -0,0 +1,19 @@
+import type { CachedFile } from "./HeaderCache";
+
+// Pump mode, the client sends the files the translation unit can include
+// instead of preprocessed output and the builder preprocesses remotely.
+export interface PumpFile extends CachedFile {
+    // Absolute and normalized on the client, mirrored under the compile's root
+    path: string;
+}
+
+export interface PumpData {
+    cwd: string;
+    // Directories that have to exist for paths with .. in them to resolve
+    dirs: string[];
+    // The client compiler's built in search path, passed as -isystem
+    systemIncludes: string[];
+    // GCC's implicit stdc-predef.h which -nostdinc turns off
+    preinclude?: string;
+    files: PumpFile[];
+}
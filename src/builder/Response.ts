@@ -1,6 +1,10 @@
+import type { DwarfPatch } from "./DwarfPatch";
+
 interface IndexItem {
     bytes: number;
     uncompressedSize: number;
+    // Only for objects in the object cache
+    dwarf?: DwarfPatch;
 }
 
 export interface Response {
@@ -10,6 +10,13 @@ import type { Options } from "@jhanssen/options";
 import type net from "net";
 import type stream from "stream";
 
+// zstd support was added to node's zlib in 22.15 and 23.8
+const zstd = zlib as unknown as {
+    zstdDecompress?: (buf: Buffer, callback: (err: Error | null, result: Buffer) => void) => void;
+    createZstdDecompress?: () => stream.Transform;
+};
+export const supportsZstd = typeof zstd.zstdDecompress === "function" && typeof zstd.createZstdDecompress === "function";
+
 export class Server extends EventEmitter {
     private app?: express.Express;
     private server?: net.Server;
@@ -50,6 +57,8 @@ export class Server extends EventEmitter {
         const connectTime = Date.now();
         let client: Job | undefined;
         let bytes: number | undefined;
+        let compression: string | undefined;
+        let upload: { received: number; data: Buffer[]; decompressor?: stream.Transform } | undefined;
         let ip = req.connection.remoteAddress;
         let clientEmitted = false;
         const error = (msg: string): void => {
@@ -140,6 +149,63 @@ export class Server extends EventEmitter {
                         error("Unable to parse string message as JSON");
                         return;
                     }
+                    if (upload) {
+                        if (json.type !== "uploadFinished") {
+                            error("Got unexpected JSON message while streaming");
+                            return;
+                        }
+                        if (json.bytes !== upload.received) {
+                            error(`length ${upload.received} !== ${json.bytes}`);
+                            return;
+                        }
+                        const streamed = upload;
+                        upload = undefined;
+                        assert(client, "Gotta client");
+                        if (streamed.decompressor) {
+                            streamed.decompressor.end();
+                        } else {
+                            client.emit("data", { data: Buffer.concat(streamed.data) });
+                        }
+                        return;
+                    }
+                    if (json.type === "needed") {
+                        // The files or segments we didn't have, all in one binary message
+                        assert(client, "Gotta client");
+                        if ((!client.pump && !client.segments) || typeof json.bytes !== "number") {
+                            error("Got unexpected needed message");
+                            return;
+                        }
+                        if (json.bytes) {
+                            bytes = json.bytes;
+                        } else {
+                            client.emit("data", { data: Buffer.alloc(0) });
+                        }
+                        return;
+                    }
+                    if (json.compression === "zstd" && !supportsZstd) {
+                        error("zstd compression is not supported by this builder");
+                        return;
+                    }
+                    if (json.stream) {
+                        upload = { received: 0, data: [] };
+                        if (json.compressed) {
+                            const streamed = upload;
+                            const decompressor: stream.Transform =
+                                json.compression === "zstd" && zstd.createZstdDecompress ? zstd.createZstdDecompress() : zlib.createGunzip();
+                            decompressor.on("data", (chunk: Buffer) => {
+                                streamed.data.push(chunk);
+                            });
+                            decompressor.on("error", (err: Error) => {
+                                error(`Got error inflating data ${err}`);
+                            });
+                            decompressor.on("end", () => {
+                                assert(client, "Gotta client");
+                                client.emit("data", { data: Buffer.concat(streamed.data) });
+                            });
+                            upload.decompressor = decompressor;
+                        }
+                    }
+                    compression = json.compression;
                     bytes = json.bytes;
                     assert(client, "Must client");
                     client.compressed = json.compressed;
@@ -147,6 +213,19 @@ export class Server extends EventEmitter {
                     client.argv0 = json.argv0;
                     client.connectTime = connectTime;
                     client.wait = json.wait;
+                    if (json.pump) {
+                        if (typeof json.pump.cwd !== "string" || !Array.isArray(json.pump.files)) {
+                            error("Bad pump data");
+                            return;
+                        }
+                        client.pump = json.pump;
+                    } else if (json.segments) {
+                        if (!Array.isArray(json.segments) || !json.segments.length) {
+                            error("Bad segments");
+                            return;
+                        }
+                        client.segments = json.segments;
+                    }
                     this.emit("job", client);
                     clientEmitted = true;
                     break;
@@ -159,6 +238,15 @@ export class Server extends EventEmitter {
                             error("No data in buffer");
                             return;
                         }
+                        if (upload) {
+                            upload.received += msg.length;
+                            if (upload.decompressor) {
+                                upload.decompressor.write(msg);
+                            } else {
+                                upload.data.push(msg);
+                            }
+                            return;
+                        }
                         if (!bytes) {
                             error("Got binary message without a preceeding json message describing the data");
                             return;
@@ -172,14 +260,19 @@ export class Server extends EventEmitter {
                         // console.log("GOT DATA", client.compressed, msg.length);
                         assert(client, "Gotta client");
                         if (client.compressed) {
-                            zlib.gunzip(msg, (err, data) => {
+                            const onData = (err: Error | null, data: Buffer): void => {
                                 if (err) {
                                     error(`Got error inflating data ${err}`);
                                 } else {
                                     assert(client, "Gotta client");
                                     client.emit("data", { data });
                                 }
-                            });
+                            };
+                            if (compression === "zstd" && zstd.zstdDecompress) {
+                                zstd.zstdDecompress(msg, onData);
+                            } else {
+                                zlib.gunzip(msg, onData);
+                            }
                         } else {
                             client.emit("data", { data: msg });
                         }
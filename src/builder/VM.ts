@@ -4,7 +4,9 @@ import child_process from "child_process";
 import fs from "fs-extra";
 import path from "path";
 import type { CompileFinishedEvent } from "./CompileFinishedEvent";
+import type { HeaderCache } from "./HeaderCache";
 import type { Options } from "@jhanssen/options";
+import type { PumpData } from "./PumpData";
 import type { VMCompileFinished, VMCompileFinishedFile, VMMessage } from "./VMMessage";
 
 export class VM extends EventEmitter {
@@ -121,8 +123,14 @@ export class VM extends EventEmitter {
         });
     }
 
-    startCompile(commandLine: string[], argv0: string, id: number): CompileJob {
-        const compile = new CompileJob(commandLine, argv0, id, this);
+    startCompile(
+        commandLine: string[],
+        argv0: string,
+        id: number,
+        pump?: PumpData,
+        headerCache?: HeaderCache
+    ): CompileJob {
+        const compile = new CompileJob(commandLine, argv0, id, this, pump, headerCache);
         this.compiles[compile.id] = compile;
         // console.log("startCompile " + compile.id);
         return compile;
@@ -5,10 +5,41 @@ import fs from "fs-extra";
 import path from "path";
 import type { ExitEvent, ExitEventFile } from "./ExitEvent";
 
+export interface CompilePump {
+    cwd: string;
+    systemIncludes: string[];
+    preinclude?: string;
+}
+
+// Options whose argument is a separate argument that doesn't need rewriting
+const pumpSkipArgs = new Set<string>([
+    "--param",
+    "-B",
+    "-D",
+    "-G",
+    "-MQ",
+    "-MT",
+    "-T",
+    "-U",
+    "-V",
+    "-Xanalyzer",
+    "-Xassembler",
+    "-Xlinker",
+    "-arch",
+    "-b",
+    "-gcc-toolchain",
+    "-imultilib",
+    "-target",
+    "-x"
+]);
+
+const pumpPathPrefixes = ["-I", "-iquote", "-isystem", "-idirafter", "-include", "-imacros"];
+const pumpPrefixMaps = ["-fdebug-prefix-map=", "-ffile-prefix-map=", "-fmacro-prefix-map=", "-fprofile-prefix-map="];
+
 export class Compile extends EventEmitter {
     proc: child_process.ChildProcessWithoutNullStreams;
 
-    constructor(args: string[], argv0: string, dir: string, debug: boolean) {
+    constructor(args: string[], argv0: string, dir: string, debug: boolean, pump?: CompilePump) {
         super();
 
         if (!args || !args.length || !dir || !argv0) {
@@ -20,6 +51,10 @@ export class Compile extends EventEmitter {
             console.error(argv0, args, dir);
             throw new Error("Bad args");
         }
+        if (pump) {
+            this.proc = this.compilePump(compiler, args, dir, debug, pump);
+            return;
+        }
         const isClang = compiler.indexOf("clang") !== -1;
 
         let output: string | undefined;
@@ -311,6 +346,151 @@ export class Compile extends EventEmitter {
         });
     }
 
+    // Pump mode, the client's files are mirrored under root and the compiler
+    // preprocesses for itself. Absolute paths are moved under root, the
+    // compiler's own search path is replaced with the client's and root is
+    // mapped away again in debug info, __FILE__, dependency files and
+    // diagnostics.
+    private compilePump(
+        compiler: string,
+        args: string[],
+        dir: string,
+        debug: boolean,
+        pump: CompilePump
+    ): child_process.ChildProcessWithoutNullStreams {
+        const root = path.join(dir, "root");
+        const cwd = root + pump.cwd;
+        // Concatenated rather than joined so .. components are resolved the
+        // same way as on the client
+        const underRoot = (file: string): string => (path.isAbsolute(file) ? root + file : file);
+        const inCwd = (file: string): string => (path.isAbsolute(file) ? root + file : path.join(cwd, file));
+
+        let output: string | undefined;
+        let depFile: string | undefined;
+        let sourcePath: string | undefined;
+        let dependencies = false;
+        for (let i = 0; i < args.length; ++i) {
+            const arg = args[i];
+            if (arg === "-o") {
+                output = args[++i];
+                args[i] = underRoot(output);
+            } else if (arg === "-MF") {
+                depFile = args[++i];
+                args[i] = underRoot(depFile);
+            } else if (arg === "-MD" || arg === "-MMD") {
+                dependencies = true;
+            } else if (pumpPathPrefixes.includes(arg)) {
+                ++i;
+                args[i] = underRoot(args[i]);
+            } else if (pumpSkipArgs.has(arg)) {
+                ++i;
+            } else if (arg[0] !== "-") {
+                if (sourcePath) {
+                    console.log("Multiple source files", sourcePath, arg);
+                    throw new Error("More than one source file");
+                }
+                sourcePath = arg;
+                args[i] = underRoot(arg);
+            } else {
+                const prefix = pumpPathPrefixes.find((p: string) => arg.startsWith(p));
+                const map = pumpPrefixMaps.find((p: string) => arg.startsWith(p));
+                if (prefix) {
+                    args[i] = prefix + underRoot(arg.substring(prefix.length));
+                } else if (map && path.isAbsolute(arg.substring(map.length))) {
+                    // The client's own maps have to match the paths under root
+                    args[i] = map + root + arg.substring(map.length);
+                }
+            }
+        }
+        if (!sourcePath) {
+            throw new Error("No sourcefile");
+        }
+        if (!output) {
+            const suffix = path.extname(sourcePath);
+            output = sourcePath.substring(0, sourcePath.length - suffix.length) + ".o";
+            args.push("-o", underRoot(output));
+        }
+        if (dependencies && !depFile) {
+            depFile = output.substring(0, output.length - path.extname(output).length) + ".d";
+        }
+
+        // The last matching map wins so ours goes first, stdc-predef.h has
+        // to come before any other -include
+        const prefix = [`-ffile-prefix-map=${root}=`];
+        if (pump.preinclude) {
+            prefix.push("-include", root + pump.preinclude);
+        }
+        args.unshift(...prefix);
+        args.push("-nostdinc");
+        for (const include of pump.systemIncludes) {
+            args.push("-isystem", root + include);
+        }
+
+        fs.mkdirpSync(cwd);
+        fs.mkdirpSync(path.dirname(inCwd(output)));
+        if (depFile) {
+            fs.mkdirpSync(path.dirname(inCwd(depFile)));
+        }
+
+        if (debug) {
+            console.log("Calling", compiler, args.map((x) => '"' + x + '"').join(" "));
+        }
+        console.log(`Compiling source file: ${sourcePath}\n${[compiler, ...args].join(" ")}`);
+        const proc: child_process.ChildProcessWithoutNullStreams = child_process.spawn(compiler, args, { cwd });
+        proc.stdout.setEncoding("utf8");
+        proc.stderr.setEncoding("utf8");
+
+        // Held back so root can be stripped even if it's split across chunks
+        let stderr = "";
+        proc.stdout.on("data", (data) => {
+            this.emit("stdout", data);
+        });
+        proc.stderr.on("data", (data) => {
+            stderr += data;
+        });
+        proc.on("error", (err) => {
+            this.emit("error", err);
+        });
+
+        const source = sourcePath;
+        const out = output;
+        proc.on("exit", (exitCode) => {
+            if (stderr) {
+                this.emit("stderr", stderr.split(root).join(""));
+            }
+            const files: ExitEventFile[] = [];
+            try {
+                if (exitCode === 0) {
+                    files.push({ path: out, mapped: inCwd(out) });
+                    if (depFile) {
+                        const mapped = inCwd(depFile);
+                        fs.writeFileSync(mapped, fs.readFileSync(mapped, "utf8").split(root).join(""));
+                        files.push({ path: depFile, mapped });
+                    }
+                    for (const ext of [".dwo", ".gcno"]) {
+                        const file = out.substring(0, out.length - path.extname(out).length) + ext;
+                        if (fs.existsSync(inCwd(file))) {
+                            files.push({ path: file, mapped: inCwd(file) });
+                        }
+                    }
+                }
+            } catch (err: unknown) {
+                console.error("Got an error processing outputs for", source, err);
+                const errorExitEvent: ExitEvent = {
+                    exitCode: 110,
+                    files: [],
+                    error: (err as Error).toString(),
+                    sourcePath: source
+                };
+                this.emit("exit", errorExitEvent);
+                return;
+            }
+            const exitEvent: ExitEvent = { exitCode: exitCode === null ? 111 : exitCode, files, sourcePath: source };
+            this.emit("exit", exitEvent);
+        });
+        return proc;
+    }
+
     kill(): void {
         this.proc.kill();
     }
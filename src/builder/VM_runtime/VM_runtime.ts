@@ -157,7 +157,7 @@ process.on("message", (msg) => {
                 if (argv.debug) {
                     console.log("Creating new compile", msg.commandLine, msg.argv0, msg.dir);
                 }
-                const compile = new Compile(msg.commandLine, msg.argv0, msg.dir, argv.debug);
+                const compile = new Compile(msg.commandLine, msg.argv0, msg.dir, argv.debug, msg.pump);
                 // console.log("running thing", msg.commandLine);
                 compile.on("stdout", (data) => {
                     send({ type: "compileStdOut", id: msg.id, data: data });
@@ -1,11 +1,13 @@
 #!/usr/bin/env node
 
 import { Client } from "./Client";
+import { HeaderCache } from "./HeaderCache";
 import { ObjectCache } from "./ObjectCache";
-import { Server } from "./Server";
+import { Server, supportsZstd } from "./Server";
 import { VM } from "./VM";
 import { common as commonFunc } from "../common";
 import { default as createOptions } from "@jhanssen/options";
+import { dwarfPatch } from "./DwarfPatch";
 import { load } from "./load";
 import { quitOnError } from "./quitOnError";
 import Url from "url-parse";
@@ -40,6 +42,8 @@ Options:
   --object-cache-size=SIZE     Object cache size (e.g. "10gb")
   --object-cache-dir=PATH      Object cache directory
   --object-cache-purge-size=N  Size to purge cache down to
+  --header-cache-size=SIZE     Size of the cache for uploaded headers and segments (default: 1gb, 0 disables both)
+  --header-cache-dir=PATH      Header cache directory
   --restart-on-new-environments  Restart when new environments arrive
   --name=NAME                  Builder name
   --hostname=HOST              Builder hostname (default: os.hostname())
@@ -92,6 +96,11 @@ let debug = option("debug");
 let objectCache: ObjectCache | undefined;
 let fetchSequence = 0;
 
+const headerCacheSize = bytes.parse(String(option("header-cache-size", "1gb"))) || 0;
+const headerCache: HeaderCache | undefined = headerCacheSize
+    ? new HeaderCache(option.string("header-cache-dir") || path.join(common.cacheDir(), "headers"), headerCacheSize)
+    : undefined;
+
 function getFromCache(job: Job, cb: (err?: Error) => void): boolean {
     // console.log("got job", job.sha1, objectCache ? objectCache.state(job.sha1) : false);
     // if (objectCache)
@@ -722,6 +731,14 @@ server.on("headers", (headers, req) => {
         wait = idx >= client.slots;
     }
     headers.push(`x-fisk-wait: ${wait}`);
+    headers.push("x-fisk-stream-upload: true");
+    if (supportsZstd) {
+        headers.push("x-fisk-zstd: true");
+    }
+    if (headerCache) {
+        headers.push("x-fisk-pump: true");
+        headers.push("x-fisk-segments: true");
+    }
 });
 
 server.on("listen", (app: express.Express) => {
@@ -879,7 +896,7 @@ server.on("job", (job: Job) => {
             console.log("Starting job", j.id, jobJob.sourcePath, "for", jobJob.ip, jobJob.name, "wait", jobJob.wait);
             assert(jobJob.commandLine, "Must have commandLine");
             assert(jobJob.argv0, "Must have argv0");
-            j.op = vm.startCompile(jobJob.commandLine, jobJob.argv0, jobJob.id);
+            j.op = vm.startCompile(jobJob.commandLine, jobJob.argv0, jobJob.id, jobJob.pump, headerCache);
             if (j.buffer) {
                 j.op.feed(j.buffer);
                 j.buffer = undefined;
@@ -985,7 +1002,11 @@ server.on("job", (job: Job) => {
                             return {
                                 path: item.path,
                                 bytes: item.contents.length, // Compressed size
-                                uncompressedSize: item.uncompressed.byteLength
+                                uncompressedSize: item.uncompressed.byteLength,
+                                // Lets clients with a different source path patch the debug info as it streams in
+                                dwarf: /\.(o|dwo)$/.exec(item.path)
+                                    ? dwarfPatch(item.uncompressed, jobJob.sourcePath)
+                                    : undefined
                             };
                         })
                     };
@@ -1032,6 +1053,18 @@ server.on("job", (job: Job) => {
         }
     };
 
+    const cached = job.pump ? job.pump.files : job.segments;
+    if (cached) {
+        if (!headerCache) {
+            console.error("Got a pump or segmented job without a header cache", job.id, job.ip, job.name);
+            job.close();
+            return;
+        }
+        // The client waits for this before uploading anything
+        j.need = headerCache.acquire(cached);
+        job.send("need", { hashes: j.need });
+    }
+
     j.heartbeatTimer = setInterval(() => {
         if (j.done || j.aborted || job.readyState !== ws.OPEN) {
             clearTimeout(j.heartbeatTimer);
@@ -1049,6 +1082,9 @@ server.on("job", (job: Job) => {
     job.on("close", () => {
         job.removeAllListeners();
         j.done = true;
+        if (headerCache && cached && j.need) {
+            headerCache.release(cached);
+        }
         const idx = jobQueue.indexOf(j);
         if (idx !== -1) {
             j.aborted = true;
@@ -1064,11 +1100,31 @@ server.on("job", (job: Job) => {
     job.on("data", (data) => {
         // console.log("got data", this.id, typeof j.op);
         uploadDuration = Date.now() - jobStartTime;
+        let buffer: Buffer = data.data;
+        if (cached) {
+            assert(headerCache && j.need, "Must have headerCache");
+            const err = headerCache.receive(cached, j.need, buffer);
+            if (err) {
+                console.error("Bad upload from", job.ip, job.name, err);
+                job.close();
+                return;
+            }
+            if (job.segments) {
+                // Compiled like any other preprocessed upload from here
+                try {
+                    buffer = headerCache.read(job.segments);
+                } catch (readErr: unknown) {
+                    console.error("Failed to put segments back together for", job.ip, job.name, readErr);
+                    job.close();
+                    return;
+                }
+            }
+        }
         if (!j.op) {
-            j.buffer = data.data;
-            console.log("buffering...", data.data.byteLength);
+            j.buffer = buffer;
+            console.log("buffering...", buffer.byteLength);
         } else {
-            j.op.feed(data.data);
+            j.op.feed(buffer);
         }
     });
 
@@ -1,5 +1,7 @@
 #include "BuilderWebSocket.h"
-#include "DwarfPatcher.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <functional>
 
 void BuilderWebSocket::onConnected()
 {
@@ -10,11 +12,7 @@ void BuilderWebSocket::onMessage(MessageType messageType, const void *bytes, siz
     Client::Data &data = Client::data();
     DEBUG("Got message %s %zu bytes", messageType == WebSocket::Text ? "text" : "binary", len);
 
-    if (messageType == WebSocket::Binary) {
-        handleFileContents(bytes, len);
-        return;
-    }
-
+    assert(messageType == WebSocket::Text);
     WARN("Got message from builder %s %s", url().c_str(), std::string(reinterpret_cast<const char *>(bytes), len).c_str());
     const std::string rawMsg(reinterpret_cast<const char *>(bytes), len);
     nlohmann::json msg = nlohmann::json::parse(rawMsg, nullptr, false, true);
@@ -41,6 +39,19 @@ void BuilderWebSocket::onMessage(MessageType messageType, const void *bytes, siz
         return;
     }
 
+    if (type == "need") {
+        const auto &hashes = msg["hashes"];
+        if (hashes.is_array()) {
+            for (const auto &hash : hashes) {
+                if (hash.is_string())
+                    need.push_back(hash.get<std::string>());
+            }
+        }
+        needReceived = true;
+        DEBUG("Builder needs %zu files or segments", need.size());
+        return;
+    }
+
     if (type == "heartbeat") {
         DEBUG("Got a heartbeat.");
         data.watchdog->heartbeat();
@@ -61,8 +72,11 @@ void BuilderWebSocket::onMessage(MessageType messageType, const void *bytes, siz
         const nlohmann::json &index = msg["index"];
         const bool hasIndex = index.is_array();
         data.exitCode = jint(msg["exitCode"]);
-        const std::string stdOut = jstring(msg["stdout"]);
-        const std::string stdErr = jstring(msg["stderr"]);
+        output.exitCode = data.exitCode;
+        output.stdOut = jstring(msg["stdout"]);
+        output.stdErr = jstring(msg["stderr"]);
+        const std::string &stdOut = output.stdOut;
+        const std::string &stdErr = output.stdErr;
 
         if (data.exitCode) {
             std::string uncolored;
@@ -100,7 +114,7 @@ void BuilderWebSocket::onMessage(MessageType messageType, const void *bytes, siz
             fprintf(stderr, "error: exit code: %d Fisk builder: %s source file: %s cache: %s fisk-version: %s\n%s\n", data.exitCode, url().c_str(), data.compilerArgs->sourceFile().c_str(), data.objectCache ? "true" : "false", npm_version, str.c_str());
         }
 
-        if (!data.preprocessed->stdErr.empty()) {
+        if (data.preprocessed && !data.preprocessed->stdErr.empty()) {
             if (Client::data().builderHasJSONDiagnostics) {
                 const std::string formatted = Client::formatJSONDiagnostics(data.preprocessed->stdErr);
                 if (!formatted.empty()) {
@@ -137,6 +151,9 @@ void BuilderWebSocket::onMessage(MessageType messageType, const void *bytes, siz
                 File ff;
                 ff.path = jstring(index[i]["path"]);
                 ff.size = jint(index[i]["bytes"]);
+                ff.uncompressedSize = index[i].contains("uncompressedSize") ? jint(index[i]["uncompressedSize"]) : ff.size;
+                if (index[i].contains("dwarf"))
+                    ff.dwarf = index[i]["dwarf"];
                 Client::data().totalWritten += ff.size;
                 if (ff.path.empty()) {
                     ERROR("No file for idx: %zu", i);
@@ -145,6 +162,7 @@ void BuilderWebSocket::onMessage(MessageType messageType, const void *bytes, siz
                     done = true;
                     return;
                 }
+                output.files.push_back(ff.path);
                 if (!ff.size) {
                     FILE *f = fopen(ff.path.c_str(), "w");
                     DEBUG("Opened file [%s] -> [%s] -> %p", ff.path.c_str(), Client::realpath(ff.path).c_str(), f);
@@ -178,55 +196,220 @@ bool BuilderWebSocket::connectFinished()
     return state() == WebSocket::ConnectedWebSocket;
 }
 
-void BuilderWebSocket::handleFileContents(const void *data, size_t len)
+void BuilderWebSocket::onMessageBegin(MessageType messageType, size_t len)
 {
+    if (messageType == WebSocket::Text) {
+        WebSocket::onMessageBegin(messageType, len);
+        return;
+    }
+
     Client::Data &clientData = Client::data();
     DEBUG("Got binary data: %zu bytes", len);
+    mReceivingFile = true;
+    mReceived = 0;
+    mStreamEnd = false;
+    if (done)
+        return;
     if (files.empty()) {
         ERROR("Unexpected binary data (%zu bytes) from builder %s while compiling %s - no files expected", len, url().c_str(), clientData.compilerArgs ? clientData.compilerArgs->sourceFile().c_str() : "unknown");
-        clientData.watchdog->stop();
-        error = "builder protocol error 2";
-        done = true;
+        fileError("builder protocol error 2");
         return;
     }
-    File &front = files.front();
-    if (len != front.size) {
+    const File &front = files.front();
+    if (len > front.size) {
         ERROR("File size mismatch from builder %s for output file %s: expected %zu bytes, got %zu bytes (source: %s)", url().c_str(), front.path.c_str(), front.size, len, clientData.compilerArgs ? clientData.compilerArgs->sourceFile().c_str() : "unknown");
-        clientData.watchdog->stop();
-        error = "builder file data error";
-        done = true;
+        fileError("builder file data error");
         return;
     }
 
-    FILE *f = fopen(front.path.c_str(), "w");
-    DEBUG("Opened file [%s] -> [%s] -> %p", front.path.c_str(), Client::realpath(front.path).c_str(), f);
-    if (!f) {
+    mFile = fopen(front.path.c_str(), "w");
+    DEBUG("Opened file [%s] -> [%s] -> %p", front.path.c_str(), Client::realpath(front.path).c_str(), mFile);
+    if (!mFile) {
         ERROR("Failed to open output file for writing: %s (%d %s) - builder: %s, source: %s", front.path.c_str(), errno, strerror(errno), url().c_str(), clientData.compilerArgs ? clientData.compilerArgs->sourceFile().c_str() : "unknown");
-        clientData.watchdog->stop();
-        error = "builder file open error";
-        done = true;
+        fileError("builder file open error");
         return;
     }
+    mWritten = 0;
+    mPending.clear();
+    mMappedRoot.clear();
+    if (clientData.compilerArgs && !clientData.compilerArgs->sourceRoot.empty()) {
+        const std::string &root = clientData.compilerArgs->sourceRoot;
+        mMappedRoot.assign(CompilerArgs::canonicalRoot().size() - root.size(), '/');
+        mMappedRoot += root;
+    }
+    mPatching = needsDwarfPatch(front) && mDwarf.init(front.dwarf, front.uncompressedSize, cachedSourcePath, clientData.compilerArgs->sourceFile());
+#ifdef __linux__
+    // Reserve the blocks up front without changing the file size
+    if (front.uncompressedSize && fallocate(fileno(mFile), FALLOC_FL_KEEP_SIZE, 0, front.uncompressedSize))
+        DEBUG("Failed to fallocate %zu bytes for %s (%d %s)", front.uncompressedSize, front.path.c_str(), errno, strerror(errno));
+#endif
 
-    bool ok;
     if (Config::compress) {
-        ok = Client::uncompressToFile(front.path, f, data, len);
-    } else {
-        ok = fwrite(data, 1, len, f) == len;
-    }
-    fclose(f);
-    if (!ok) {
-        ERROR("Failed to write to output file: %s (%d %s) - builder: %s, source: %s", front.path.c_str(), errno, strerror(errno), url().c_str(), clientData.compilerArgs ? clientData.compilerArgs->sourceFile().c_str() : "unknown");
-        clientData.watchdog->stop();
-        error = "builder file write error";
-        done = true;
+        memset(&mInflate, 0, sizeof(mInflate));
+        const int ret = inflateInit2(&mInflate, MAX_WBITS + 16);
+        if (ret != Z_OK) {
+            ERROR("Failed to inflateInit2 -> %d", ret);
+            fileError("builder file write error");
+            return;
+        }
+        mInflating = true;
+    }
+}
+
+void BuilderWebSocket::onMessageData(const void *data, size_t len)
+{
+    if (!mReceivingFile) {
+        WebSocket::onMessageData(data, len);
+        return;
+    }
+    if (!mFile)
+        return;
+
+    mReceived += len;
+    if (mReceived > files.front().size) {
+        ERROR("File size mismatch from builder %s for output file %s: expected %zu bytes, got at least %zu bytes", url().c_str(), files.front().path.c_str(), files.front().size, mReceived);
+        fileError("builder file data error");
         return;
     }
 
-    if (!cachedSourcePath.empty() && clientData.compilerArgs && (Client::endsWith(front.path, ".o") || Client::endsWith(front.path, ".dwo")) && cachedSourcePath != clientData.compilerArgs->sourceFile()) {
+    if (!writeFile(data, len)) {
+        ERROR("Failed to write to output file: %s (%d %s) - builder: %s", files.front().path.c_str(), errno, strerror(errno), url().c_str());
+        fileError("builder file write error");
+    }
+}
+
+void BuilderWebSocket::onMessageEnd()
+{
+    if (!mReceivingFile) {
+        WebSocket::onMessageEnd();
+        return;
+    }
+    mReceivingFile = false;
+    if (!mFile)
+        return;
+
+    Client::Data &clientData = Client::data();
+    const File &front = files.front();
+    if (mReceived != front.size || (mInflating && !mStreamEnd)) {
+        ERROR("File size mismatch from builder %s for output file %s: expected %zu bytes, got %zu bytes (source: %s)", url().c_str(), front.path.c_str(), front.size, mReceived, clientData.compilerArgs ? clientData.compilerArgs->sourceFile().c_str() : "unknown");
+        fileError("builder file data error");
+        return;
+    }
+    if (!mPending.empty() && !writePatched(mPending.data(), mPending.size())) {
+        ERROR("Failed to write to output file: %s (%d %s) - builder: %s", front.path.c_str(), errno, strerror(errno), url().c_str());
+        fileError("builder file write error");
+        return;
+    }
+    if (mPatching) {
+        const std::string &tail = mDwarf.tail();
+        if (mWritten != front.uncompressedSize) {
+            ERROR("Wrote %zu bytes to %s, expected %zu, can't patch its debug info", mWritten, front.path.c_str(), front.uncompressedSize);
+            fileError("builder file data error");
+            return;
+        }
+        if (!tail.empty() && fwrite(tail.data(), 1, tail.size(), mFile) != tail.size()) {
+            ERROR("Failed to write to output file: %s (%d %s) - builder: %s", front.path.c_str(), errno, strerror(errno), url().c_str());
+            fileError("builder file write error");
+            return;
+        }
+    }
+    closeFile();
+
+    if (!mPatching && needsDwarfPatch(front)) {
         patchDwarfSourcePath(front.path, cachedSourcePath, clientData.compilerArgs->sourceFile());
     }
 
     files.erase(files.begin());
     done = files.empty();
 }
+
+bool BuilderWebSocket::needsDwarfPatch(const File &file) const
+{
+    const Client::Data &data = Client::data();
+    // With --prefix-map the paths never contained the builder's source root
+    return !cachedSourcePath.empty() && data.compilerArgs && data.compilerArgs->sourceRoot.empty() && (Client::endsWith(file.path, ".o") || Client::endsWith(file.path, ".dwo")) && cachedSourcePath != data.compilerArgs->sourceFile();
+}
+
+bool BuilderWebSocket::writeOutput(const void *data, size_t len)
+{
+    if (mMappedRoot.empty())
+        return writePatched(data, len);
+
+    // The replacement has the same length so nothing moves, the stream
+    // patcher and the size checks see the offsets they expect
+    const std::string &canonical = CompilerArgs::canonicalRoot();
+    mPending.append(static_cast<const char *>(data), len);
+    const std::boyer_moore_horspool_searcher<std::string::const_iterator> searcher(canonical.begin(), canonical.end());
+    auto it = mPending.begin();
+    while ((it = std::search(it, mPending.end(), searcher)) != mPending.end()) {
+        it = std::copy(mMappedRoot.begin(), mMappedRoot.end(), it);
+    }
+    if (mPending.size() < canonical.size())
+        return true;
+    const size_t flush = mPending.size() - canonical.size() + 1;
+    if (!writePatched(mPending.data(), flush))
+        return false;
+    mPending.erase(0, flush);
+    return true;
+}
+
+bool BuilderWebSocket::writePatched(const void *data, size_t len)
+{
+    if (mPatching)
+        data = mDwarf.patch(data, len, mWritten);
+    mWritten += len;
+    return fwrite(data, 1, len, mFile) == len;
+}
+
+bool BuilderWebSocket::writeFile(const void *data, size_t len)
+{
+    if (!mInflating)
+        return writeOutput(data, len);
+
+    mInflate.next_in = static_cast<const Bytef *>(data);
+    mInflate.avail_in = static_cast<uInt>(len);
+    unsigned char buffer[65536];
+    while (mInflate.avail_in) {
+        if (mStreamEnd) {
+            // another gzip member
+            inflateReset(&mInflate);
+            mStreamEnd = false;
+        }
+        mInflate.next_out = buffer;
+        mInflate.avail_out = sizeof(buffer);
+        const int ret = ::inflate(&mInflate, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            ERROR("uncompress failed (input %zu bytes): %d %s", len, ret, zError(ret));
+            return false;
+        }
+        const size_t produced = sizeof(buffer) - mInflate.avail_out;
+        if (produced && !writeOutput(buffer, produced))
+            return false;
+        if (ret == Z_STREAM_END) {
+            mStreamEnd = true;
+        } else if (!produced && ret == Z_BUF_ERROR) {
+            break;
+        }
+    }
+    return true;
+}
+
+void BuilderWebSocket::closeFile()
+{
+    if (mInflating) {
+        inflateEnd(&mInflate);
+        mInflating = false;
+    }
+    if (mFile) {
+        fclose(mFile);
+        mFile = nullptr;
+    }
+}
+
+void BuilderWebSocket::fileError(const char *reason)
+{
+    closeFile();
+    Client::data().watchdog->stop();
+    error = reason;
+    done = true;
+}
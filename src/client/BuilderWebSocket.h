@@ -2,10 +2,16 @@
 #define BUILDERWEBSOCKET_H
 
 #include "Client.h"
+#include "DwarfPatcher.h"
+#include "LocalCache.h"
 #include "Preprocessed.h"
 #include "Watchdog.h"
 #include "WebSocket.h"
 #include <string>
+#ifndef ZLIB_CONST
+#define ZLIB_CONST
+#endif
+#include <zlib.h>
 
 extern "C" const char *npm_version;
 
@@ -15,19 +21,56 @@ public:
     virtual void onConnected() override;
     virtual void onMessage(MessageType messageType, const void *bytes, size_t len) override;
     virtual bool connectFinished() override;
-    void handleFileContents(const void *data, size_t len);
 
     struct File
     {
         std::string path;
         size_t size;
+        size_t uncompressedSize;
+        // Where to patch the debug info of an object cache hit, see DwarfStreamPatcher
+        nlohmann::json dwarf;
     };
 
     bool wait { false };
+    // Pump mode and segmented uploads, the hashes the builder doesn't have yet
+    bool needReceived { false };
+    std::vector<std::string> need;
     std::vector<File> files;
     bool done { false };
     std::string error;
     std::string cachedSourcePath;
+    // What the builder sent, kept for the local cache
+    LocalCache::Entry output;
+
+protected:
+    // Binary messages are written to the output file as they arrive
+    virtual void onMessageBegin(MessageType messageType, size_t len) override;
+    virtual void onMessageData(const void *data, size_t len) override;
+    virtual void onMessageEnd() override;
+
+private:
+    void fileError(const char *reason);
+    void closeFile();
+    bool writeFile(const void *data, size_t len);
+    bool writeOutput(const void *data, size_t len);
+    bool writePatched(const void *data, size_t len);
+    bool needsDwarfPatch(const File &file) const;
+
+    bool mReceivingFile { false };
+    bool mInflating { false };
+    bool mStreamEnd { false };
+    FILE *mFile { nullptr };
+    size_t mReceived { 0 };
+    // Uncompressed bytes written to mFile
+    size_t mWritten { 0 };
+    bool mPatching { false };
+    DwarfStreamPatcher mDwarf;
+    // With --prefix-map, what CompilerArgs::canonicalRoot() is turned back
+    // into. The last canonicalRoot().size() - 1 bytes are held back in
+    // mPending in case a match straddles two chunks.
+    std::string mMappedRoot;
+    std::string mPending;
+    z_stream mInflate;
 };
 
 #endif /* BUILDERWEBSOCKET_H */
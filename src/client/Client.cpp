@@ -15,7 +15,9 @@
 #include <sys/inotify.h>
 #endif
 #include <ifaddrs.h>
+#include <poll.h>
 #include <process.hpp>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #ifdef __APPLE__
@@ -24,8 +26,7 @@
 #include <mach/mach_time.h>
 #endif
 
-#define ZLIB_CONST
-#include <zlib.h>
+extern char **environ;
 
 #ifdef __APPLE__
 static const char *systemName = "Darwin x86_64";
@@ -49,6 +50,22 @@ Client::Data::Data()
 #endif
 }
 
+bool Client::Data::initHash(const std::string &algorithm)
+{
+    // The scheduler checks the key length for these and rejects anything else
+    if (algorithm != "sha1" && algorithm != "blake2s256" && algorithm != "blake2b512")
+        return false;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    const EVP_MD *hashptr = EVP_get_digestbyname(algorithm.c_str());
+    if (!hashptr)
+        return false;
+    EVP_DigestInit_ex(sha1Context, hashptr, nullptr);
+    return true;
+#else
+    return !strcasecmp(algorithm.c_str(), "sha1");
+#endif
+}
+
 Client::Data::~Data()
 {
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
@@ -706,6 +723,9 @@ void Client::writeStatistics()
         stats["command_line"] = data.originalArgs;
     }
     stats["object_cache"] = data.objectCache;
+    stats["local_cache"] = data.localCache;
+    stats["direct_mode"] = data.directMode;
+    stats["pump"] = data.pump;
     if (data.preprocessed) {
         stats["cpp_size"] = static_cast<int>(data.preprocessed->cppSize);
         stats["cpp_time"] = static_cast<int>(data.preprocessed->duration);
@@ -855,69 +875,194 @@ const char *Client::compilerTypeToString(CompilerType type)
     return "";
 }
 
-std::string Client::realpath(const std::string &path)
+void Client::runSplit(const std::vector<std::string> &sources)
 {
-    char buf[PATH_MAX + 1];
-    if (::realpath(path.c_str(), buf)) {
-        return buf;
+    const Client::Data &data = Client::data();
+    DEBUG("Splitting %s into %zu jobs", argsAsString().c_str(), sources.size());
+
+    enum
+    {
+        Increment = 75000
+    };
+
+    // argv[0] is usually a symlink named after the compiler, it has to be
+    // passed on as is but the binary is us either way
+#ifdef __APPLE__
+    char self[PATH_MAX];
+    uint32_t selfSize = sizeof(self);
+    if (_NSGetExecutablePath(self, &selfSize))
+        runLocal("split failure");
+#else
+    const char *self = "/proc/self/exe";
+#endif
+
+    std::vector<pid_t> pids;
+    for (const std::string &source : sources) {
+        // Our own options are still in originalArgs so every job is set up
+        // the same way
+        std::vector<char *> argv;
+        argv.push_back(const_cast<char *>(data.originalArgs[0].c_str()));
+        for (size_t i = 1; i < data.originalArgs.size(); ++i) {
+            const std::string &arg = data.originalArgs[i];
+            if (arg == source || std::find(sources.begin(), sources.end(), arg) == sources.end())
+                argv.push_back(const_cast<char *>(arg.c_str()));
+        }
+        argv.push_back(nullptr);
+
+        pid_t pid;
+        size_t micros = 0;
+        int ret;
+        while ((ret = posix_spawn(&pid, self, nullptr, nullptr, argv.data(), environ)) == EAGAIN) {
+            if (micros < Increment * 10)
+                micros += Increment;
+            ERROR("Spawn failed (%s) again errno: %d %s. Trying again... in %zums", source.c_str(), ret, strerror(ret), micros / 1000);
+            usleep(static_cast<unsigned int>(micros));
+        }
+        if (ret) {
+            ERROR("Failed to spawn job for %s: %d %s", source.c_str(), ret, strerror(ret));
+            // Compiling everything again is wasteful but gets the right result
+            for (pid_t p : pids) {
+                int status;
+                EINTRWRAP(ret, waitpid(p, &status, 0));
+            }
+            runLocal("split failure");
+        }
+        pids.push_back(pid);
     }
-    return std::string();
+
+    int exitCode = 0;
+    for (pid_t pid : pids) {
+        int ret, status;
+        EINTRWRAP(ret, waitpid(pid, &status, 0));
+        if (!exitCode && (ret == -1 || !WIFEXITED(status) || WEXITSTATUS(status)))
+            exitCode = ret != -1 && WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+    }
+    _exit(exitCode);
 }
 
-std::string Client::cwd()
+enum
 {
-    char buf[PATH_MAX];
-    const char *ret = getcwd(buf, sizeof(buf));
-    return ret ? std::string(ret) : std::string();
-}
+    // Linux lets anyone grow a pipe to 1MB (/proc/sys/fs/pipe-max-size), the
+    // default 64KB has the preprocessor stalling on every few writes
+    PipeSize = 1024 * 1024
+};
 
-bool Client::uncompressToFile(const std::string &fileName, FILE *f, const void *bytes, size_t len)
+// Other threads may be spawning too, only the dup2'ed copies should survive
+// the exec
+static bool cloexecPipe(int fds[2])
 {
-    DEBUG("Uncompressing %zu bytes to file %s", len, fileName.c_str());
-    z_stream zctx;
-    zctx.zalloc = nullptr;
-    zctx.zfree = nullptr;
-    zctx.opaque = nullptr;
-    zctx.avail_in = 0;
-    zctx.next_in = nullptr;
-    int ret = inflateInit2(&zctx, MAX_WBITS + 16);
-    if (ret != Z_OK) {
-        ERROR("Failed to inflateInit2 -> %d", ret);
+#ifdef __APPLE__
+    if (pipe(fds))
         return false;
-    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#else
+    return !pipe2(fds, O_CLOEXEC);
+#endif
+}
 
-    zctx.next_in = static_cast<const Bytef *>(bytes);
-    zctx.avail_in = static_cast<uint32_t>(len);
+int Client::spawn(const std::vector<std::string> &arguments, std::vector<unsigned char> &out, const std::function<void(size_t)> &onOut, std::string &err)
+{
+    int outPipe[2];
+    int errPipe[2];
+    if (!cloexecPipe(outPipe)) {
+        ERROR("Failed to create pipe %d %s", errno, strerror(errno));
+        return -1;
+    }
+    if (!cloexecPipe(errPipe)) {
+        ERROR("Failed to create pipe %d %s", errno, strerror(errno));
+        ::close(outPipe[0]);
+        ::close(outPipe[1]);
+        return -1;
+    }
+#ifdef F_SETPIPE_SZ
+    // Fails above the limit, the default size works too
+    fcntl(outPipe[1], F_SETPIPE_SZ, static_cast<int>(PipeSize));
+#endif
 
-    // temporary buffer for deflated data
-    unsigned char buffer[16384];
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+    std::vector<char *> argv;
+    argv.reserve(arguments.size() + 1);
+    for (const std::string &arg : arguments)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(nullptr);
+    pid_t pid;
+    const int spawned = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    ::close(outPipe[1]);
+    ::close(errPipe[1]);
+    if (spawned) {
+        ERROR("Failed to spawn %s %d %s", argv[0], spawned, strerror(spawned));
+        ::close(outPipe[0]);
+        ::close(errPipe[0]);
+        return -1;
+    }
 
-    int zerr = 0;
-    do {
-        // point context at the output buffer
-        zctx.next_out = buffer;
-        zctx.avail_out = sizeof(buffer);
-
-        zerr = ::inflate(&zctx, Z_SYNC_FLUSH);
-        if ((zerr != Z_OK) && (zerr != Z_STREAM_END)) {
-            inflateEnd(&zctx); // don't leak the context memory
-            ERROR("uncompress failed (input %zu bytes): %d %s", len, zerr, zError(zerr));
-            return false;
+    // Reads usually come back with a lot less than PipeSize, resizing out up
+    // front would zero fill all of it every time
+    std::unique_ptr<unsigned char[]> buffer(new unsigned char[PipeSize]);
+    pollfd fds[2] = { { outPipe[0], POLLIN, 0 }, { errPipe[0], POLLIN, 0 } };
+    while (fds[0].fd != -1 || fds[1].fd != -1) {
+        int ret;
+        EINTRWRAP(ret, poll(fds, 2, -1));
+        if (ret == -1) {
+            ERROR("Failed to poll output of %s %d %s", argv[0], errno, strerror(errno));
+            break;
         }
-
-        // output processed data to dst std::string
-        const size_t processed = sizeof(buffer) - zctx.avail_out;
-        if (fwrite(buffer, 1, processed, f) != processed) {
-            ERROR("Failed to write to file %d %s", errno, strerror(errno));
-            inflateEnd(&zctx); // don't leak the context memory
-            return false;
+        if (fds[0].revents) {
+            ssize_t r;
+            EINTRWRAP(r, ::read(fds[0].fd, buffer.get(), PipeSize));
+            if (r > 0) {
+                const size_t offset = out.size();
+                out.insert(out.end(), buffer.get(), buffer.get() + r);
+                onOut(offset);
+            } else {
+                ::close(fds[0].fd);
+                fds[0].fd = -1;
+            }
         }
-    } while (zerr != Z_STREAM_END);
+        if (fds[1].revents) {
+            char buf[16384];
+            ssize_t r;
+            EINTRWRAP(r, ::read(fds[1].fd, buf, sizeof(buf)));
+            if (r > 0) {
+                err.append(buf, r);
+            } else {
+                ::close(fds[1].fd);
+                fds[1].fd = -1;
+            }
+        }
+    }
+    for (const pollfd &fd : fds) {
+        if (fd.fd != -1)
+            ::close(fd.fd);
+    }
 
-    // free context memory
-    inflateEnd(&zctx);
+    int status, ret;
+    EINTRWRAP(ret, waitpid(pid, &status, 0));
+    if (ret == -1 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
 
-    return true;
+std::string Client::realpath(const std::string &path)
+{
+    char buf[PATH_MAX + 1];
+    if (::realpath(path.c_str(), buf)) {
+        return buf;
+    }
+    return std::string();
+}
+
+std::string Client::cwd()
+{
+    char buf[PATH_MAX];
+    const char *ret = getcwd(buf, sizeof(buf));
+    return ret ? std::string(ret) : std::string();
 }
 
 void Client::checkInterfaces()
@@ -1308,8 +1453,10 @@ int Client::dumpSha1()
         }
         data.hash = info.hash;
         data.compilerArgs = CompilerArgs::create(std::move(args), &data.localReason);
-        if (data.compilerArgs)
-            data.compilerArgs->finalize(info);
+        if (data.compilerArgs && !data.compilerArgs->finalize(info)) {
+            data.localReason = CompilerArgs::Local_NativeArch;
+            data.compilerArgs.reset();
+        }
     }
     if (!data.compilerArgs) {
         ERROR("compiler args parse failure: %s", CompilerArgs::localReasonToString(data.localReason));
@@ -1319,9 +1466,9 @@ int Client::dumpSha1()
     data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, nullptr, nullptr);
     assert(data.preprocessed);
     data.preprocessed->wait();
-    unsigned char sha1Buf[SHA_DIGEST_LENGTH];
-    Client::data().sha1Final(sha1Buf);
-    std::string sha1 = Client::toHex(sha1Buf, sizeof(sha1Buf));
+    unsigned char sha1Buf[EVP_MAX_MD_SIZE];
+    const size_t sha1Len = Client::data().sha1Final(sha1Buf);
+    std::string sha1 = Client::toHex(sha1Buf, sha1Len);
     printf("%s\n", sha1.c_str());
     return 0;
 }
@@ -8,6 +8,7 @@
 #include <condition_variable>
 #include <cstdarg>
 #include <fcntl.h>
+#include <functional>
 #include <memory>
 #include <mutex>
 #ifdef __clang__
@@ -56,6 +57,9 @@ struct Data
     std::string builderIp, builderHostname;
     std::string hash;
     bool objectCache { false };
+    bool localCache { false };
+    bool directMode { false };
+    bool pump { false };
     int exitCode { 0 };
     size_t totalWritten { 0 };
     bool builderHasJSONDiagnostics { false };
@@ -76,6 +80,9 @@ struct Data
 
     std::unordered_map<std::string, CachedFile> fileCache;
 
+    // Addresses the daemon already resolved, consumed by WebSocket::connect
+    std::unordered_map<std::string, std::string> hostAddresses;
+
     std::string commandLineAsString() const;
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
@@ -93,13 +100,39 @@ struct Data
 #endif
     }
 
-    void sha1Final(void *buf)
+    // Selects the digest used by sha1Update/sha1Final, SHA1 unless told
+    // otherwise. Only sha1, blake2s256 and blake2b512, the ones the scheduler
+    // knows. Has to be called before anything is hashed.
+    bool initHash(const std::string &algorithm);
+
+    // Digest of what has been hashed so far, hashing can go on afterwards.
+    // buf must hold at least EVP_MAX_MD_SIZE bytes, returns the digest size
+    size_t sha1Peek(void *buf) const
+    {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+        unsigned int len = 0;
+        EVP_MD_CTX *copy = EVP_MD_CTX_new();
+        if (EVP_MD_CTX_copy_ex(copy, sha1Context))
+            EVP_DigestFinal_ex(copy, reinterpret_cast<unsigned char *>(buf), &len);
+        EVP_MD_CTX_free(copy);
+        return len;
+#else
+        SHAstate_st copy = sha1;
+        SHA1_Final(reinterpret_cast<unsigned char *>(buf), &copy);
+        return SHA_DIGEST_LENGTH;
+#endif
+    }
+
+    // buf must hold at least EVP_MAX_MD_SIZE bytes, returns the digest size
+    size_t sha1Final(void *buf)
     {
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
         unsigned int len;
         EVP_DigestFinal_ex(sha1Context, reinterpret_cast<unsigned char *>(buf), &len);
+        return len;
 #else
         SHA1_Final(reinterpret_cast<unsigned char *>(buf), &sha1);
+        return SHA_DIGEST_LENGTH;
 #endif
     }
 };
@@ -122,13 +155,19 @@ inline void parsePath(const std::string &path, std::string *basename, std::strin
 
 void writeStatistics();
 [[noreturn]] void runLocal(const std::string &reason);
+// Runs fiskc once per source with the others left out and exits with the
+// first failure
+[[noreturn]] void runSplit(const std::vector<std::string> &sources);
+// Runs arguments[0] from PATH without a shell in between. stdout is appended
+// to out in pieces, onOut gets the offset where each piece starts. Returns the
+// exit status or -1.
+int spawn(const std::vector<std::string> &arguments, std::vector<unsigned char> &out, const std::function<void(size_t)> &onOut, std::string &err);
 unsigned long long mono();
 bool setFlag(int fd, uint32_t flag);
 bool recursiveMkdir(const std::string &path, mode_t mode = S_IRWXU);
 bool recursiveRmdir(const std::string &path);
 std::string realpath(const std::string &path);
 std::string cwd();
-bool uncompressToFile(const std::string &fileName, FILE *f, const void *bytes, size_t len);
 void checkInterfaces();
 
 template <size_t StaticBufSize = 4096>
@@ -337,6 +376,10 @@ struct CompilerInfo
     std::string hash;
     std::string input;
     CompilerType type { CompilerType::Unknown };
+    // -march=native and friends spelled out for this machine, only if the
+    // daemon was asked and managed to
+    bool hasNative { false };
+    std::vector<std::string> native;
 
     struct Version
     {
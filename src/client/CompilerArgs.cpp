@@ -16,206 +16,439 @@
 #include "CompilerArgs.h"
 #include "Client.h"
 #include "Log.h"
+#include <algorithm>
 #include <string.h>
 
 enum OptionFlag
 {
     None = 0x0,
     Sha1 = 0x1,
-    SkipPreprocess = 0x2
+    SkipPreprocess = 0x2,
+    // Also matches with the operand glued on, like -I/usr/include or -Wl,-z
+    Prefix = 0x4,
+    // Changes where headers are found. The preprocessed output covers that
+    // but direct mode never looks at it
+    SearchPath = 0x8
+};
+
+// What create() does about an option beyond skipping and hashing its operands
+enum OptionKind
+{
+    Option_Generic,
+    Option_Local,
+    Option_Native,
+    Option_DashC,
+    Option_DashO,
+    Option_ProfileDir,
+    Option_Profiling,
+    Option_Assembler,
+    Option_Xclang,
+    Option_Arch,
+    Option_Language
 };
 
 struct OptionArg
 {
+    constexpr OptionArg(const char *n, size_t a, uint32_t f, OptionKind k = Option_Generic, uint32_t v = 0)
+        : name(n), args(a), flags(f), kind(k), value(v)
+    {
+    }
+
     const char *name;
     size_t args;
     uint32_t flags;
+    OptionKind kind;
+    // The LocalReason for Option_Local, otherwise CompilerArgs flags to set
+    uint32_t value;
+};
 
-    bool operator<(const OptionArg &other) const
-    {
-        return strcmp(name, other.name) < 0;
+static constexpr OptionArg argOptions[] = { { "-", 0, None, Option_Local, CompilerArgs::Local_StdinInput },
+                                            { "--CLASSPATH", 1, Sha1 },
+                                            { "--assert", 1, Sha1 },
+                                            { "--bootclasspath", 1, Sha1 },
+                                            { "--classpath", 1, Sha1 },
+                                            { "--config", 1, Sha1 },
+                                            { "--coverage", 0, Sha1 | SkipPreprocess },
+                                            { "--define-macro", 1, Sha1 },
+                                            { "--dyld-prefix", 1, Sha1 },
+                                            { "--encoding", 1, Sha1 },
+                                            { "--extdirs", 1, Sha1 },
+                                            { "--for-linker", 1, Sha1 | SkipPreprocess },
+                                            { "--force-link", 1, Sha1 | SkipPreprocess },
+                                            { "--include-directory", 1, None },
+                                            { "--include-directory-after", 1, None },
+                                            { "--include-prefix", 1, None },
+                                            { "--include-with-prefix", 1, None },
+                                            { "--include-with-prefix-after", 1, None },
+                                            { "--include-with-prefix-before", 1, None },
+                                            { "--language", 1, Sha1 },
+                                            { "--library-directory", 1, Sha1 },
+                                            { "--mhwdiv", 1, Sha1 },
+                                            { "--output", 1, Sha1 },
+                                            { "--output-class-directory", 1, Sha1 },
+                                            { "--param", 1, Sha1 },
+                                            { "--prefix", 1, Sha1 },
+                                            { "--print-file-name", 1, Sha1 },
+                                            { "--print-prog-name", 1, Sha1 },
+                                            { "--resource", 1, SearchPath },
+                                            { "--rtlib", 1, Sha1 },
+                                            { "--serialize-diagnostics", 1, None },
+                                            { "--std", 1, Sha1 },
+                                            { "--stdlib", 1, Sha1 },
+                                            { "--sysroot", 1, SearchPath },
+                                            { "--system-header-prefix", 1, Sha1 },
+                                            { "--undefine-macro", 1, Sha1 },
+                                            { "-B", 0, Prefix, Option_Local, CompilerArgs::Local_BinPath },
+                                            { "-E", 0, None, Option_Local, CompilerArgs::Local_Preprocess },
+                                            { "-F", 1, SearchPath },
+                                            { "-G", 1, Sha1 },
+                                            { "-I", 1, Prefix | SearchPath },
+                                            { "-L", 1, Sha1 | SkipPreprocess | Prefix },
+                                            { "-M", 0, None, Option_Local, CompilerArgs::Local_Preprocess },
+                                            { "-MD", 0, Sha1, Option_Generic, CompilerArgs::HasDashMD },
+                                            { "-MF", 1, Sha1, Option_Generic, CompilerArgs::HasDashMF },
+                                            { "-MM", 0, None, Option_Local, CompilerArgs::Local_Preprocess },
+                                            { "-MMD", 0, Sha1, Option_Generic, CompilerArgs::HasDashMMD },
+                                            { "-MQ", 1, Sha1 },
+                                            { "-MT", 1, Sha1, Option_Generic, CompilerArgs::HasDashMT },
+                                            { "-S", 0, None, Option_Local, CompilerArgs::Local_DoNotAssemble },
+                                            { "-Wa,", 0, Prefix, Option_Assembler },
+                                            { "-Wl,", 0, Sha1 | SkipPreprocess | Prefix },
+                                            { "-Xanalyzer", 1, Sha1 },
+                                            { "-Xarch_device", 1, Sha1 },
+                                            { "-Xarch_host", 1, Sha1 },
+                                            { "-Xassembler", 1, Sha1 },
+                                            { "-Xclang", 1, Sha1, Option_Xclang },
+                                            { "-Xclangas", 1, Sha1 },
+                                            { "-Xcuda-fatbinary", 1, Sha1 },
+                                            { "-Xcuda-ptxas", 1, Sha1 },
+                                            { "-Xlinker", 1, Sha1 | SkipPreprocess },
+                                            { "-Xopenmp-target", 1, Sha1 },
+                                            { "-Xpreprocessor", 1, Sha1 },
+                                            { "-alias_list", 1, None },
+                                            { "-allowable_client", 1, Sha1 },
+                                            { "-arch", 1, Sha1, Option_Arch },
+                                            { "-arch_only", 1, Sha1 },
+                                            { "-arcmt-migrate-report-output", 1, None },
+                                            { "-aux-info", 1, None },
+                                            { "-bundle_loader", 1, None },
+                                            { "-c", 0, Sha1 | SkipPreprocess, Option_DashC },
+                                            { "-client_name", 1, Sha1 },
+                                            { "-compatibility_version", 1, Sha1 },
+                                            { "-current_version", 1, Sha1 },
+                                            { "-cxx-isystem", 1, SearchPath },
+                                            { "-darwin-target-variant", 1, Sha1 },
+                                            { "-darwin-target-variant-triple", 1, Sha1 },
+                                            { "-dependency-dot", 1, None },
+                                            { "-dependency-file", 1, None },
+                                            { "-dumpbase", 1, None },
+                                            { "-dumpbase-ext", 1, Sha1 },
+                                            { "-dumpdir", 1, None },
+                                            { "-dylib_file", 1, None },
+                                            { "-dylinker_install_name", 1, None },
+                                            { "-exported_symbols_list", 1, None },
+                                            { "-fexec-charset", 0, None, Option_Local, CompilerArgs::Local_Charset },
+                                            { "-filelist", 1, None },
+                                            { "-finput-charset", 0, None, Option_Local, CompilerArgs::Local_Charset },
+                                            { "-fmodule-implementation-of", 1, Sha1 },
+                                            { "-fmodule-name", 1, Sha1 },
+                                            { "-fmodules-user-build-path", 1, None },
+                                            { "-fnew-alignment", 1, Sha1 },
+                                            { "-fno-integrated-as", 0, None, Option_Local, CompilerArgs::Local_NoIntegratedAs },
+                                            { "-force_load", 1, None },
+                                            { "-fplugin=", 0, Prefix, Option_Local, CompilerArgs::Local_ExtraFiles },
+                                            { "-fprofile-arcs", 0, Sha1 | SkipPreprocess, Option_Profiling },
+                                            { "-fprofile-dir=", 0, Sha1 | Prefix, Option_ProfileDir },
+                                            { "-framework", 1, Sha1 | SkipPreprocess },
+                                            { "-frewrite-map-file", 1, None },
+                                            { "-fsanitize-blacklist=", 0, Prefix, Option_Local, CompilerArgs::Local_ExtraFiles },
+                                            { "-ftest-coverage", 0, Sha1 | SkipPreprocess, Option_Profiling },
+                                            { "-ftrapv-handler", 1, Sha1 },
+                                            { "-fuse-ld=", 0, Sha1 | SkipPreprocess | Prefix },
+                                            { "-fwide-exec-charset", 0, None, Option_Local, CompilerArgs::Local_Charset },
+                                            { "-gcc-toolchain", 1, SearchPath },
+                                            { "-idirafter", 1, SearchPath },
+                                            { "-iframework", 1, SearchPath },
+                                            { "-iframeworkwithsysroot", 1, SearchPath },
+                                            { "-imacros", 1, SearchPath },
+                                            { "-image_base", 1, Sha1 },
+                                            { "-imultiarch", 1, SearchPath },
+                                            { "-imultilib", 1, SearchPath },
+                                            { "-include", 1, Sha1 },
+                                            { "-include-pch", 1, Sha1 },
+                                            { "-index-store-path", 1, None },
+                                            { "-init", 1, Sha1 },
+                                            { "-install_name", 1, Sha1 },
+                                            { "-iprefix", 1, SearchPath },
+                                            { "-iquote", 1, SearchPath },
+                                            { "-isysroot", 1, SearchPath },
+                                            { "-isystem", 1, SearchPath },
+                                            { "-isystem-after", 1, SearchPath },
+                                            { "-iwithprefix", 1, SearchPath },
+                                            { "-iwithprefixbefore", 1, SearchPath },
+                                            { "-iwithsysroot", 1, SearchPath },
+                                            { "-l", 1, Sha1 | SkipPreprocess | Prefix },
+                                            { "-lazy_framework", 1, Sha1 },
+                                            { "-lazy_library", 1, Sha1 },
+                                            { "-m32", 0, Sha1, Option_Generic, CompilerArgs::HasDashM32 },
+                                            { "-m64", 0, Sha1, Option_Generic, CompilerArgs::HasDashM64 },
+                                            { "-march=native", 0, None, Option_Native },
+                                            { "-mcpu=native", 0, None, Option_Native },
+                                            { "-meabi", 1, Sha1 },
+                                            { "-mllvm", 1, Sha1 },
+                                            { "-mmlir", 1, Sha1 },
+                                            { "-module-dependency-dir", 1, None },
+                                            { "-mthread-model", 1, Sha1 },
+                                            { "-mtune=native", 0, None, Option_Native },
+                                            { "-multiply_defined", 1, Sha1 },
+                                            { "-multiply_defined_unused", 1, Sha1 },
+                                            { "-no-pie", 0, Sha1 | SkipPreprocess },
+                                            { "-nodefaultlibs", 0, Sha1 | SkipPreprocess },
+                                            { "-nostartfiles", 0, Sha1 | SkipPreprocess },
+                                            { "-nostdlib", 0, Sha1 | SkipPreprocess },
+                                            { "-o", 1, Sha1 | SkipPreprocess, Option_DashO, CompilerArgs::HasDashO },
+                                            { "-pagezero_size", 1, Sha1 },
+                                            { "-pie", 0, Sha1 | SkipPreprocess },
+                                            { "-rdynamic", 0, Sha1 | SkipPreprocess },
+                                            { "-read_only_relocs", 1, Sha1 },
+                                            { "-reexport_framework", 1, Sha1 },
+                                            { "-resource-dir", 1, SearchPath },
+                                            { "-rpath", 1, Sha1 },
+                                            { "-s", 0, Sha1 | SkipPreprocess },
+                                            { "-save-temps", 0, Sha1 | SkipPreprocess },
+                                            { "-save-temps=", 0, Sha1 | SkipPreprocess | Prefix },
+                                            { "-sectalign", 3, Sha1 },
+                                            { "-sectcreate", 3, Sha1 },
+                                            { "-sectobjectsymbols", 2, Sha1 },
+                                            { "-sectorder", 3, Sha1 },
+                                            { "-seg1addr", 1, Sha1 },
+                                            { "-seg_addr_table", 1, Sha1 },
+                                            { "-seg_addr_table_filename", 1, Sha1 },
+                                            { "-segaddr", 2, Sha1 },
+                                            { "-segcreate", 3, Sha1 },
+                                            { "-segprot", 3, Sha1 },
+                                            { "-segs_read_only_addr", 1, Sha1 },
+                                            { "-segs_read_write_addr", 1, Sha1 },
+                                            { "-serialize-diagnostics", 1, None },
+                                            { "-shared", 0, Sha1 | SkipPreprocess },
+                                            { "-shared-libgcc", 0, Sha1 | SkipPreprocess },
+                                            { "-static", 0, Sha1 | SkipPreprocess },
+                                            { "-static-libgcc", 0, Sha1 | SkipPreprocess },
+                                            { "-static-libstdc++", 0, Sha1 | SkipPreprocess },
+                                            { "-sub_library", 1, Sha1 },
+                                            { "-sub_umbrella", 1, Sha1 },
+                                            { "-target", 1, Sha1 },
+                                            { "-u", 1, Sha1 | SkipPreprocess },
+                                            { "-umbrella", 1, Sha1 },
+                                            { "-undefined", 1, Sha1 },
+                                            { "-unexported_symbols_list", 1, None },
+                                            { "-weak_framework", 1, Sha1 },
+                                            { "-weak_library", 1, Sha1 },
+                                            { "-weak_reference_mismatches", 1, Sha1 },
+                                            { "-working-directory", 1, None },
+                                            { "-wrapper", 1, None },
+                                            { "-x", 1, Sha1, Option_Language, CompilerArgs::HasDashX },
+                                            { "-z", 1, Sha1 } };
+
+namespace {
+enum
+{
+    OptionCount = sizeof(argOptions) / sizeof(argOptions[0]),
+    OptionBuckets = 64,
+    OptionSlots = 512,
+    EmptySlot = 0xff
+};
+
+static_assert(OptionCount < EmptySlot, "Option indexes have to fit in a byte");
+
+constexpr size_t optionLength(const char *name)
+{
+    size_t len = 0;
+    while (name[len])
+        ++len;
+    return len;
+}
+
+constexpr uint32_t hashOption(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= static_cast<unsigned char>(name[i]);
+        hash *= 16777619u;
     }
+    return hash;
+}
+
+// FNV's low bits are weak and those are the ones we use
+constexpr uint32_t mixOption(uint32_t hash, uint32_t seed)
+{
+    hash ^= seed;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Perfect hash over argOptions, built by the compiler. Every option hashes to
+// a bucket and each bucket gets a seed that puts its options in free slots, so
+// a lookup is one pass over the argument and a strncmp.
+struct OptionIndex
+{
+    uint32_t seeds[OptionBuckets];
+    uint8_t slots[OptionSlots];
+    size_t maxLength;
+    bool valid;
 };
 
-static const OptionArg argOptions[] = { { "--CLASSPATH", 1, Sha1 },
-                                        { "--assert", 1, Sha1 },
-                                        { "--bootclasspath", 1, Sha1 },
-                                        { "--classpath", 1, Sha1 },
-                                        { "--config", 1, Sha1 },
-                                        { "--coverage", 0, Sha1 | SkipPreprocess },
-                                        { "--define-macro", 1, Sha1 },
-                                        { "--dyld-prefix", 1, Sha1 },
-                                        { "--encoding", 1, Sha1 },
-                                        { "--extdirs", 1, Sha1 },
-                                        { "--for-linker", 1, Sha1 | SkipPreprocess },
-                                        { "--force-link", 1, Sha1 | SkipPreprocess },
-                                        { "--include-directory", 1, None },
-                                        { "--include-directory-after", 1, None },
-                                        { "--include-prefix", 1, None },
-                                        { "--include-with-prefix", 1, None },
-                                        { "--include-with-prefix-after", 1, None },
-                                        { "--include-with-prefix-before", 1, None },
-                                        { "--language", 1, Sha1 },
-                                        { "--library-directory", 1, Sha1 },
-                                        { "--mhwdiv", 1, Sha1 },
-                                        { "--output", 1, Sha1 },
-                                        { "--output-class-directory", 1, Sha1 },
-                                        { "--param", 1, Sha1 },
-                                        { "--prefix", 1, Sha1 },
-                                        { "--print-file-name", 1, Sha1 },
-                                        { "--print-prog-name", 1, Sha1 },
-                                        { "--resource", 1, None },
-                                        { "--rtlib", 1, Sha1 },
-                                        { "--serialize-diagnostics", 1, None },
-                                        { "--std", 1, Sha1 },
-                                        { "--stdlib", 1, Sha1 },
-                                        { "--sysroot", 1, None },
-                                        { "--system-header-prefix", 1, Sha1 },
-                                        { "--undefine-macro", 1, Sha1 },
-                                        { "-F", 1, None },
-                                        { "-G", 1, Sha1 },
-                                        { "-I", 1, None },
-                                        { "-MQ", 1, Sha1 },
-                                        { "-Xanalyzer", 1, Sha1 },
-                                        { "-Xarch_device", 1, Sha1 },
-                                        { "-Xarch_host", 1, Sha1 },
-                                        { "-Xassembler", 1, Sha1 },
-                                        { "-Xclang", 1, Sha1 },
-                                        { "-Xclangas", 1, Sha1 },
-                                        { "-Xcuda-fatbinary", 1, Sha1 },
-                                        { "-Xcuda-ptxas", 1, Sha1 },
-                                        { "-Xlinker", 1, Sha1 | SkipPreprocess },
-                                        { "-Xopenmp-target", 1, Sha1 },
-                                        { "-Xpreprocessor", 1, Sha1 },
-                                        { "-alias_list", 1, None },
-                                        { "-allowable_client", 1, Sha1 },
-                                        { "-arch", 1, Sha1 },
-                                        { "-arch_only", 1, Sha1 },
-                                        { "-arcmt-migrate-report-output", 1, None },
-                                        { "-aux-info", 1, None },
-                                        { "-bundle_loader", 1, None },
-                                        { "-c", 0, Sha1 | SkipPreprocess },
-                                        { "-client_name", 1, Sha1 },
-                                        { "-compatibility_version", 1, Sha1 },
-                                        { "-current_version", 1, Sha1 },
-                                        { "-cxx-isystem", 1, None },
-                                        { "-darwin-target-variant", 1, Sha1 },
-                                        { "-darwin-target-variant-triple", 1, Sha1 },
-                                        { "-dependency-dot", 1, None },
-                                        { "-dependency-file", 1, None },
-                                        { "-dumpbase", 1, None },
-                                        { "-dumpbase-ext", 1, Sha1 },
-                                        { "-dumpdir", 1, None },
-                                        { "-dylib_file", 1, None },
-                                        { "-dylinker_install_name", 1, None },
-                                        { "-exported_symbols_list", 1, None },
-                                        { "-filelist", 1, None },
-                                        { "-fmodule-implementation-of", 1, Sha1 },
-                                        { "-fmodule-name", 1, Sha1 },
-                                        { "-fmodules-user-build-path", 1, None },
-                                        { "-fnew-alignment", 1, Sha1 },
-                                        { "-force_load", 1, None },
-                                        { "-fprofile-arcs", 0, Sha1 | SkipPreprocess },
-                                        { "-framework", 1, Sha1 | SkipPreprocess },
-                                        { "-frewrite-map-file", 1, None },
-                                        { "-ftest-coverage", 0, Sha1 | SkipPreprocess },
-                                        { "-ftrapv-handler", 1, Sha1 },
-                                        { "-gcc-toolchain", 1, None },
-                                        { "-idirafter", 1, None },
-                                        { "-iframework", 1, None },
-                                        { "-iframeworkwithsysroot", 1, None },
-                                        { "-imacros", 1, None },
-                                        { "-image_base", 1, Sha1 },
-                                        { "-imultiarch", 1, None },
-                                        { "-imultilib", 1, None },
-                                        { "-include", 1, None },
-                                        { "-include-pch", 1, None },
-                                        { "-index-store-path", 1, None },
-                                        { "-init", 1, Sha1 },
-                                        { "-install_name", 1, Sha1 },
-                                        { "-iprefix", 1, None },
-                                        { "-iquote", 1, None },
-                                        { "-isysroot", 1, None },
-                                        { "-isystem", 1, None },
-                                        { "-isystem-after", 1, None },
-                                        { "-iwithprefix", 1, None },
-                                        { "-iwithprefixbefore", 1, None },
-                                        { "-iwithsysroot", 1, None },
-                                        { "-lazy_framework", 1, Sha1 },
-                                        { "-lazy_library", 1, Sha1 },
-                                        { "-meabi", 1, Sha1 },
-                                        { "-mllvm", 1, Sha1 },
-                                        { "-mmlir", 1, Sha1 },
-                                        { "-module-dependency-dir", 1, None },
-                                        { "-mthread-model", 1, Sha1 },
-                                        { "-multiply_defined", 1, Sha1 },
-                                        { "-multiply_defined_unused", 1, Sha1 },
-                                        { "-no-pie", 0, Sha1 | SkipPreprocess },
-                                        { "-nodefaultlibs", 0, Sha1 | SkipPreprocess },
-                                        { "-nostartfiles", 0, Sha1 | SkipPreprocess },
-                                        { "-nostdlib", 0, Sha1 | SkipPreprocess },
-                                        { "-o", 1, Sha1 | SkipPreprocess },
-                                        { "-pagezero_size", 1, Sha1 },
-                                        { "-pie", 0, Sha1 | SkipPreprocess },
-                                        { "-rdynamic", 0, Sha1 | SkipPreprocess },
-                                        { "-read_only_relocs", 1, Sha1 },
-                                        { "-reexport_framework", 1, Sha1 },
-                                        { "-resource-dir", 1, None },
-                                        { "-rpath", 1, Sha1 },
-                                        { "-s", 0, Sha1 | SkipPreprocess },
-                                        { "-save-temps", 0, Sha1 | SkipPreprocess },
-                                        { "-sectalign", 3, Sha1 },
-                                        { "-sectcreate", 3, Sha1 },
-                                        { "-sectobjectsymbols", 2, Sha1 },
-                                        { "-sectorder", 3, Sha1 },
-                                        { "-seg1addr", 1, Sha1 },
-                                        { "-seg_addr_table", 1, Sha1 },
-                                        { "-seg_addr_table_filename", 1, Sha1 },
-                                        { "-segaddr", 2, Sha1 },
-                                        { "-segcreate", 3, Sha1 },
-                                        { "-segprot", 3, Sha1 },
-                                        { "-segs_read_only_addr", 1, Sha1 },
-                                        { "-segs_read_write_addr", 1, Sha1 },
-                                        { "-serialize-diagnostics", 1, None },
-                                        { "-shared", 0, Sha1 | SkipPreprocess },
-                                        { "-shared-libgcc", 0, Sha1 | SkipPreprocess },
-                                        { "-static", 0, Sha1 | SkipPreprocess },
-                                        { "-static-libgcc", 0, Sha1 | SkipPreprocess },
-                                        { "-static-libstdc++", 0, Sha1 | SkipPreprocess },
-                                        { "-sub_library", 1, Sha1 },
-                                        { "-sub_umbrella", 1, Sha1 },
-                                        { "-target", 1, Sha1 },
-                                        { "-u", 1, Sha1 | SkipPreprocess },
-                                        { "-umbrella", 1, Sha1 },
-                                        { "-undefined", 1, Sha1 },
-                                        { "-unexported_symbols_list", 1, None },
-                                        { "-weak_framework", 1, Sha1 },
-                                        { "-weak_library", 1, Sha1 },
-                                        { "-weak_reference_mismatches", 1, Sha1 },
-                                        { "-working-directory", 1, None },
-                                        { "-wrapper", 1, None },
-                                        { "-x", 1, Sha1 },
-                                        { "-z", 1, Sha1 } };
-
-static inline const OptionArg *lookupOption(const std::string &arg)
+constexpr OptionIndex buildOptionIndex()
 {
-    constexpr size_t count = sizeof(argOptions) / sizeof(argOptions[0]);
-    const OptionArg key { arg.c_str(), 0, 0 };
-    const OptionArg *end = argOptions + count;
-    const OptionArg *it = std::lower_bound(argOptions, end, key);
-    if (it != end && !strcmp(it->name, arg.c_str())) {
-        return it;
+    OptionIndex index {};
+    for (size_t slot = 0; slot < OptionSlots; ++slot)
+        index.slots[slot] = EmptySlot;
+
+    uint32_t hashes[OptionCount] {};
+    size_t buckets[OptionCount] {};
+    size_t bucketSizes[OptionBuckets] {};
+    size_t maxBucketSize = 0;
+    for (size_t i = 0; i < OptionCount; ++i) {
+        const size_t len = optionLength(argOptions[i].name);
+        if (argOptions[i].name[0] != '-')
+            return index;
+        if (len > index.maxLength)
+            index.maxLength = len;
+        hashes[i] = hashOption(argOptions[i].name, len);
+        buckets[i] = mixOption(hashes[i], 0) & (OptionBuckets - 1);
+        if (++bucketSizes[buckets[i]] > maxBucketSize)
+            maxBucketSize = bucketSizes[buckets[i]];
+    }
+
+    // The biggest buckets are the hardest to place so they go first
+    for (size_t size = maxBucketSize; size > 0; --size) {
+        for (size_t bucket = 0; bucket < OptionBuckets; ++bucket) {
+            if (bucketSizes[bucket] != size)
+                continue;
+            size_t members[OptionCount] {};
+            size_t count = 0;
+            for (size_t i = 0; i < OptionCount; ++i) {
+                if (buckets[i] == bucket)
+                    members[count++] = i;
+            }
+
+            bool placed = false;
+            for (uint32_t seed = 1; !placed && seed < 0x10000; ++seed) {
+                size_t slots[OptionCount] {};
+                placed = true;
+                for (size_t i = 0; placed && i < count; ++i) {
+                    slots[i] = mixOption(hashes[members[i]], seed) & (OptionSlots - 1);
+                    placed = index.slots[slots[i]] == EmptySlot;
+                    for (size_t j = 0; placed && j < i; ++j)
+                        placed = slots[j] != slots[i];
+                }
+                if (placed) {
+                    index.seeds[bucket] = seed;
+                    for (size_t i = 0; i < count; ++i)
+                        index.slots[slots[i]] = static_cast<uint8_t>(members[i]);
+                }
+            }
+            if (!placed)
+                return index;
+        }
+    }
+    index.valid = true;
+    return index;
+}
+
+constexpr OptionIndex optionIndex = buildOptionIndex();
+static_assert(optionIndex.valid, "Options have to start with - and need a perfect hash, try more slots");
+} // namespace
+
+static inline const OptionArg *lookupOption(const char *arg, size_t len)
+{
+    if (len > optionIndex.maxLength)
+        return nullptr;
+    const uint32_t hash = hashOption(arg, len);
+    const uint32_t bucket = mixOption(hash, 0) & (OptionBuckets - 1);
+    const uint8_t slot = optionIndex.slots[mixOption(hash, optionIndex.seeds[bucket]) & (OptionSlots - 1)];
+    if (slot == EmptySlot)
+        return nullptr;
+    const OptionArg &option = argOptions[slot];
+    if (strncmp(option.name, arg, len) || option.name[len])
+        return nullptr;
+    return &option;
+}
+
+// Tries the whole argument first, then what comes before a glued on operand
+// for Prefix options. Those take no separate operands.
+static inline const OptionArg *lookupOption(const std::string &arg, size_t *operands)
+{
+    *operands = 0;
+    if (arg[0] != '-')
+        return nullptr;
+    if (const OptionArg *option = lookupOption(arg.c_str(), arg.size())) {
+        *operands = option->args;
+        return option;
+    }
+    const size_t limit = std::min(arg.size(), optionIndex.maxLength);
+    for (size_t delimiter = 1; delimiter < limit; ++delimiter) {
+        if (arg[delimiter] == '=' || arg[delimiter] == ',') {
+            const OptionArg *option = lookupOption(arg.c_str(), delimiter + 1);
+            if (option && option->flags & Prefix)
+                return option;
+            break;
+        }
+    }
+    if (arg.size() > 2) {
+        const OptionArg *option = lookupOption(arg.c_str(), 2);
+        if (option && option->flags & Prefix)
+            return option;
     }
     return nullptr;
 }
 
-static inline size_t hasArg(const std::string &arg, bool &sha1)
+// stolen from icecc
+static bool assemblerArgsSupported(const std::string &arg)
 {
-    if (const OptionArg *o = lookupOption(arg)) {
-        sha1 = o->flags & Sha1;
-        return o->args;
+    const char *pos = arg.c_str() + 4;
+
+    while ((pos = strstr(pos + 1, "-a"))) {
+        pos += 2;
+
+        while ((*pos >= 'a') && (*pos <= 'z')) {
+            pos++;
+        }
+
+        if (*pos == '=') {
+            DEBUG("Incompatible arg %s building local", arg.c_str());
+            return false;
+        }
+
+        if (!*pos) {
+            break;
+        }
+    }
+
+    /* Some weird build systems pass directly additional assembler files.
+     * Example: -Wa,src/code16gcc.s
+     * Need to handle it locally then. Search if the first part after -Wa, does not start with -
+     */
+    pos = arg.c_str() + 3;
+
+    while (*pos) {
+        if ((*pos == ',') || (*pos == ' ')) {
+            pos++;
+            continue;
+        }
+
+        if (*pos == '-') {
+            break;
+        }
+
+        DEBUG("Incompatible arg (2) %s building local", arg.c_str());
+        return false;
     }
-    return 0;
+    return true;
 }
 
 // Caller contract for the object-cache SHA1 chain (must not be reordered):
@@ -223,7 +456,8 @@ static inline size_t hasArg(const std::string &arg, bool &sha1)
 // finalize() applies the compiler-info-gated arg tweaks and their sha1Update
 // calls; running finalize() out of order corrupts the cache key.
 std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&arguments,
-                                                   LocalReason *localReason)
+                                                   LocalReason *localReason,
+                                                   std::vector<std::string> *sources)
 {
     const bool objectCache = Config::objectCache;
     std::shared_ptr<CompilerArgs> ret = std::make_shared<CompilerArgs>();
@@ -234,6 +468,7 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
     std::string hasArch;
     bool hasProfileDir = false;
     bool hasProfiling = false;
+    std::vector<size_t> extraSources;
 
     size_t i;
     if (Log::minLogLevel <= Log::Verbose || !Config::color) {
@@ -252,12 +487,22 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
         }
     }
 
-    auto sha1 = [&i, &ret, objectCache](size_t count = 1) {
+    // Everything after a native flag is held back until finalize() has hashed
+    // what it expands to, so the key follows the order the compiler sees
+    auto hash = [&ret](const char *data, size_t len) {
+        if (ret->nativeArgs.empty()) {
+            Client::data().sha1Update(data, len);
+        } else {
+            ret->pendingSha1.append(data, len);
+        }
+    };
+
+    auto sha1 = [&i, &ret, &hash, objectCache](size_t count = 1) {
         if (objectCache) {
             for (size_t aa = i; aa < i + count; ++aa) {
                 const std::string &arg = ret->commandLine[aa];
                 VERBOSE("SHA1'ing arg %zu [%s]", aa, arg.c_str());
-                Client::data().sha1Update(arg.c_str(), arg.size());
+                hash(arg.c_str(), arg.size());
             }
         }
     };
@@ -265,319 +510,114 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
     for (i = 1; i < ret->commandLine.size(); ++i) {
         const std::string &arg = ret->commandLine[i];
 
-        if (arg == "-S") {
-            DEBUG("-S, running local");
-            *localReason = Local_DoNotAssemble;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-E") {
-            DEBUG("-E, running local");
-            *localReason = Local_Preprocess;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-fno-integrated-as") {
-            DEBUG("-fno-integrated-as, running local");
-            *localReason = Local_NoIntegratedAs;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-M" || arg == "-MM") {
-            DEBUG("%s, running local", arg.c_str());
-            *localReason = Local_Preprocess;
-            ret.reset();
-            goto end;
-        }
-
-        if (!strncmp(arg.c_str(), "-B", 2)) {
-            DEBUG("%s, running local", arg.c_str());
-            *localReason = Local_BinPath;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-march=native" || arg == "-mcpu=native" || arg == "-mtune=native") {
-            DEBUG("Local archicture optimizations: %s. Run local", arg.c_str());
-            *localReason = Local_NativeArch;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-fexec-charset" || arg == "-fwide-exec-charset" || arg == "-finput-charset") {
-            DEBUG("build environment charset conversions: %s. Run local", arg.c_str());
-            *localReason = Local_Charset;
-            ret.reset();
-            goto end;
-        }
-
-        if (!strncmp(arg.c_str(), "-fplugin=", 9) || !strncmp(arg.c_str(), "-fsanitize-blacklist=", 21)) {
-            DEBUG("Extra files: %s. Run local", arg.c_str());
-            *localReason = Local_ExtraFiles;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-") {
-            DEBUG("STDIN input, building local");
-            *localReason = Local_StdinInput;
-            ret.reset();
-            goto end;
-        }
-
-        if (arg == "-c") {
-            hasDashC = true;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-o") {
-            if (i + 1 >= ret->commandLine.size()) {
-                DEBUG("-o without an argument, building local");
-                *localReason = Local_ParseError;
-                ret.reset();
-                goto end;
-            }
-            if (ret->commandLine[i + 1] == "-") {
-                DEBUG("-o - This means different things for different compilers. Run local");
-                *localReason = Local_StdOutOutput;
-                ret.reset();
-                goto end;
-            }
-            ret->flags |= HasDashO;
-            ret->objectFileIndex = i + 1;
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        if (!strncmp(arg.c_str(), "-fprofile-dir=", 14)) {
-            hasProfileDir = true;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-ftest-coverage" || arg == "-fprofile-arcs") {
-            hasProfiling = true;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-m32") {
-            ret->flags |= HasDashM32;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-m64") {
-            ret->flags |= HasDashM64;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-MF") {
-            if (i + 1 >= ret->commandLine.size()) {
-                DEBUG("-MF without an argument, building local");
-                *localReason = Local_ParseError;
-                ret.reset();
-                goto end;
-            }
-            ret->flags |= HasDashMF;
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        if (arg == "-MD") {
-            ret->flags |= HasDashMD;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-MMD") {
-            ret->flags |= HasDashMMD;
-            sha1();
-            continue;
-        }
-
-        if (arg == "-MT") {
-            if (i + 1 >= ret->commandLine.size()) {
-                DEBUG("-MT without an argument, building local");
+        size_t operands;
+        if (const OptionArg *option = lookupOption(arg, &operands)) {
+            if (i + operands >= ret->commandLine.size()) {
+                DEBUG("%s missing operand(s), building local", arg.c_str());
                 *localReason = Local_ParseError;
                 ret.reset();
                 goto end;
             }
-            ret->flags |= HasDashMT;
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        if (!strncmp(arg.c_str(), "-Wa,", 4)) {
-            // stolen from icecc
-            const char *pos = arg.c_str() + 4;
 
-            while ((pos = strstr(pos + 1, "-a"))) {
-                pos += 2;
-
-                while ((*pos >= 'a') && (*pos <= 'z')) {
-                    pos++;
-                }
-
-                if (*pos == '=') {
-                    DEBUG("Incompatible arg %s building local", arg.c_str());
-                    *localReason = Local_ParseError;
+            switch (option->kind) {
+                case Option_Generic:
+                    break;
+                case Option_Local:
+                    *localReason = static_cast<LocalReason>(option->value);
+                    DEBUG("%s, running local (%s)", arg.c_str(), localReasonToString(*localReason));
                     ret.reset();
                     goto end;
-                }
-
-                if (!*pos) {
+                case Option_Native:
+                    if (Config::resolveNative) {
+                        // Hashed once they're expanded
+                        if (std::find(ret->nativeArgs.begin(), ret->nativeArgs.end(), arg) == ret->nativeArgs.end())
+                            ret->nativeArgs.push_back(arg);
+                        continue;
+                    }
+                    DEBUG("Local archicture optimizations: %s. Run local", arg.c_str());
+                    *localReason = Local_NativeArch;
+                    ret.reset();
+                    goto end;
+                case Option_DashC:
+                    hasDashC = true;
                     break;
-                }
-            }
-
-            /* Some weird build systems pass directly additional assembler files.
-             * Example: -Wa,src/code16gcc.s
-             * Need to handle it locally then. Search if the first part after -Wa, does not start with -
-             */
-            pos = arg.c_str() + 3;
-
-            while (*pos) {
-                if ((*pos == ',') || (*pos == ' ')) {
-                    pos++;
-                    continue;
-                }
-
-                if (*pos == '-') {
+                case Option_DashO:
+                    if (ret->commandLine[i + 1] == "-") {
+                        DEBUG("-o - This means different things for different compilers. Run local");
+                        *localReason = Local_StdOutOutput;
+                        ret.reset();
+                        goto end;
+                    }
+                    ret->objectFileIndex = i + 1;
                     break;
-                }
-
-                DEBUG("Incompatible arg (2) %s building local", arg.c_str());
-                *localReason = Local_ParseError;
-                ret.reset();
-                goto end;
-            }
-            continue;
-        }
-
-        if (arg == "-Xclang") {
-            if (i + 1 >= ret->commandLine.size()) {
-                DEBUG("-Xclang without an argument, building local");
-                *localReason = Local_ParseError;
-                ret.reset();
-                goto end;
-            }
-            if (ret->commandLine[i + 1] == "-load") {
-                DEBUG("Extra files: %s. Run local", arg.c_str());
-                *localReason = Local_ExtraFiles;
-                ret.reset();
-                goto end;
-            }
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        if (arg == "-arch") {
-            if (i + 1 >= ret->commandLine.size()) {
-                DEBUG("-arch without an argument, building local");
-                *localReason = Local_ParseError;
-                ret.reset();
-                goto end;
-            }
-            const std::string arch = ret->commandLine[i + 1];
-            if (!hasArch.empty() && hasArch != arch) {
-                DEBUG("multiple -arch options, building locally");
-                *localReason = Local_MultiArch;
-                ret.reset();
-                goto end;
-            }
-            hasArch = arch;
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        if (arg == "-x") {
-            ret->flags |= HasDashX;
-            if (i + 1 == ret->commandLine.size()) {
-                ret.reset();
-                goto end;
-            }
-
-            const std::string lang = ret->commandLine.at(i + 1);
-            const CompilerArgs::Flag languages[] = { CPlusPlus, C, CPreprocessed, CPlusPlusPreprocessed, ObjectiveC, ObjectiveCPreprocessed, ObjectiveCPlusPlus, ObjectiveCPlusPlusPreprocessed, AssemblerWithCpp, Assembler };
-            for (size_t j = 0; j < sizeof(languages) / sizeof(languages[0]); ++j) {
-                if (lang == CompilerArgs::languageName(languages[j])) {
-                    ret->flags &= ~LanguageMask;
-                    ret->flags |= languages[j];
-                    // -x takes precedence
+                case Option_ProfileDir:
+                    hasProfileDir = true;
+                    break;
+                case Option_Profiling:
+                    hasProfiling = true;
+                    break;
+                case Option_Assembler:
+                    if (!assemblerArgsSupported(arg)) {
+                        *localReason = Local_ParseError;
+                        ret.reset();
+                        goto end;
+                    }
+                    break;
+                case Option_Xclang:
+                    if (ret->commandLine[i + 1] == "-load") {
+                        DEBUG("Extra files: %s. Run local", arg.c_str());
+                        *localReason = Local_ExtraFiles;
+                        ret.reset();
+                        goto end;
+                    }
+                    break;
+                case Option_Arch: {
+                    const std::string &arch = ret->commandLine[i + 1];
+                    if (!hasArch.empty() && hasArch != arch) {
+                        DEBUG("multiple -arch options, building locally");
+                        *localReason = Local_MultiArch;
+                        ret.reset();
+                        goto end;
+                    }
+                    hasArch = arch;
                     break;
                 }
-            }
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        if (arg == "-include" || arg == "-include-pch") {
-            // we may have to handle this differently, gcc apparently falls back
-            // to not using the pch file if it can't be found. Icecream code is
-            // extremely confusing.
-            if (i + 1 >= ret->commandLine.size()) {
-                DEBUG("%s without an argument, building local", arg.c_str());
-                *localReason = Local_ParseError;
-                ret.reset();
-                goto end;
-            }
-            sha1(2);
-            ++i;
-            continue;
-        }
-
-        {
-            bool needSHA1 = false;
-            if (size_t count = hasArg(arg, needSHA1)) {
-                if (i + count >= ret->commandLine.size()) {
-                    DEBUG("%s missing operand(s), building local", arg.c_str());
-                    *localReason = Local_ParseError;
-                    ret.reset();
-                    goto end;
+                case Option_Language: {
+                    const std::string &lang = ret->commandLine[i + 1];
+                    const CompilerArgs::Flag languages[] = { CPlusPlus, C, CPreprocessed, CPlusPlusPreprocessed, ObjectiveC, ObjectiveCPreprocessed, ObjectiveCPlusPlus, ObjectiveCPlusPlusPreprocessed, AssemblerWithCpp, Assembler };
+                    for (size_t j = 0; j < sizeof(languages) / sizeof(languages[0]); ++j) {
+                        if (lang == CompilerArgs::languageName(languages[j])) {
+                            ret->flags &= ~LanguageMask;
+                            ret->flags |= languages[j];
+                            // -x takes precedence
+                            break;
+                        }
+                    }
+                    break;
                 }
-                if (needSHA1)
-                    sha1(count + 1);
-                i += count;
-                continue;
             }
-        }
 
-        if (!strncmp("-I", arg.c_str(), 2)) {
+            ret->flags |= option->value;
+            if (option->flags & Sha1)
+                sha1(operands + 1);
+            i += operands;
             continue;
         }
 
         if (arg[0] != '-') {
             if (ret->sourceFileIndex != std::numeric_limits<size_t>::max()) {
-                if (!hasDashC) {
-                    while (i < ret->commandLine.size()) {
-                        if (ret->commandLine[i] == "-c") {
-                            hasDashC = true;
-                            break;
-                        }
-                        ++i;
-                    }
-                }
+                if (!hasDashC)
+                    hasDashC = std::find(ret->commandLine.begin() + i, ret->commandLine.end(), "-c") != ret->commandLine.end();
                 if (!hasDashC) {
                     DEBUG("link job, building local");
                     *localReason = Local_Link;
-                } else {
-                    DEBUG("Multiple source files %s and %s", ret->commandLine[ret->sourceFileIndex].c_str(), arg.c_str());
-                    *localReason = Local_MultiSource;
+                    ret.reset();
+                    goto end;
                 }
-                ret.reset();
-                goto end;
+                // Keep going, the caller may want all of them
+                DEBUG("Multiple source files %s and %s", ret->commandLine[ret->sourceFileIndex].c_str(), arg.c_str());
+                extraSources.push_back(i);
+                continue;
             }
             ret->sourceFileIndex = i;
             if (!(ret->flags & LanguageMask)) {
@@ -621,7 +661,7 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
 
             size_t len = 0;
             const char *fn = Client::trimSourceRoot(arg, &len);
-            Client::data().sha1Update(fn, len);
+            hash(fn, len);
             VERBOSE("SHA1'ing arg %zu [%.*s]", i, static_cast<int>(len), fn);
             continue;
         }
@@ -630,6 +670,23 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
         sha1();
     }
 
+    if (!extraSources.empty()) {
+        *localReason = Local_MultiSource;
+        // With -o or -MF the compiler either refuses or has every source
+        // write the same file, that's between it and the build system
+        if (sources && !(ret->flags & (HasDashO | HasDashMF))) {
+            sources->push_back(ret->commandLine[ret->sourceFileIndex]);
+            for (size_t idx : extraSources)
+                sources->push_back(ret->commandLine[idx]);
+            std::vector<std::string> sorted = *sources;
+            std::sort(sorted.begin(), sorted.end());
+            if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end())
+                sources->clear();
+        }
+        ret.reset();
+        goto end;
+    }
+
     if (ret->sourceFileIndex == std::numeric_limits<size_t>::max()) {
         DEBUG("No src file, building local");
         *localReason = Local_NoSources;
@@ -680,8 +737,8 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
         ret->commandLine.push_back("-o");
         std::string out = ret->output();
         if (objectCache) {
-            Client::data().sha1Update("-o", 2);
-            Client::data().sha1Update(out.c_str(), out.size());
+            hash("-o", 2);
+            hash(out.c_str(), out.size());
             VERBOSE("SHA1'ing arg [-o]");
             VERBOSE("SHA1'ing arg [%s]", out.c_str());
         }
@@ -694,8 +751,8 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
         Client::parsePath(ret->output(), nullptr, &dir);
         dir = Client::realpath(dir);
         if (objectCache) {
-            Client::data().sha1Update("-fprofile-dir=", 14);
-            Client::data().sha1Update(dir.c_str(), dir.size());
+            hash("-fprofile-dir=", 14);
+            hash(dir.c_str(), dir.size());
             VERBOSE("SHA1'ing arg [-fprofile-dir=%s]", dir.c_str());
         }
         ret->commandLine.push_back("-fprofile-dir=" + dir);
@@ -706,8 +763,8 @@ std::shared_ptr<CompilerArgs> CompilerArgs::create(std::vector<std::string> &&ar
         ret->commandLine.push_back("-MF");
         std::string dfile = out.substr(0, out.find_last_of('.')) + ".d";
         if (objectCache) {
-            Client::data().sha1Update("-MF", 2);
-            Client::data().sha1Update(dfile.c_str(), dfile.size());
+            hash("-MF", 2);
+            hash(dfile.c_str(), dfile.size());
             VERBOSE("SHA1'ing arg [-MF]");
             VERBOSE("SHA1'ing arg [%s]", dfile.c_str());
         }
@@ -720,8 +777,56 @@ end:
     return ret;
 }
 
-void CompilerArgs::finalize(const Client::CompilerInfo &info)
+void CompilerArgs::removeArgument(size_t idx)
+{
+    commandLine.erase(commandLine.begin() + idx);
+    if (sourceFileIndex != std::numeric_limits<size_t>::max() && sourceFileIndex > idx) {
+        --sourceFileIndex;
+    }
+    if (objectFileIndex != std::numeric_limits<size_t>::max() && objectFileIndex > idx) {
+        --objectFileIndex;
+    }
+}
+
+void CompilerArgs::insertArguments(size_t idx, const std::vector<std::string> &args)
+{
+    commandLine.insert(commandLine.begin() + idx, args.begin(), args.end());
+    if (sourceFileIndex != std::numeric_limits<size_t>::max() && sourceFileIndex >= idx) {
+        sourceFileIndex += args.size();
+    }
+    if (objectFileIndex != std::numeric_limits<size_t>::max() && objectFileIndex >= idx) {
+        objectFileIndex += args.size();
+    }
+}
+
+bool CompilerArgs::finalize(const Client::CompilerInfo &info)
 {
+    if (!nativeArgs.empty()) {
+        if (!info.hasNative) {
+            DEBUG("Daemon couldn't expand native architecture flags. Run local");
+            return false;
+        }
+        // The expansion goes where the first one was so that flags after it,
+        // like -mno-avx2, still win
+        size_t first = std::numeric_limits<size_t>::max();
+        for (size_t i = 1; i < commandLine.size();) {
+            if (std::find(nativeArgs.begin(), nativeArgs.end(), commandLine[i]) != nativeArgs.end()) {
+                removeArgument(i);
+                first = std::min(first, i);
+            } else {
+                ++i;
+            }
+        }
+        assert(first != std::numeric_limits<size_t>::max());
+        for (const std::string &arg : info.native) {
+            VERBOSE("SHA1'ing arg [%s]", arg.c_str());
+            Client::data().sha1Update(arg.c_str(), arg.size());
+        }
+        insertArguments(first, info.native);
+        Client::data().sha1Update(pendingSha1.c_str(), pendingSha1.size());
+        pendingSha1.clear();
+    }
+
     const bool hasJSONDiagnostics = ((Config::jsonDiagnostics || Config::jsonDiagnosticsRaw)
                                      && info.type == Client::CompilerType::GCC
                                      && info.version.major >= 10);
@@ -729,13 +834,7 @@ void CompilerArgs::finalize(const Client::CompilerInfo &info)
     if (hasJSONDiagnostics) {
         for (size_t i = 0; i < commandLine.size();) {
             if (commandLine[i] == "-fdiagnostics-parseable-fixits") {
-                commandLine.erase(commandLine.begin() + i);
-                if (sourceFileIndex != std::numeric_limits<size_t>::max() && sourceFileIndex > i) {
-                    --sourceFileIndex;
-                }
-                if (objectFileIndex != std::numeric_limits<size_t>::max() && objectFileIndex > i) {
-                    --objectFileIndex;
-                }
+                removeArgument(i);
             } else {
                 ++i;
             }
@@ -753,6 +852,43 @@ void CompilerArgs::finalize(const Client::CompilerInfo &info)
         Client::data().sha1Update(arg.c_str(), arg.size());
         commandLine.push_back(std::move(arg));
     }
+
+    // -ffile-prefix-map showed up in gcc 8 and clang 10
+    const bool hasFilePrefixMap = ((info.type == Client::CompilerType::GCC && info.version.major >= 8)
+                                   || (info.type == Client::CompilerType::Clang && info.version.major >= 10));
+    if (Config::prefixMap && hasFilePrefixMap) {
+        const auto conflicts = [](const std::string &arg) {
+            // Compressed debug sections would hide the paths
+            return !strncmp(arg.c_str(), "-gz", 3) || arg.find("-prefix-map=") != std::string::npos;
+        };
+        std::string source = sourceFile();
+        if (source[0] != '/')
+            source = Client::cwd() + '/' + source;
+        size_t len;
+        const char *trimmed = Client::trimSourceRoot(source, &len);
+        const size_t rootLength = trimmed - source.c_str();
+        if (rootLength > 1 && rootLength <= canonicalRoot().size() && std::none_of(commandLine.begin(), commandLine.end(), conflicts)) {
+            sourceRoot = source.substr(0, rootLength - 1);
+            // The root itself stays out of the hash, that's the point
+            const std::string hashed = "-ffile-prefix-map=" + canonicalRoot();
+            VERBOSE("SHA1'ing arg [%s]", hashed.c_str());
+            Client::data().sha1Update(hashed.c_str(), hashed.size());
+            commandLine.push_back("-ffile-prefix-map=" + sourceRoot + '=' + canonicalRoot());
+        } else {
+            DEBUG("Not mapping the source root of %s", source.c_str());
+        }
+    }
+    return true;
+}
+
+const std::string &CompilerArgs::canonicalRoot()
+{
+    static const std::string root = [] {
+        std::string ret = "/fisk-source-root";
+        ret.resize(128, '_');
+        return ret;
+    }();
+    return root;
 }
 
 const char *CompilerArgs::languageName(Flag flag, bool preprocessed)
@@ -829,43 +965,60 @@ const char *CompilerArgs::localReasonToString(LocalReason reason)
     return nullptr;
 }
 
-static bool skipForPreprocessPrefix(const std::string &arg)
+std::vector<std::string> CompilerArgs::preprocessArguments(const std::string &compiler) const
 {
-    if (!strncmp(arg.c_str(), "-Wl,", 4))
-        return true;
-    if (!strncmp(arg.c_str(), "-fuse-ld=", 9))
-        return true;
-    if (!strncmp(arg.c_str(), "-save-temps=", 12))
-        return true;
-    if (arg.size() > 2 && arg[0] == '-' && (arg[1] == 'l' || arg[1] == 'L'))
-        return true;
-    return false;
-}
-
-std::string CompilerArgs::preprocessCommandLine(const std::string &compiler) const
-{
-    std::string ret = compiler;
+    std::vector<std::string> ret;
+    ret.reserve(commandLine.size() + 2);
+    ret.push_back(compiler);
     for (size_t i = 1; i < commandLine.size(); ++i) {
         const std::string &arg = commandLine[i];
-        if (const OptionArg *o = lookupOption(arg); o && (o->flags & SkipPreprocess)) {
-            i += std::min(o->args, commandLine.size() - i - 1);
-            continue;
-        }
-        if (skipForPreprocessPrefix(arg)) {
+        size_t operands;
+        if (const OptionArg *o = lookupOption(arg, &operands); o && (o->flags & SkipPreprocess)) {
+            i += std::min(operands, commandLine.size() - i - 1);
             continue;
         }
-        ret += " '";
-        ret += arg;
-        ret += '\'';
+        ret.push_back(arg);
     }
-    ret += " '-E'";
+    ret.push_back("-E");
     if (Client::data().builderCompiler.find("clang") != std::string::npos) {
-        ret += " '-frewrite-includes'";
+        ret.push_back("-frewrite-includes");
     } else {
-        ret += " '-fdirectives-only'";
+        ret.push_back("-fdirectives-only");
     }
     if (!Config::discardComments) {
-        ret += " '-C'";
+        ret.push_back("-C");
+    }
+    return ret;
+}
+
+std::string CompilerArgs::searchPathArguments() const
+{
+    std::string ret;
+    for (size_t i = 1; i < commandLine.size(); ++i) {
+        size_t operands;
+        const OptionArg *option = lookupOption(commandLine[i], &operands);
+        if (!option)
+            continue;
+        const size_t last = std::min(i + operands, commandLine.size() - 1);
+        if (option->flags & SearchPath) {
+            for (size_t j = i; j <= last; ++j) {
+                ret += commandLine[j];
+                ret += '\0';
+            }
+        }
+        i = last;
+    }
+    return ret;
+}
+
+std::string CompilerArgs::preprocessCommandLine(const std::string &compiler) const
+{
+    const std::vector<std::string> arguments = preprocessArguments(compiler);
+    std::string ret = arguments[0];
+    for (size_t i = 1; i < arguments.size(); ++i) {
+        ret += " '";
+        ret += arguments[i];
+        ret += '\'';
     }
     return ret;
 }
@@ -32,6 +32,14 @@ struct CompilerArgs
     std::vector<std::string> commandLine;
     size_t sourceFileIndex { std::numeric_limits<size_t>::max() };
     size_t objectFileIndex { std::numeric_limits<size_t>::max() };
+    // -march=native and friends, replaced in finalize() with what the daemon
+    // expanded them to
+    std::vector<std::string> nativeArgs;
+    // What create() hashed after the first of nativeArgs, finalize() hashes
+    // it after the expansion
+    std::string pendingSha1;
+    // With --prefix-map, the directory finalize() mapped to canonicalRoot()
+    std::string sourceRoot;
 
     enum Flag
     {
@@ -84,8 +92,15 @@ struct CompilerArgs
     };
 
     static const char *localReasonToString(LocalReason reason);
-    static std::shared_ptr<CompilerArgs> create(std::vector<std::string> &&args, LocalReason *reason);
-    void finalize(const Client::CompilerInfo &info);
+    // With Local_MultiSource, sources gets every source file if they can be
+    // compiled one at a time
+    static std::shared_ptr<CompilerArgs> create(std::vector<std::string> &&args, LocalReason *reason, std::vector<std::string> *sources = nullptr);
+    // Returns false if nativeArgs couldn't be expanded
+    bool finalize(const Client::CompilerInfo &info);
+    // What sourceRoot is replaced with in everything the compiler writes. It's
+    // longer than any root it's used for so the root can be put back in place,
+    // padded with leading slashes.
+    static const std::string &canonicalRoot();
 
     std::string sourceFile() const
     {
@@ -94,7 +109,17 @@ struct CompilerArgs
     }
 
     std::string output() const;
+    // The preprocessor is spawned with these directly, the command line is
+    // for logging
+    std::vector<std::string> preprocessArguments(const std::string &compiler) const;
     std::string preprocessCommandLine(const std::string &compiler) const;
+    // -I, -isystem, --sysroot and the rest of what decides which file an
+    // #include finds, with their operands in command line order
+    std::string searchPathArguments() const;
+
+private:
+    void removeArgument(size_t idx);
+    void insertArguments(size_t idx, const std::vector<std::string> &args);
 };
 
 inline CompilerArgs::Flag CompilerArgs::preprocessedFlag(Flag flag)
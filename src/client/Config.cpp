@@ -80,12 +80,38 @@ Getter<bool> objectCache("object-cache",
                          "configured with --object-cache and the builders to have --object-cache-size",
                          true);
 Getter<std::string> objectCacheTag("object-cache-tag", "Additional tag that gets sha1'ed into the cache key");
+Getter<unsigned long long> localCacheSize("local-cache-size",
+                                          "Keep up to this many bytes of compiler output in cache-dir and reuse it without contacting the scheduler "
+                                          "(requires --object-cache, 0 disables it)",
+                                          0);
+Getter<bool> directMode("direct-mode",
+                        "Look up the object cache key from the include files recorded last time instead of preprocessing "
+                        "(requires --local-cache-size)",
+                        false);
+Getter<bool> pump("pump",
+                  "Send the source and the headers it includes to the builder and preprocess there. Falls back to preprocessing "
+                  "locally when the includes can't be resolved without the preprocessor",
+                  false);
+Getter<bool> prefixMap("prefix-map",
+                       "Compile with the source root mapped to a fixed path so the object cache can be shared between checkouts in "
+                       "different places, the root is put back as the objects are written",
+                       false);
+Getter<bool> resolveNative("resolve-native", "Have the daemon spell out -march=native, -mcpu=native and -mtune=native for this machine and compile remotely", true);
+Getter<bool> splitSources("split-sources", "Compile command lines with several source files (gcc -c a.c b.c) as one job per source", true);
+Getter<std::string> hashAlgorithm("hash-algorithm", "Digest used for the object cache key, one of sha1, blake2s256 or blake2b512 (the scheduler rejects anything else)", "sha1");
 Getter<bool> storePreprocessedDataOnError("store-preprocessed-data-on-error", "Set to true to store the preprocessed data on errors",
                                           false);
 Getter<bool> watchdog("watchdog", "Whether watchdog is enabled", true);
 Getter<bool> verify("verify", "Only verify that the npm version is correct", false);
 Getter<unsigned long long> delay("delay", "Delay this many milliseconds before starting", 0);
 Getter<bool> compress("compress", "Compress preprocessed output");
+Getter<std::string> compression("compression", "Codec used for compressed uploads, gzip or zstd. Falls back to gzip for builders without zstd support", "gzip");
+Getter<int> zstdLevel("zstd-level", "Compression level used with --compression zstd", 3);
+Getter<bool> adaptiveCompression("adaptive-compression", "Pick the compression level for each builder from measured upload throughput (gzip only)", false);
+Getter<int> compressThreads("compress-threads", "Number of threads used to compress preprocessed output, 0 means one per core", 0);
+Getter<bool> zeroMaskUploads("zero-mask-uploads", "Send preprocessed output with an all zero WebSocket masking key so it isn't copied. Against RFC 6455, only for builders reached without proxies in between", false);
+Getter<bool> streamUpload("stream-upload", "Upload preprocessed output to the builder while the preprocessor is still running (not used with --object-cache)", false);
+Getter<bool> dedupSegments("dedup-segments", "Split preprocessed output where headers start and end and only upload the pieces the builder hasn't seen (not used with --stream-upload)", false);
 Getter<bool> discardComments("discard-comments", "Discard comments when preprocessing", true);
 Getter<std::string> nodePath("node-path", "Path to nodejs executable", "node");
 static Separator s4;
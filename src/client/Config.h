@@ -324,6 +324,13 @@ extern Getter<bool> jsonDiagnostics;
 extern Getter<bool> jsonDiagnosticsRaw;
 extern Getter<bool> objectCache;
 extern Getter<std::string> objectCacheTag;
+extern Getter<unsigned long long> localCacheSize;
+extern Getter<bool> directMode;
+extern Getter<bool> pump;
+extern Getter<bool> prefixMap;
+extern Getter<bool> splitSources;
+extern Getter<bool> resolveNative;
+extern Getter<std::string> hashAlgorithm;
 extern Getter<bool> storePreprocessedDataOnError;
 extern Getter<bool> disabled;
 extern Getter<int> priority;
@@ -351,5 +358,12 @@ extern Getter<bool> debug;
 extern Getter<bool> discardComments;
 extern Getter<unsigned long long> delay;
 extern Getter<bool> compress;
+extern Getter<std::string> compression;
+extern Getter<int> zstdLevel;
+extern Getter<bool> adaptiveCompression;
+extern Getter<int> compressThreads;
+extern Getter<bool> zeroMaskUploads;
+extern Getter<bool> streamUpload;
+extern Getter<bool> dedupSegments;
 } // namespace Config
 #endif /* CONFIG_H */
@@ -205,11 +205,23 @@ void DaemonSocket::send(const std::string &json)
     DEBUG("DaemonSocket send message: %s", json.c_str());
 }
 
-void DaemonSocket::sendAcquireSlot(const std::string &compiler)
+void DaemonSocket::sendAcquireSlot(const std::string &compiler, const std::vector<std::string> &resolve, const std::vector<std::string> &native)
 {
     nlohmann::json obj = nlohmann::json::object();
     obj["type"] = "acquireSlot";
     obj["compiler"] = compiler;
+    if (!resolve.empty())
+        obj["resolve"] = resolve;
+    if (!native.empty())
+        obj["native"] = native;
+    send(obj.dump());
+}
+
+void DaemonSocket::sendResolveHost(const std::string &host)
+{
+    nlohmann::json obj = nlohmann::json::object();
+    obj["type"] = "resolveHost";
+    obj["host"] = host;
     send(obj.dump());
 }
 
@@ -349,6 +361,23 @@ void DaemonSocket::processJSON(const std::string &json)
         }
     }
 
+    auto nativeIt = obj.find("native");
+    if (nativeIt != obj.end() && nativeIt->is_array()) {
+        mCompilerInfo.hasNative = true;
+        for (const nlohmann::json &flag : *nativeIt) {
+            if (flag.is_string())
+                mCompilerInfo.native.push_back(flag.get<std::string>());
+        }
+    }
+
+    auto hostsIt = obj.find("hosts");
+    if (hostsIt != obj.end() && hostsIt->is_object()) {
+        for (auto it = hostsIt->begin(); it != hostsIt->end(); ++it) {
+            if (it->is_string())
+                mHosts[it.key()] = it->get<std::string>();
+        }
+    }
+
     const bool hasError = obj.contains("error");
     if (hasError) {
         WARN("Daemon reported slot acquisition error: %s", obj["error"].dump().c_str());
@@ -6,6 +6,8 @@
 #include <condition_variable>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 class DaemonSocket : public Socket
 {
@@ -45,7 +47,9 @@ public:
 
     void send(const std::string &json);
     void send(Command cmd);
-    void sendAcquireSlot(const std::string &compiler);
+    void sendAcquireSlot(const std::string &compiler, const std::vector<std::string> &resolve = std::vector<std::string>(),
+                         const std::vector<std::string> &native = std::vector<std::string>());
+    void sendResolveHost(const std::string &host);
     bool hasCppSlot() const;
     bool waitForCppSlot();
 
@@ -54,6 +58,13 @@ public:
         return mCompilerInfo;
     }
 
+    // Host to address, for the hosts we asked to resolve and any other the
+    // daemon has warm
+    const std::unordered_map<std::string, std::string> &hosts() const
+    {
+        return mHosts;
+    }
+
     bool hasCompileSlot() const
     {
         return mHasCompileSlot;
@@ -119,6 +130,7 @@ private:
     bool mHasLocalSlot { false };
     std::string mError;
     Client::CompilerInfo mCompilerInfo;
+    std::unordered_map<std::string, std::string> mHosts;
     mutable std::mutex mMutex;
     std::condition_variable mCond;
 };
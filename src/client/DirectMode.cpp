@@ -0,0 +1,185 @@
+#include "DirectMode.h"
+#include "Client.h"
+#include "Config.h"
+#include "LocalCache.h"
+#include "Log.h"
+#include <openssl/evp.h>
+#include <unordered_map>
+
+namespace {
+enum
+{
+    // Manifests keep the most recent sets of includes, a header flipping
+    // between two versions shouldn't miss every time
+    MaxEntries = 8,
+    // Files modified this close to the start of the compile may change again
+    // without their mtime moving
+    MinAgeMs = 2000
+};
+
+std::string digest(const void *data, size_t len)
+{
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (!EVP_Digest(data, len, buf, &size, EVP_sha256(), nullptr))
+        return std::string();
+    return Client::toHex(buf, size);
+}
+
+bool hasTimeMacros(const std::string &contents)
+{
+    // __TIMESTAMP__ contains __TIME__
+    return contents.find("__DATE__") != std::string::npos || contents.find("__TIME__") != std::string::npos;
+}
+
+unsigned long long mtime(const struct stat &st)
+{
+#ifdef __APPLE__
+    const struct timespec &ts = st.st_mtimespec;
+#else
+    const struct timespec &ts = st.st_mtim;
+#endif
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+} // namespace
+
+bool DirectMode::enabled()
+{
+    return Config::directMode && LocalCache::enabled();
+}
+
+std::string DirectMode::key()
+{
+    Client::Data &data = Client::data();
+    if (data.compilerArgs->flags & (CompilerArgs::CPreprocessed | CompilerArgs::ObjectiveCPreprocessed | CompilerArgs::ObjectiveCPlusPlusPreprocessed | CompilerArgs::CPlusPlusPreprocessed))
+        return std::string();
+
+    std::string contents;
+    const std::string &sourceFile = data.compilerArgs->sourceFile();
+    if (!Client::readFile(sourceFile, contents)) {
+        DEBUG("Failed to read %s for direct mode", sourceFile.c_str());
+        return std::string();
+    }
+    if (hasTimeMacros(contents)) {
+        DEBUG("%s uses __DATE__ or __TIME__, not using direct mode", sourceFile.c_str());
+        return std::string();
+    }
+
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    const size_t len = data.sha1Peek(buf);
+    std::string key = "direct";
+    key.append(reinterpret_cast<const char *>(buf), len);
+    key += digest(contents.data(), contents.size());
+    // Relative include paths and the preprocessor's search path. The hashed
+    // arguments leave out the search path options
+    key += Client::cwd();
+    key += data.compilerArgs->searchPathArguments();
+    for (const char *env : { "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH" }) {
+        key += '\0';
+        if (const char *value = getenv(env))
+            key += value;
+    }
+    key += data.hash;
+    key += Config::objectCacheTag.get();
+    return digest(key.data(), key.size());
+}
+
+bool DirectMode::lookup(const std::string &key, Entry *entry)
+{
+    LocalCache::Entry cached;
+    if (!LocalCache::load(key, &cached))
+        return false;
+    const nlohmann::json manifest = nlohmann::json::parse(cached.stdOut, nullptr, false);
+    if (!manifest.is_array())
+        return false;
+
+    // The same header usually shows up in every entry
+    std::unordered_map<std::string, std::string> hashes;
+    for (const nlohmann::json &candidate : manifest) {
+        if (!candidate.is_object())
+            continue;
+        const auto includes = candidate.find("includes");
+        if (includes == candidate.end() || !includes->is_array())
+            continue;
+        bool match = true;
+        for (const nlohmann::json &include : *includes) {
+            if (!include.is_array() || include.size() != 4 || !include[0].is_string() || !include[1].is_number_unsigned() || !include[2].is_number_unsigned() || !include[3].is_string()) {
+                match = false;
+                break;
+            }
+            const std::string path = include[0].get<std::string>();
+            struct stat st;
+            if (stat(path.c_str(), &st) || static_cast<unsigned long long>(st.st_size) != include[1].get<unsigned long long>()) {
+                match = false;
+                break;
+            }
+            if (mtime(st) == include[2].get<unsigned long long>())
+                continue;
+
+            auto it = hashes.find(path);
+            if (it == hashes.end()) {
+                std::string contents;
+                if (!Client::readFile(path, contents)) {
+                    match = false;
+                    break;
+                }
+                it = hashes.emplace(path, digest(contents.data(), contents.size())).first;
+            }
+            if (it->second != include[3].get<std::string>()) {
+                VERBOSE("Direct mode %s changed", path.c_str());
+                match = false;
+                break;
+            }
+        }
+        if (match) {
+            entry->objectKey = candidate.value("objectKey", std::string());
+            entry->stdErr = candidate.value("stderr", std::string());
+            DEBUG("Direct mode hit for %s -> %s", key.c_str(), entry->objectKey.c_str());
+            return !entry->objectKey.empty();
+        }
+    }
+    DEBUG("Direct mode miss for %s, %zu candidates", key.c_str(), manifest.size());
+    return false;
+}
+
+void DirectMode::store(const std::string &key, const Entry &entry, const std::set<std::string> &includes)
+{
+    nlohmann::json files = nlohmann::json::array();
+    for (const std::string &path : includes) {
+        struct stat st;
+        std::string contents;
+        if (stat(path.c_str(), &st) || !Client::readFile(path, contents)) {
+            DEBUG("Failed to read %s for direct mode", path.c_str());
+            return;
+        }
+        if (mtime(st) / 1000000 + MinAgeMs > Client::milliseconds_since_epoch) {
+            DEBUG("%s is too new for direct mode", path.c_str());
+            return;
+        }
+        if (hasTimeMacros(contents)) {
+            DEBUG("%s uses __DATE__ or __TIME__, not using direct mode", path.c_str());
+            return;
+        }
+        files.push_back({ path, static_cast<unsigned long long>(contents.size()), mtime(st), digest(contents.data(), contents.size()) });
+    }
+
+    nlohmann::json manifest = nlohmann::json::array();
+    manifest.push_back({ { "objectKey", entry.objectKey }, { "stderr", entry.stdErr }, { "includes", std::move(files) } });
+    LocalCache::Entry cached;
+    if (LocalCache::load(key, &cached)) {
+        const nlohmann::json old = nlohmann::json::parse(cached.stdOut, nullptr, false);
+        if (old.is_array()) {
+            for (const nlohmann::json &candidate : old) {
+                if (manifest.size() == MaxEntries)
+                    break;
+                if (candidate.is_object() && candidate.value("objectKey", std::string()) != entry.objectKey)
+                    manifest.push_back(candidate);
+            }
+        }
+    }
+
+    LocalCache::Entry out;
+    out.stdOut = manifest.dump();
+    LocalCache::store(key, out, true);
+    DEBUG("Stored direct mode manifest %s with %zu includes", key.c_str(), includes.size());
+}
@@ -0,0 +1,35 @@
+#ifndef DIRECTMODE_H
+#define DIRECTMODE_H
+
+#include <set>
+#include <string>
+
+// ccache style direct mode. The object cache key of a translation unit is
+// remembered together with every file its preprocessed output came from,
+// keyed on the compiler arguments, the source file and the compiler. As long
+// as none of those files changed the key can be reused without running the
+// preprocessor. Manifests are kept in the LocalCache so they're evicted along
+// with everything else.
+//
+// Like ccache this can't see a header that would now shadow one found further
+// down the include path.
+namespace DirectMode {
+struct Entry
+{
+    std::string objectKey;
+    // The preprocessor's warnings, they would be lost otherwise
+    std::string stdErr;
+};
+
+bool enabled();
+
+// Has to be called after CompilerArgs::create hashed the arguments and
+// before anything else is hashed. Returns an empty string if the translation
+// unit can't use direct mode.
+std::string key();
+
+bool lookup(const std::string &key, Entry *entry);
+void store(const std::string &key, const Entry &entry, const std::set<std::string> &includes);
+} // namespace DirectMode
+
+#endif /* DIRECTMODE_H */
@@ -1,7 +1,11 @@
 #include "DwarfPatcher.h"
+#include "Client.h"
 #include "Log.h"
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <iterator>
 #if defined(__clang__)
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wextra-semi"
@@ -26,7 +30,10 @@
 #elif defined(__GNUC__)
 #pragma GCC diagnostic pop
 #endif
+#include <limits>
 #include <string>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <vector>
 #include <zlib.h>
 
@@ -78,6 +85,17 @@ enum
     DW_FORM_ref_sup8 = 0x24,
     DW_FORM_strp_sup = 0x1d,
     DW_FORM_indirect = 0x16,
+    DW_FORM_GNU_addr_index = 0x1f01,
+    DW_FORM_GNU_str_index = 0x1f02,
+    DW_FORM_GNU_ref_alt = 0x1f20,
+    DW_FORM_GNU_strp_alt = 0x1f21,
+    DW_AT_str_offsets_base = 0x72,
+    DW_UT_compile = 0x01,
+    DW_UT_type = 0x02,
+    DW_UT_skeleton = 0x04,
+    DW_UT_split_compile = 0x05,
+    DW_UT_split_type = 0x06,
+    DW_LNCT_path = 0x1,
 };
 
 // ELF constants
@@ -152,6 +170,8 @@ static int formSize(uint16_t form, uint8_t addressSize, uint8_t offsetSize, cons
         case DW_FORM_sec_offset:
         case DW_FORM_ref_addr:
         case DW_FORM_strp_sup:
+        case DW_FORM_GNU_ref_alt:
+        case DW_FORM_GNU_strp_alt:
             return offsetSize;
         case DW_FORM_flag_present:
         case DW_FORM_implicit_const:
@@ -165,6 +185,8 @@ static int formSize(uint16_t form, uint8_t addressSize, uint8_t offsetSize, cons
         case DW_FORM_rnglistx:
         case DW_FORM_strx:
         case DW_FORM_addrx:
+        case DW_FORM_GNU_str_index:
+        case DW_FORM_GNU_addr_index:
             readULEB128(infoPtr);
             return 0; // already advanced
         case DW_FORM_string: {
@@ -212,6 +234,12 @@ static size_t findStringInSection(const char *sectionData, size_t sectionSize, c
     return static_cast<size_t>(-1);
 }
 
+static std::string parentDir(const std::string &path)
+{
+    const size_t lastSlash = path.rfind('/');
+    return lastSlash == std::string::npos ? std::string() : path.substr(0, lastSlash);
+}
+
 // Decompress a SHF_COMPRESSED section. Returns false on failure.
 static bool decompressSection(ELFIO::section *sec, std::vector<uint8_t> &out)
 {
@@ -272,16 +300,67 @@ static std::vector<uint8_t> compressSection(const std::vector<uint8_t> &uncompre
 // Structure to track which .debug_info offsets need relocation patching
 struct AttrLocation
 {
-    size_t infoOffset; // offset within .debug_info where the strp value is
-    bool isName; // true = DW_AT_name, false = DW_AT_comp_dir
+    size_t offset; // where the value is in .debug_info, or in .debug_line for line table entries
+    bool isName; // true = DW_AT_name or a file name, false = DW_AT_comp_dir or a directory
+    uint16_t form; // DW_FORM_strp, DW_FORM_line_strp or one of the string index forms
+    uint8_t size; // 4 or 8 depending on the DWARF format
+    uint64_t index; // for the string index forms
+};
+
+struct UnitInfo
+{
+    uint16_t version;
+    uint8_t offsetSize;
+    // The .debug_info offset of DW_AT_str_offsets_base. Units in .dwo files
+    // don't have it, theirs is the only contribution to .debug_str_offsets.dwo.
+    size_t strOffsetsBase;
 };
 
+static bool isStringIndex(uint64_t form)
+{
+    switch (form) {
+        case DW_FORM_strx:
+        case DW_FORM_strx1:
+        case DW_FORM_strx2:
+        case DW_FORM_strx3:
+        case DW_FORM_strx4:
+        case DW_FORM_GNU_str_index:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool isStringForm(uint64_t form)
+{
+    return form == DW_FORM_strp || form == DW_FORM_line_strp || isStringIndex(form);
+}
+
+static uint64_t readStringIndex(uint16_t form, const uint8_t *p)
+{
+    switch (form) {
+        case DW_FORM_strx1:
+        case DW_FORM_strx2:
+        case DW_FORM_strx3:
+        case DW_FORM_strx4: {
+            const int size = form - DW_FORM_strx1 + 1;
+            uint64_t ret = 0;
+            for (int i = size - 1; i >= 0; --i)
+                ret = (ret << 8) | p[i];
+            return ret;
+        }
+        default:
+            return readULEB128(p);
+    }
+}
+
 // Parse the first CU's first DIE to find DW_AT_name and DW_AT_comp_dir positions.
 // Takes decompressed data buffers.
 static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const uint8_t *abbrevData, size_t abbrevSize,
-                              std::vector<AttrLocation> &locations)
+                              std::vector<AttrLocation> &locations, UnitInfo &unit)
 {
-    (void)infoSize;
+    if (infoSize < 12)
+        return false;
     const uint8_t *p = infoData;
 
     // Read CU header
@@ -299,9 +378,10 @@ static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const ui
 
     uint64_t abbrevOffset;
     uint8_t addressSize;
+    uint8_t unitType = DW_UT_compile;
 
     if (version >= 5) {
-        p++; // unit_type
+        unitType = *p++;
         addressSize = *p++;
         if (is64bit) {
             memcpy(&abbrevOffset, p, 8);
@@ -312,6 +392,18 @@ static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const ui
             abbrevOffset = tmp;
             p += 4;
         }
+        switch (unitType) {
+            case DW_UT_skeleton:
+            case DW_UT_split_compile:
+                p += 8; // dwo_id
+                break;
+            case DW_UT_type:
+            case DW_UT_split_type:
+                p += 8 + offsetSize; // type_signature, type_offset
+                break;
+            default:
+                break;
+        }
     } else {
         if (is64bit) {
             memcpy(&abbrevOffset, p, 8);
@@ -324,6 +416,12 @@ static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const ui
         }
         addressSize = *p++;
     }
+    if (abbrevOffset >= abbrevSize || p >= infoData + infoSize)
+        return false;
+
+    unit.version = version;
+    unit.offsetSize = offsetSize;
+    unit.strOffsetsBase = std::string::npos;
 
     uint64_t abbrevCode = readULEB128(p);
     if (abbrevCode == 0)
@@ -350,8 +448,11 @@ static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const ui
 
                 size_t attrOffset = p - infoData;
 
-                if ((attrName == DW_AT_name || attrName == DW_AT_comp_dir) && (attrForm == DW_FORM_strp || attrForm == DW_FORM_line_strp)) {
-                    locations.push_back({ attrOffset, attrName == DW_AT_name });
+                if ((attrName == DW_AT_name || attrName == DW_AT_comp_dir) && isStringForm(attrForm)) {
+                    const uint64_t index = isStringIndex(attrForm) ? readStringIndex(static_cast<uint16_t>(attrForm), p) : 0;
+                    locations.push_back({ attrOffset, attrName == DW_AT_name, static_cast<uint16_t>(attrForm), offsetSize, index });
+                } else if (attrName == DW_AT_str_offsets_base && attrForm == DW_FORM_sec_offset) {
+                    unit.strOffsetsBase = attrOffset;
                 }
 
                 // Advance past attribute value
@@ -361,6 +462,8 @@ static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const ui
                     return false;
                 if (p == before)
                     p += sz;
+                if (p > infoData + infoSize)
+                    return false;
             }
             return true;
         } else {
@@ -377,7 +480,76 @@ static bool findAttrLocations(const uint8_t *infoData, size_t infoSize, const ui
     return false;
 }
 
-bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldSourcePath, const std::string &newSourcePath)
+// Finds the paths in the directory and file tables of every DWARF 5 line
+// table in .debug_line. Earlier versions have the strings inline, they can't
+// change length.
+static bool findLinePaths(const uint8_t *lineData, size_t lineSize, std::vector<AttrLocation> &locations)
+{
+    const uint8_t *p = lineData;
+    const uint8_t *sectionEnd = lineData + lineSize;
+    while (sectionEnd - p >= 4) {
+        uint32_t unitLength32;
+        memcpy(&unitLength32, p, 4);
+        p += 4;
+        uint64_t unitLength = unitLength32;
+        const bool is64bit = unitLength32 == 0xFFFFFFFF;
+        if (is64bit) {
+            if (sectionEnd - p < 8)
+                return false;
+            memcpy(&unitLength, p, 8);
+            p += 8;
+        }
+        if (unitLength > static_cast<uint64_t>(sectionEnd - p))
+            return false;
+        const uint8_t *end = p + unitLength;
+        const uint8_t offsetSize = is64bit ? 8 : 4;
+
+        uint16_t version;
+        memcpy(&version, p, 2);
+        if (version != 5) {
+            p = end;
+            continue;
+        }
+        // version, address_size, segment_selector_size, header_length,
+        // minimum_instruction_length, maximum_operations_per_instruction,
+        // default_is_stmt, line_base, line_range
+        p += 4 + offsetSize + 5;
+        const uint8_t opcodeBase = *p++;
+        if (opcodeBase)
+            p += opcodeBase - 1;
+
+        for (bool isName : { false, true }) {
+            if (p >= end)
+                return false;
+            std::vector<std::pair<uint64_t, uint64_t>> formats(*p++);
+            for (auto &format : formats) {
+                format.first = readULEB128(p);
+                format.second = readULEB128(p);
+            }
+            const uint64_t count = readULEB128(p);
+            for (uint64_t i = 0; i < count; ++i) {
+                for (const auto &format : formats) {
+                    if (p >= end)
+                        return false;
+                    if (format.first == DW_LNCT_path && isStringForm(format.second)) {
+                        const uint64_t index = isStringIndex(format.second) ? readStringIndex(static_cast<uint16_t>(format.second), p) : 0;
+                        locations.push_back({ static_cast<size_t>(p - lineData), isName, static_cast<uint16_t>(format.second), offsetSize, index });
+                    }
+                    const uint8_t *before = p;
+                    const int sz = formSize(static_cast<uint16_t>(format.second), 0, offsetSize, p);
+                    if (sz < 0)
+                        return false;
+                    if (p == before)
+                        p += sz;
+                }
+            }
+        }
+        p = end;
+    }
+    return true;
+}
+
+static bool patchWithElfio(const std::string &objectFile, const std::string &oldSourcePath, const std::string &newSourcePath)
 {
     ELFIO::elfio elf;
     if (!elf.load(objectFile)) {
@@ -445,22 +617,17 @@ bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldS
     }
 
     // Find DW_AT_name and DW_AT_comp_dir positions in .debug_info
+    // Only DW_FORM_strp is handled here, this is the fallback for compressed sections
     std::vector<AttrLocation> attrLocations;
-    if (!findAttrLocations(infoData, infoSize, abbrevDataPtr, abbrevSize, attrLocations) || attrLocations.empty()) {
+    UnitInfo unit;
+    if (!findAttrLocations(infoData, infoSize, abbrevDataPtr, abbrevSize, attrLocations, unit) || attrLocations.empty()) {
         DEBUG("DwarfPatcher: could not find DW_AT_name/DW_AT_comp_dir in %s", objectFile.c_str());
         return true;
     }
 
     // Compute old/new directory paths
-    std::string oldDir, newDir;
-    {
-        size_t lastSlash = oldSourcePath.rfind('/');
-        if (lastSlash != std::string::npos)
-            oldDir = oldSourcePath.substr(0, lastSlash);
-        lastSlash = newSourcePath.rfind('/');
-        if (lastSlash != std::string::npos)
-            newDir = newSourcePath.substr(0, lastSlash);
-    }
+    const std::string oldDir = parentDir(oldSourcePath);
+    const std::string newDir = parentDir(newSourcePath);
 
     // Check if .debug_str is compressed (SHF_COMPRESSED)
     bool isCompressed = (debugStr->get_flags() & SHF_COMPRESSED) != 0;
@@ -495,11 +662,13 @@ bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldS
         bool patched = false;
 
         for (const auto &loc : attrLocations) {
+            if (loc.form != DW_FORM_strp)
+                continue;
             // Find the relocation entry for this .debug_info offset
             for (ELFIO::Elf_Xword i = 0; i < rela.get_entries_num(); ++i) {
                 rela.get_entry(i, offset, symbol, rtype, addend);
 
-                if (static_cast<size_t>(offset) != loc.infoOffset)
+                if (static_cast<size_t>(offset) != loc.offset)
                     continue;
 
                 // Verify this relocation targets .debug_str
@@ -515,7 +684,7 @@ bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldS
                 syma.get_symbol(symbol, symName, symValue, symSize, symBind, symType, symSection, symOther);
 
                 if (symSection != debugStrIdx) {
-                    DEBUG("DwarfPatcher: relocation at 0x%zx targets section %d, not .debug_str (%d)", loc.infoOffset, symSection, debugStrIdx);
+                    DEBUG("DwarfPatcher: relocation at 0x%zx targets section %d, not .debug_str (%d)", loc.offset, symSection, debugStrIdx);
                     continue;
                 }
 
@@ -602,18 +771,20 @@ bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldS
         bool patched = false;
 
         for (const auto &loc : attrLocations) {
+            if (loc.form != DW_FORM_strp || loc.size != 4)
+                continue;
             uint32_t currentOffset;
-            memcpy(&currentOffset, &infoDataCopy[loc.infoOffset], 4);
+            memcpy(&currentOffset, &infoDataCopy[loc.offset], 4);
 
             if (loc.isName && currentOffset == oldOffset) {
                 uint32_t val = static_cast<uint32_t>(newStrOffset);
-                memcpy(&infoDataCopy[loc.infoOffset], &val, 4);
+                memcpy(&infoDataCopy[loc.offset], &val, 4);
                 patched = true;
             } else if (!loc.isName && !oldDir.empty()) {
                 size_t oldDirOffset = findStringInSection(debugStr->get_data(), debugStr->get_size(), oldDir);
                 if (currentOffset == oldDirOffset && newDirOffset != static_cast<size_t>(-1)) {
                     uint32_t val = static_cast<uint32_t>(newDirOffset);
-                    memcpy(&infoDataCopy[loc.infoOffset], &val, 4);
+                    memcpy(&infoDataCopy[loc.offset], &val, 4);
                     patched = true;
                 }
             }
@@ -632,3 +803,542 @@ bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldS
     DEBUG("DwarfPatcher: patched source path in %s: %s -> %s", objectFile.c_str(), oldSourcePath.c_str(), newSourcePath.c_str());
     return true;
 }
+// In place patching. Objects from the cache can carry hundreds of megabytes
+// of debug info and loading and saving all of it to change two string offsets
+// made every hit pay for a full rewrite. Instead the file is mapped, the
+// section headers are walked directly and the fixed width offsets, or the
+// addends of the relocations pointing at them, are overwritten where they
+// are. The new strings are appended to .debug_str and .debug_line_str, which
+// are first moved to the end of the file unless they're already there, so
+// their section headers are the only ones that change. DwarfStreamPatcher
+// works out that layout, the same way it does for a file that's streaming
+// in. Compressed sections, a foreign byte order and other unusual layouts are
+// left to ELFIO.
+namespace {
+enum class InPlace
+{
+    Done,
+    Unsupported,
+    Failed
+};
+
+struct Elf32
+{
+    using Ehdr = ELFIO::Elf32_Ehdr;
+    using Shdr = ELFIO::Elf32_Shdr;
+    using Sym = ELFIO::Elf32_Sym;
+    using Rel = ELFIO::Elf32_Rel;
+    using Rela = ELFIO::Elf32_Rela;
+    static constexpr size_t elfClass = 32;
+    static uint64_t symbol(uint64_t info)
+    {
+        return ELF32_R_SYM(info);
+    }
+};
+
+struct Elf64
+{
+    using Ehdr = ELFIO::Elf64_Ehdr;
+    using Shdr = ELFIO::Elf64_Shdr;
+    using Sym = ELFIO::Elf64_Sym;
+    using Rel = ELFIO::Elf64_Rel;
+    using Rela = ELFIO::Elf64_Rela;
+    static constexpr size_t elfClass = 64;
+    static uint64_t symbol(uint64_t info)
+    {
+        return ELF64_R_SYM(info);
+    }
+};
+
+struct MappedFile
+{
+    ~MappedFile()
+    {
+        if (data)
+            munmap(data, size);
+        if (fd != -1)
+            ::close(fd);
+    }
+
+    int fd { -1 };
+    uint8_t *data { nullptr };
+    size_t size { 0 };
+};
+
+uint64_t readOffset(const uint8_t *p, size_t size)
+{
+    if (size == 4) {
+        uint32_t ret;
+        memcpy(&ret, p, 4);
+        return ret;
+    }
+    uint64_t ret;
+    memcpy(&ret, p, 8);
+    return ret;
+}
+
+void writeOffset(uint8_t *p, size_t size, uint64_t value)
+{
+    if (size == 4) {
+        const uint32_t val = static_cast<uint32_t>(value);
+        memcpy(p, &val, 4);
+    } else {
+        memcpy(p, &value, 8);
+    }
+}
+
+bool writeAll(int fd, const void *data, size_t size, uint64_t offset)
+{
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    while (size) {
+        ssize_t w;
+        EINTRWRAP(w, pwrite(fd, p, size, static_cast<off_t>(offset)));
+        if (w <= 0)
+            return false;
+        p += w;
+        size -= w;
+        offset += w;
+    }
+    return true;
+}
+
+template <typename Shdr>
+bool inBounds(const Shdr &section, size_t fileSize, size_t align)
+{
+    return section.sh_type != ELFIO::SHT_NOBITS && section.sh_offset <= fileSize && section.sh_size <= fileSize - section.sh_offset && !(section.sh_offset % align);
+}
+
+// Returns the relocation for the offset in the section relSection applies
+// to if it points into the section with index target
+template <typename Elf, typename Rel>
+Rel *findRelocation(const MappedFile &file, const typename Elf::Shdr *sections, const typename Elf::Shdr &relSection, size_t target, uint64_t offset)
+{
+    using Sym = typename Elf::Sym;
+    Rel *rels = reinterpret_cast<Rel *>(file.data + relSection.sh_offset);
+    const typename Elf::Shdr &symtab = sections[relSection.sh_link];
+    const Sym *symbols = reinterpret_cast<const Sym *>(file.data + symtab.sh_offset);
+    const size_t symbolCount = symtab.sh_size / sizeof(Sym);
+    const size_t count = relSection.sh_size / sizeof(Rel);
+    for (size_t i = 0; i < count; ++i) {
+        if (rels[i].r_offset != offset)
+            continue;
+        const uint64_t symbol = Elf::symbol(rels[i].r_info);
+        if (symbol >= symbolCount || symbols[symbol].st_shndx != target || symbols[symbol].st_value) {
+            DEBUG("DwarfPatcher: relocation at 0x%llx doesn't target the start of section %zu", static_cast<unsigned long long>(offset), target);
+            return nullptr;
+        }
+        return rels + i;
+    }
+    return nullptr;
+}
+
+template <typename Elf>
+InPlace patchInPlace(MappedFile &file, const std::string &objectFile, const std::string &oldSourcePath, const std::string &newSourcePath)
+{
+    using Shdr = typename Elf::Shdr;
+    const auto *ehdr = reinterpret_cast<const typename Elf::Ehdr *>(file.data);
+    if (file.size < sizeof(*ehdr) || ehdr->e_shentsize != sizeof(Shdr) || !ehdr->e_shnum || ehdr->e_shstrndx >= ehdr->e_shnum || ehdr->e_shoff % alignof(Shdr) || ehdr->e_shoff > file.size
+        || (file.size - ehdr->e_shoff) / sizeof(Shdr) < ehdr->e_shnum) {
+        return InPlace::Unsupported;
+    }
+
+    Shdr *sections = reinterpret_cast<Shdr *>(file.data + ehdr->e_shoff);
+    const size_t count = ehdr->e_shnum;
+    const Shdr &shstrtab = sections[ehdr->e_shstrndx];
+    if (!inBounds(shstrtab, file.size, 1))
+        return InPlace::Unsupported;
+    const char *names = reinterpret_cast<const char *>(file.data + shstrtab.sh_offset);
+
+    size_t info = 0, abbrev = 0, str = 0, lineStr = 0, line = 0, strOffsets = 0;
+    for (size_t i = 1; i < count; ++i) {
+        const size_t nameOffset = sections[i].sh_name;
+        if (nameOffset >= shstrtab.sh_size || !memchr(names + nameOffset, '\0', shstrtab.sh_size - nameOffset))
+            continue;
+        const char *name = names + nameOffset;
+        if (!strcmp(name, ".debug_info") || !strcmp(name, ".debug_info.dwo"))
+            info = i;
+        else if (!strcmp(name, ".debug_abbrev") || !strcmp(name, ".debug_abbrev.dwo"))
+            abbrev = i;
+        else if (!strcmp(name, ".debug_str") || !strcmp(name, ".debug_str.dwo"))
+            str = i;
+        else if (!strcmp(name, ".debug_line_str"))
+            lineStr = i;
+        else if (!strcmp(name, ".debug_line") || !strcmp(name, ".debug_line.dwo"))
+            line = i;
+        else if (!strcmp(name, ".debug_str_offsets") || !strcmp(name, ".debug_str_offsets.dwo"))
+            strOffsets = i;
+    }
+
+    if (!info || !abbrev) {
+        DEBUG("DwarfPatcher: no .debug_info or .debug_abbrev in %s", objectFile.c_str());
+        return InPlace::Done;
+    }
+
+    for (size_t idx : { info, abbrev, str, lineStr, line, strOffsets }) {
+        if (idx && (sections[idx].sh_flags & SHF_COMPRESSED || !inBounds(sections[idx], file.size, 1)))
+            return InPlace::Unsupported;
+    }
+
+    // The relocations for the sections that hold string offsets
+    size_t rels[3] = {};
+    const size_t containers[3] = { info, line, strOffsets };
+    for (size_t i = 1; i < count; ++i) {
+        const Shdr &relSection = sections[i];
+        if (relSection.sh_type != ELFIO::SHT_REL && relSection.sh_type != ELFIO::SHT_RELA)
+            continue;
+        const size_t *container = std::find(containers, containers + 3, relSection.sh_info);
+        if (!relSection.sh_info || container == containers + 3)
+            continue;
+        const size_t entSize = relSection.sh_type == ELFIO::SHT_RELA ? sizeof(typename Elf::Rela) : sizeof(typename Elf::Rel);
+        if (relSection.sh_flags & SHF_COMPRESSED || relSection.sh_entsize != entSize || !inBounds(relSection, file.size, alignof(typename Elf::Rela)) || relSection.sh_link >= count
+            || !inBounds(sections[relSection.sh_link], file.size, alignof(typename Elf::Sym))) {
+            return InPlace::Unsupported;
+        }
+        rels[container - containers] = i;
+    }
+
+    // Returns where the offset into target that's at offset in container
+    // lives, the addend of its relocation with RELA, the bytes themselves
+    // otherwise. size is updated to the width of the addend.
+    auto locate = [&](size_t container, uint64_t offset, size_t *size, size_t target) -> uint8_t * {
+        const Shdr &section = sections[container];
+        if (offset > section.sh_size || section.sh_size - offset < *size)
+            return nullptr;
+        const size_t rel = rels[std::find(containers, containers + 3, container) - containers];
+        if (!rel)
+            return file.data + section.sh_offset + offset;
+        if (sections[rel].sh_type == ELFIO::SHT_RELA) {
+            // The bytes in the section are ignored, the offset is the addend
+            auto *entry = findRelocation<Elf, typename Elf::Rela>(file, sections, sections[rel], target, offset);
+            if (!entry)
+                return nullptr;
+            *size = sizeof(entry->r_addend);
+            return reinterpret_cast<uint8_t *>(&entry->r_addend);
+        }
+        if (!findRelocation<Elf, typename Elf::Rel>(file, sections, sections[rel], target, offset))
+            return nullptr;
+        return file.data + section.sh_offset + offset;
+    };
+
+    std::vector<AttrLocation> locations;
+    UnitInfo unit;
+    if (!findAttrLocations(file.data + sections[info].sh_offset, sections[info].sh_size, file.data + sections[abbrev].sh_offset, sections[abbrev].sh_size, locations, unit)) {
+        DEBUG("DwarfPatcher: could not find DW_AT_name/DW_AT_comp_dir in %s", objectFile.c_str());
+        return InPlace::Done;
+    }
+    const size_t infoLocations = locations.size();
+    if (line && !findLinePaths(file.data + sections[line].sh_offset, sections[line].sh_size, locations)) {
+        DEBUG("DwarfPatcher: failed to parse .debug_line in %s", objectFile.c_str());
+        locations.resize(infoLocations);
+    }
+
+    uint64_t strOffsetsBase = std::numeric_limits<uint64_t>::max();
+    if (strOffsets) {
+        const Shdr &section = sections[strOffsets];
+        const uint8_t *data = file.data + section.sh_offset;
+        if (unit.strOffsetsBase != std::string::npos) {
+            size_t size = unit.offsetSize;
+            if (const uint8_t *value = locate(info, unit.strOffsetsBase, &size, strOffsets))
+                strOffsetsBase = readOffset(value, size);
+        } else if (section.sh_size >= 8 && readOffset(data, 4) == section.sh_size - 4 && data[4] == 5 && !data[5]) {
+            // A .dwo has a single contribution and no DW_AT_str_offsets_base
+            strOffsetsBase = 8;
+        } else if (section.sh_size >= 16 && readOffset(data, 4) == 0xffffffff && readOffset(data + 4, 8) == section.sh_size - 12 && data[12] == 5 && !data[13]) {
+            strOffsetsBase = 16;
+        } else {
+            // GCC leaves the header out
+            strOffsetsBase = 0;
+        }
+    }
+
+    const std::string oldDir = parentDir(oldSourcePath);
+    const std::string newDir = parentDir(newSourcePath);
+    std::vector<DwarfStreamPatcher::Strings> strings(2);
+    for (size_t i : { 0, 1 }) {
+        const size_t idx = i ? lineStr : str;
+        strings[i] = { static_cast<size_t>(ehdr->e_shoff + idx * sizeof(Shdr)), sections[idx].sh_offset, sections[idx].sh_size, std::max<size_t>(sections[idx].sh_addralign, 1), {} };
+    }
+
+    for (size_t i = 0; i < locations.size(); ++i) {
+        const AttrLocation &loc = locations[i];
+        if (!loc.isName && (oldDir.empty() || newDir.empty() || oldDir == newDir))
+            continue;
+        const size_t container = i < infoLocations ? info : line;
+        const size_t target = loc.form == DW_FORM_line_strp ? lineStr : str;
+        if (!target)
+            continue;
+        size_t size = loc.size;
+        uint8_t *value;
+        if (isStringIndex(loc.form)) {
+            if (!strOffsets || strOffsetsBase > sections[strOffsets].sh_size || loc.index >= (sections[strOffsets].sh_size - strOffsetsBase) / unit.offsetSize)
+                continue;
+            size = unit.offsetSize;
+            value = locate(strOffsets, strOffsetsBase + loc.index * unit.offsetSize, &size, target);
+        } else {
+            value = locate(container, loc.offset, &size, target);
+        }
+        if (!value)
+            continue;
+
+        const Shdr &strSection = sections[target];
+        const uint8_t *strData = file.data + strSection.sh_offset;
+        const uint64_t offset = readOffset(value, size);
+        if (offset >= strSection.sh_size || !memchr(strData + offset, '\0', strSection.sh_size - offset))
+            continue;
+        const std::string &expected = loc.isName ? oldSourcePath : oldDir;
+        if (expected != reinterpret_cast<const char *>(strData + offset))
+            continue;
+        // Several string indexes can share an entry in .debug_str_offsets
+        std::vector<DwarfStreamPatcher::Ref> &refs = strings[target == lineStr].refs;
+        const size_t fileOffset = value - file.data;
+        if (std::none_of(refs.begin(), refs.end(), [fileOffset](const DwarfStreamPatcher::Ref &ref) { return ref.offset == fileOffset; }))
+            refs.push_back({ fileOffset, size, loc.isName });
+    }
+
+    strings.erase(std::remove_if(strings.begin(), strings.end(), [](const DwarfStreamPatcher::Strings &section) { return section.refs.empty(); }), strings.end());
+    if (strings.empty()) {
+        DEBUG("DwarfPatcher: nothing to patch in %s", objectFile.c_str());
+        return InPlace::Done;
+    }
+
+    DwarfStreamPatcher patcher;
+    if (!patcher.init(Elf::elfClass, strings, file.size, oldSourcePath, newSourcePath))
+        return InPlace::Unsupported;
+    patcher.capture(file.data, file.size, 0);
+    const std::string &tail = patcher.tail();
+    if (!writeAll(file.fd, tail.data(), tail.size(), file.size)) {
+        ERROR("DwarfPatcher: failed to grow the string sections in %s %d %s", objectFile.c_str(), errno, strerror(errno));
+        // The headers still describe the original layout, only the tail has to go
+        if (ftruncate(file.fd, static_cast<off_t>(file.size)))
+            ERROR("DwarfPatcher: failed to truncate %s %d %s", objectFile.c_str(), errno, strerror(errno));
+        return InPlace::Failed;
+    }
+    patcher.apply(file.data);
+
+    DEBUG("DwarfPatcher: patched in place in %s: %s -> %s", objectFile.c_str(), oldSourcePath.c_str(), newSourcePath.c_str());
+    return InPlace::Done;
+}
+
+InPlace patchInPlace(const std::string &objectFile, const std::string &oldSourcePath, const std::string &newSourcePath)
+{
+    MappedFile file;
+    EINTRWRAP(file.fd, ::open(objectFile.c_str(), O_RDWR | O_CLOEXEC));
+    if (file.fd == -1) {
+        ERROR("DwarfPatcher: failed to open %s %d %s", objectFile.c_str(), errno, strerror(errno));
+        return InPlace::Failed;
+    }
+    struct stat st;
+    if (fstat(file.fd, &st) || static_cast<size_t>(st.st_size) < ELFIO::EI_NIDENT)
+        return InPlace::Unsupported;
+    void *mapped = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+    if (mapped == MAP_FAILED) {
+        DEBUG("DwarfPatcher: failed to mmap %s %d %s", objectFile.c_str(), errno, strerror(errno));
+        return InPlace::Unsupported;
+    }
+    file.data = static_cast<uint8_t *>(mapped);
+    file.size = st.st_size;
+
+    const uint8_t *ident = file.data;
+    if (ident[ELFIO::EI_MAG0] != ELFIO::ELFMAG0 || ident[ELFIO::EI_MAG1] != ELFIO::ELFMAG1 || ident[ELFIO::EI_MAG2] != ELFIO::ELFMAG2 || ident[ELFIO::EI_MAG3] != ELFIO::ELFMAG3)
+        return InPlace::Unsupported;
+    const uint16_t probe = 1;
+    const unsigned char hostData = *reinterpret_cast<const unsigned char *>(&probe) ? ELFIO::ELFDATA2LSB : ELFIO::ELFDATA2MSB;
+    if (ident[ELFIO::EI_DATA] != hostData)
+        return InPlace::Unsupported;
+    switch (ident[ELFIO::EI_CLASS]) {
+        case ELFIO::ELFCLASS32:
+            return patchInPlace<Elf32>(file, objectFile, oldSourcePath, newSourcePath);
+        case ELFIO::ELFCLASS64:
+            return patchInPlace<Elf64>(file, objectFile, oldSourcePath, newSourcePath);
+        default:
+            return InPlace::Unsupported;
+    }
+}
+} // namespace
+
+bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldSourcePath, const std::string &newSourcePath)
+{
+    switch (patchInPlace(objectFile, oldSourcePath, newSourcePath)) {
+        case InPlace::Done:
+            return true;
+        case InPlace::Failed:
+            return false;
+        case InPlace::Unsupported:
+            break;
+    }
+    DEBUG("DwarfPatcher: falling back to ELFIO for %s", objectFile.c_str());
+    return patchWithElfio(objectFile, oldSourcePath, newSourcePath);
+}
+
+bool DwarfStreamPatcher::init(const nlohmann::json &description, size_t fileSize, const std::string &oldSourcePath, const std::string &newSourcePath)
+{
+    mRanges.clear();
+    mMoved.clear();
+    mTail.clear();
+
+    // The values are written in our byte order and the builder only describes little endian objects
+    const uint16_t probe = 1;
+    if (!*reinterpret_cast<const unsigned char *>(&probe) || !description.is_object())
+        return false;
+
+    auto number = [](const nlohmann::json &object, const char *key, size_t *out) {
+        const auto it = object.find(key);
+        if (it == object.end() || !it->is_number_unsigned())
+            return false;
+        *out = it->get<size_t>();
+        return true;
+    };
+
+    size_t elfClass;
+    const auto sections = description.find("sections");
+    if (!number(description, "elfClass", &elfClass) || sections == description.end() || !sections->is_array())
+        return false;
+
+    std::vector<Strings> strings;
+    for (const nlohmann::json &section : *sections) {
+        Strings str;
+        if (!section.is_object() || !number(section, "header", &str.header) || !number(section, "offset", &str.offset) || !number(section, "size", &str.size) || !number(section, "align", &str.align))
+            return false;
+        const auto refs = section.find("refs");
+        if (refs == section.end() || !refs->is_array())
+            return false;
+        for (const nlohmann::json &ref : *refs) {
+            Ref r;
+            if (!ref.is_object() || !number(ref, "offset", &r.offset) || !number(ref, "size", &r.size))
+                return false;
+            r.isName = ref.value("name", false);
+            str.refs.push_back(r);
+        }
+        strings.push_back(std::move(str));
+    }
+    return init(elfClass, strings, fileSize, oldSourcePath, newSourcePath);
+}
+
+bool DwarfStreamPatcher::init(size_t elfClass, const std::vector<Strings> &sections, size_t fileSize, const std::string &oldSourcePath, const std::string &newSourcePath)
+{
+    mRanges.clear();
+    mMoved.clear();
+    mTail.clear();
+
+    size_t headerSize, offsetField, sizeField, fieldSize;
+    if (elfClass == 64) {
+        headerSize = sizeof(ELFIO::Elf64_Shdr);
+        offsetField = offsetof(ELFIO::Elf64_Shdr, sh_offset);
+        sizeField = offsetof(ELFIO::Elf64_Shdr, sh_size);
+        fieldSize = 8;
+    } else if (elfClass == 32) {
+        headerSize = sizeof(ELFIO::Elf32_Shdr);
+        offsetField = offsetof(ELFIO::Elf32_Shdr, sh_offset);
+        sizeField = offsetof(ELFIO::Elf32_Shdr, sh_size);
+        fieldSize = 4;
+    } else {
+        return false;
+    }
+
+    // Nothing may follow a string section once it grows. The one at the end
+    // of the file, if any, grows where it is and the others are copied after it.
+    std::vector<const Strings *> order;
+    for (const Strings &section : sections) {
+        if (section.offset + section.size == fileSize) {
+            order.insert(order.begin(), &section);
+        } else {
+            order.push_back(&section);
+        }
+    }
+
+    const std::string oldDir = parentDir(oldSourcePath);
+    const std::string newDir = parentDir(newSourcePath);
+    size_t refCount = 0;
+    for (const Strings *section : order) {
+        if (section->header > fileSize || fileSize - section->header < headerSize || section->offset > fileSize || section->size > fileSize - section->offset || !section->align)
+            return false;
+
+        std::string append;
+        uint64_t nameOffset = 0, dirOffset = 0;
+        size_t minSize = 8;
+        std::vector<Range> ranges;
+        for (const Ref &ref : section->refs) {
+            if ((ref.size != 4 && ref.size != 8) || ref.offset > fileSize || fileSize - ref.offset < ref.size)
+                return false;
+            if (!ref.isName && (newDir.empty() || oldDir == newDir))
+                continue;
+            uint64_t &strOffset = ref.isName ? nameOffset : dirOffset;
+            if (!strOffset) {
+                strOffset = section->size + append.size();
+                append += ref.isName ? newSourcePath : newDir;
+                append += '\0';
+            }
+            minSize = std::min(minSize, ref.size);
+            Range range { ref.offset, std::string(ref.size, '\0') };
+            writeOffset(reinterpret_cast<uint8_t *>(&range.bytes[0]), ref.size, strOffset);
+            ranges.push_back(std::move(range));
+        }
+        if (ranges.empty())
+            continue;
+
+        const uint64_t newSize = section->size + append.size();
+        if (minSize == 4 && newSize > UINT32_MAX)
+            return false;
+        const bool move = !mTail.empty() || section->offset + section->size != fileSize;
+        const uint64_t start = move ? (fileSize + mTail.size() + section->align - 1) / section->align * section->align : section->offset;
+        if (fieldSize == 4 && start + newSize > UINT32_MAX)
+            return false;
+        if (move) {
+            mTail.resize(start - fileSize);
+            mMoved.push_back({ section->offset, section->size, mTail.size() });
+            mTail.resize(mTail.size() + section->size);
+        }
+        mTail += append;
+
+        refCount += ranges.size();
+        std::move(ranges.begin(), ranges.end(), std::back_inserter(mRanges));
+        Range offsetRange { section->header + offsetField, std::string(fieldSize, '\0') };
+        writeOffset(reinterpret_cast<uint8_t *>(&offsetRange.bytes[0]), fieldSize, start);
+        mRanges.push_back(std::move(offsetRange));
+        Range sizeRange { section->header + sizeField, std::string(fieldSize, '\0') };
+        writeOffset(reinterpret_cast<uint8_t *>(&sizeRange.bytes[0]), fieldSize, newSize);
+        mRanges.push_back(std::move(sizeRange));
+    }
+    DEBUG("DwarfPatcher: patching %zu string offsets, %zu bytes after the end", refCount, mTail.size());
+    return true;
+}
+
+void DwarfStreamPatcher::capture(const void *data, size_t len, size_t offset)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    const size_t end = offset + len;
+    for (const Moved &moved : mMoved) {
+        if (offset >= moved.offset + moved.size || end <= moved.offset)
+            continue;
+        const size_t from = std::max(offset, moved.offset);
+        const size_t to = std::min(end, moved.offset + moved.size);
+        memcpy(&mTail[moved.tail + from - moved.offset], bytes + from - offset, to - from);
+    }
+}
+
+const void *DwarfStreamPatcher::patch(const void *data, size_t len, size_t offset)
+{
+    capture(data, len, offset);
+
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    const size_t end = offset + len;
+    const void *ret = data;
+    for (const Range &range : mRanges) {
+        if (range.offset >= end || range.offset + range.bytes.size() <= offset)
+            continue;
+        if (ret == data) {
+            mBuffer.assign(bytes, bytes + len);
+            ret = mBuffer.data();
+        }
+        const size_t from = std::max(offset, range.offset);
+        const size_t to = std::min(end, range.offset + range.bytes.size());
+        memcpy(&mBuffer[from - offset], range.bytes.data() + from - range.offset, to - from);
+    }
+    return ret;
+}
+
+void DwarfStreamPatcher::apply(unsigned char *file) const
+{
+    for (const Range &range : mRanges)
+        memcpy(file + range.offset, range.bytes.data(), range.bytes.size());
+}
@@ -1,11 +1,87 @@
 #ifndef DWARFPATCHER_H
 #define DWARFPATCHER_H
 
+#include <nlohmann/json.hpp>
 #include <string>
+#include <vector>
 
 // Patches DWARF debug info in an ELF object file, replacing oldSourcePath
-// with newSourcePath in DW_AT_name/DW_AT_comp_dir attributes.
+// with newSourcePath in DW_AT_name/DW_AT_comp_dir attributes and in the
+// DWARF 5 line table's directory and file entries. The strings can be in
+// .debug_str, .debug_line_str or, through .debug_str_offsets, be referenced by
+// index. The file is patched in place where possible, only the string
+// sections grow.
 // Returns true on success (or if no patching was needed), false on error.
 bool patchDwarfSourcePath(const std::string &objectFile, const std::string &oldSourcePath, const std::string &newSourcePath);
 
+// Does the same thing to an object from the builder's object cache while it's
+// being written, using the locations the builder found when it cached it (see
+// DwarfPatch.ts). The bytes holding the string offsets and the string
+// sections' headers are replaced on their way to disk and the new strings go
+// after the end of the file, so a hit with a different source path costs a
+// single write. patchDwarfSourcePath plans its in place patch with it too.
+class DwarfStreamPatcher
+{
+public:
+    struct Ref
+    {
+        // File offset and width of a string offset, wherever it lives
+        size_t offset;
+        size_t size;
+        // DW_AT_name or a file name, otherwise a directory
+        bool isName;
+    };
+
+    // A string section and the offsets pointing into it
+    struct Strings
+    {
+        // File offset of its section header
+        size_t header;
+        size_t offset;
+        size_t size;
+        size_t align;
+        std::vector<Ref> refs;
+    };
+
+    // Returns false if the description can't be used, the file has to go
+    // through patchDwarfSourcePath once it's written then
+    bool init(const nlohmann::json &description, size_t fileSize, const std::string &oldSourcePath, const std::string &newSourcePath);
+    bool init(size_t elfClass, const std::vector<Strings> &sections, size_t fileSize, const std::string &oldSourcePath, const std::string &newSourcePath);
+
+    // Returns data, or a patched copy of it, for the len bytes at offset
+    const void *patch(const void *data, size_t len, size_t offset);
+
+    // Copies whatever passes of the string sections that have to move into the tail
+    void capture(const void *data, size_t len, size_t offset);
+
+    // Patches a file that's mapped in full, its tail has to be written first
+    void apply(unsigned char *file) const;
+
+    // What has to be written after the last byte of the original file
+    const std::string &tail() const
+    {
+        return mTail;
+    }
+
+private:
+    struct Range
+    {
+        size_t offset;
+        std::string bytes;
+    };
+
+    // A string section that's copied to mTail, at tail
+    struct Moved
+    {
+        size_t offset;
+        size_t size;
+        size_t tail;
+    };
+
+    std::vector<Range> mRanges;
+    std::vector<Moved> mMoved;
+    std::vector<unsigned char> mBuffer;
+    std::string mTail;
+};
+
 #endif
@@ -0,0 +1,542 @@
+#include "IncludeScanner.h"
+#include "Client.h"
+#include "CompilerArgs.h"
+#include "Config.h"
+#include "Log.h"
+#include <openssl/evp.h>
+#include <set>
+#include <string_view>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+struct Include
+{
+    std::string name;
+    bool angled { false };
+};
+
+struct SearchPath
+{
+    // -iquote, only searched for "" includes
+    std::vector<std::string> quote;
+    // -I, -isystem, the compiler's own directories and -idirafter
+    std::vector<std::string> bracket;
+};
+
+std::string digest(const void *data, size_t len)
+{
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (!EVP_Digest(data, len, buf, &size, EVP_sha256(), nullptr))
+        return std::string();
+    return Client::toHex(buf, size);
+}
+
+// Collapses ., .. and repeated slashes without looking at the file system,
+// that's how the builder will resolve the path under its root
+std::string normalize(const std::string &path)
+{
+    std::string ret;
+    size_t pos = 0;
+    while (pos < path.size()) {
+        size_t next = path.find('/', pos);
+        if (next == std::string::npos)
+            next = path.size();
+        const size_t len = next - pos;
+        if (len == 2 && path[pos] == '.' && path[pos + 1] == '.') {
+            const size_t slash = ret.rfind('/');
+            ret.resize(slash == std::string::npos ? 0 : slash);
+        } else if (len && (len != 1 || path[pos] != '.')) {
+            ret += '/';
+            ret.append(path, pos, len);
+        }
+        pos = next + 1;
+    }
+    return ret.empty() ? "/" : ret;
+}
+
+bool startsWith(const std::string &str, const char *prefix)
+{
+    return !str.compare(0, strlen(prefix), prefix);
+}
+
+// Client::fileType doesn't follow symlinks and headers often are ones
+bool isType(const std::string &path, mode_t type)
+{
+    struct stat st;
+    return !stat(path.c_str(), &st) && (st.st_mode & S_IFMT) == type;
+}
+
+std::string absolute(const std::string &path, const std::string &cwd)
+{
+    if (!path.empty() && path[0] == '/')
+        return path;
+    return cwd + '/' + path;
+}
+
+// The kernel resolves foo/../bar by walking through foo so it has to exist
+// on the builder even if nothing in it is shipped
+void addDotDotDirs(const std::string &path, std::set<std::string> *dirs)
+{
+    size_t pos = 0;
+    while ((pos = path.find("/..", pos)) != std::string::npos) {
+        if (pos + 3 == path.size() || path[pos + 3] == '/')
+            dirs->insert(normalize(path.substr(0, pos)));
+        pos += 3;
+    }
+}
+
+// Whitespace, comments and line continuations
+const char *skipSpace(const char *p, const char *end)
+{
+    while (p < end) {
+        if (*p == ' ' || *p == '\t' || *p == '\f' || *p == '\v' || *p == '\r') {
+            ++p;
+        } else if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+            p += 2;
+        } else if (*p == '\\' && p + 2 < end && p[1] == '\r' && p[2] == '\n') {
+            p += 3;
+        } else if (*p == '/' && p + 1 < end && p[1] == '*') {
+            const char *close = std::search(p + 2, end, "*/", "*/" + 2);
+            p = close == end ? end : close + 2;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+bool parseHeaderName(const char *&p, const char *end, Include *include)
+{
+    if (p == end || (*p != '"' && *p != '<'))
+        return false;
+    const char close = *p == '"' ? '"' : '>';
+    const char *q = p + 1;
+    while (q < end && *q != close && *q != '\n')
+        ++q;
+    if (q == end || *q != close || q == p + 1)
+        return false;
+    include->name.assign(p + 1, q);
+    include->angled = close == '>';
+    p = q + 1;
+    return true;
+}
+
+// Finds every #include, #include_next, #import and __has_include in the
+// file, conditionals are ignored so this can only find too many
+bool scanDirectives(const std::string &contents, std::vector<Include> *includes, std::string *reason)
+{
+    const char *const begin = contents.c_str();
+    const char *const end = begin + contents.size();
+    const char *line = begin;
+    while (line < end) {
+        const char *p = skipSpace(line, end);
+        if (p < end && *p == '#') {
+            p = skipSpace(p + 1, end);
+            const char *word = p;
+            while (p < end && (isalpha(static_cast<unsigned char>(*p)) || *p == '_'))
+                ++p;
+            const std::string_view directive(word, p - word);
+            if (directive == "include" || directive == "include_next" || directive == "import") {
+                p = skipSpace(p, end);
+                Include include;
+                if (!parseHeaderName(p, end, &include)) {
+                    *reason = Client::format("computed #%.*s", static_cast<int>(directive.size()), directive.data());
+                    return false;
+                }
+                includes->push_back(std::move(include));
+            } else if (directive == "embed") {
+                *reason = "#embed";
+                return false;
+            }
+        }
+        // Continued lines don't start a new directive
+        while (true) {
+            const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+            if (!newline) {
+                line = end;
+                break;
+            }
+            if (newline > begin && newline[-1] == '\\' && newline + 1 < end) {
+                p = newline + 1;
+                continue;
+            }
+            line = newline + 1;
+            break;
+        }
+    }
+
+    static const std::string hasInclude = "__has_include";
+    for (size_t pos = contents.find(hasInclude); pos != std::string::npos; pos = contents.find(hasInclude, pos + 1)) {
+        const char *p = begin + pos + hasInclude.size();
+        if (end - p >= 5 && !memcmp(p, "_next", 5))
+            p += 5;
+        if (p < end && (isalnum(static_cast<unsigned char>(*p)) || *p == '_'))
+            continue;
+        p = skipSpace(p, end);
+        // #ifdef __has_include and defined(__has_include)
+        if (p == end || *p != '(')
+            continue;
+        p = skipSpace(p + 1, end);
+        Include include;
+        if (!parseHeaderName(p, end, &include)) {
+            *reason = "computed __has_include";
+            return false;
+        }
+        includes->push_back(std::move(include));
+    }
+    return true;
+}
+
+// The compiler's built in search path as printed by -v. Running the compiler
+// for this every time would cost about as much as we're trying to save so
+// it's cached by the compiler and the arguments that can change it.
+bool systemIncludes(const std::string &compiler, const std::string &language, const std::vector<std::string> &probeArgs, std::vector<std::string> *dirs, std::string *reason)
+{
+    std::vector<std::string> arguments = { compiler, "-E", "-v", "-x", language };
+    arguments.insert(arguments.end(), probeArgs.begin(), probeArgs.end());
+    arguments.push_back("/dev/null");
+
+    std::string path;
+    const std::string cacheDir = Config::cacheDir;
+    if (!cacheDir.empty()) {
+        std::string key;
+        for (const std::string &arg : arguments) {
+            key += arg;
+            key += '\0';
+        }
+        key += Client::data().hash;
+        path = cacheDir + "includepaths/" + digest(key.data(), key.size());
+        std::string cached, error;
+        if (isType(path, S_IFREG) && Client::readFile(path, cached, nullptr, &error)) {
+            *dirs = Client::split(cached, "\n");
+            return true;
+        }
+    }
+
+    std::vector<unsigned char> stdOut;
+    std::string stdErr;
+    if (Client::spawn(arguments, stdOut, [](size_t) {}, stdErr)) {
+        *reason = "failed to run " + compiler + " -E -v";
+        return false;
+    }
+
+    bool inList = false, found = false;
+    for (std::string &line : Client::split(stdErr, "\n")) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line == "#include <...> search starts here:") {
+            inList = found = true;
+        } else if (line == "End of search list.") {
+            inList = false;
+        } else if (inList && !line.empty() && line[0] == ' ') {
+            if (Client::endsWith(line, " (framework directory)")) {
+                *reason = "framework directories";
+                return false;
+            }
+            dirs->push_back(line.substr(1));
+        }
+    }
+    if (!found) {
+        *reason = "no search list from " + compiler + " -E -v";
+        return false;
+    }
+
+    if (!path.empty() && Client::recursiveMkdir(cacheDir + "includepaths")) {
+        // Another fiskc may be writing the same file
+        const std::string tmp = Client::format("%s.%d", path.c_str(), getpid());
+        std::string contents;
+        for (const std::string &dir : *dirs) {
+            if (!contents.empty())
+                contents += '\n';
+            contents += dir;
+        }
+        FILE *f = fopen(tmp.c_str(), "w");
+        if (f) {
+            const bool ok = fwrite(contents.c_str(), 1, contents.size(), f) == contents.size();
+            fclose(f);
+            if (!ok || rename(tmp.c_str(), path.c_str()))
+                unlink(tmp.c_str());
+        }
+    }
+    return true;
+}
+
+// Picks the search path out of the command line and the arguments that
+// change the compiler's own part of it. Everything that makes the search
+// path depend on more than that is refused.
+bool parseArguments(const CompilerArgs &args, const std::string &cwd, SearchPath *searchPath, std::vector<std::string> *probeArgs, std::vector<std::string> *forced, bool *hosted, std::string *reason)
+{
+    std::vector<std::string> user, system, after;
+    const std::vector<std::string> &commandLine = args.commandLine;
+    for (size_t i = 1; i < commandLine.size(); ++i) {
+        if (i == args.sourceFileIndex)
+            continue;
+        const std::string &arg = commandLine[i];
+        if (arg.size() < 2 || arg[0] != '-')
+            continue;
+
+        // -I foo, -Ifoo
+        auto value = [&](const char *option, std::string *out) {
+            const size_t len = strlen(option);
+            if (arg.compare(0, len, option))
+                return false;
+            if (arg.size() > len) {
+                *out = arg.substr(len);
+                return true;
+            }
+            if (i + 1 == commandLine.size())
+                return false;
+            *out = commandLine[++i];
+            return true;
+        };
+
+        std::string dir;
+        if (arg == "-I-" || startsWith(arg, "-include-pch") || startsWith(arg, "-isystem-after")) {
+            *reason = arg;
+            return false;
+        } else if (value("-iquote", &dir)) {
+            searchPath->quote.push_back(dir);
+        } else if (value("-isystem", &dir)) {
+            system.push_back(dir);
+        } else if (value("-idirafter", &dir)) {
+            after.push_back(dir);
+        } else if (value("-I", &dir)) {
+            user.push_back(dir);
+        } else if (value("-include", &dir) || value("-imacros", &dir)) {
+            // Found relative to the working directory first and skipped if
+            // there's a precompiled header next to it
+            if (!access((absolute(dir, cwd) + ".gch").c_str(), F_OK)) {
+                *reason = "precompiled header " + dir;
+                return false;
+            }
+            forced->push_back(dir);
+        } else if (arg == "-nostdinc" || arg == "-nostdinc++" || arg == "-nostdlibinc" || arg == "-nobuiltininc" || arg == "-m32" || arg == "-m64" || arg == "-mx32" || startsWith(arg, "-stdlib=") || startsWith(arg, "--target=") || startsWith(arg, "--sysroot=") || startsWith(arg, "--gcc-toolchain=")) {
+            probeArgs->push_back(arg);
+        } else if (arg == "-target" || arg == "--sysroot" || arg == "-isysroot" || arg == "-B") {
+            if (i + 1 == commandLine.size()) {
+                *reason = arg;
+                return false;
+            }
+            probeArgs->push_back(arg);
+            probeArgs->push_back(commandLine[++i]);
+        } else if (startsWith(arg, "-B") || startsWith(arg, "-isysroot")) {
+            probeArgs->push_back(arg);
+        } else if (arg == "-ffreestanding" || arg == "-fno-hosted") {
+            *hosted = false;
+        } else if (arg == "-fhosted") {
+            *hosted = true;
+        } else if (startsWith(arg, "-iprefix") || startsWith(arg, "-iwithprefix") || startsWith(arg, "-iwithsysroot") || startsWith(arg, "-F") || startsWith(arg, "-iframework") || startsWith(arg, "-cxx-isystem") || startsWith(arg, "--include-directory") || startsWith(arg, "-Xpreprocessor") || startsWith(arg, "-Wp,") || arg == "-Xclang" || startsWith(arg, "-fmodule") || arg == "-fcxx-modules" || startsWith(arg, "-ivfsoverlay")) {
+            *reason = arg;
+            return false;
+        }
+        if (!dir.empty() && (dir[0] == '=' || startsWith(dir, "$SYSROOT") || Client::endsWith(dir, ".hmap"))) {
+            *reason = arg + ' ' + dir;
+            return false;
+        }
+    }
+
+    // GCC puts -I before -isystem before its own directories, which the
+    // caller adds, before -idirafter. The order doesn't matter for finding
+    // everything though.
+    searchPath->bracket = std::move(user);
+    searchPath->bracket.insert(searchPath->bracket.end(), system.begin(), system.end());
+    searchPath->bracket.insert(searchPath->bracket.end(), after.begin(), after.end());
+    return true;
+}
+
+class Scanner
+{
+public:
+    Scanner(const std::string &cwd, IncludeScanner::Result *result)
+        : mCwd(cwd), mResult(result)
+    {
+    }
+
+    void setSearchPath(SearchPath &&searchPath)
+    {
+        // Directories that don't exist are skipped by the compiler too
+        for (std::vector<std::string> *dirs : { &searchPath.quote, &searchPath.bracket }) {
+            std::vector<std::string> &out = dirs == &searchPath.quote ? mQuote : mBracket;
+            std::unordered_set<std::string> seen;
+            for (const std::string &dir : *dirs) {
+                const std::string abs = absolute(dir, mCwd);
+                if (seen.insert(abs).second && isType(abs, S_IFDIR))
+                    out.push_back(abs);
+            }
+        }
+    }
+
+    // Ships path and everything it includes
+    bool add(const std::string &path, std::string *reason)
+    {
+        if (!mVisited.insert(path).second)
+            return true;
+
+        IncludeScanner::File file;
+        file.path = normalize(path);
+        if (!Client::readFile(path, file.contents, nullptr, reason))
+            return false;
+        file.hash = digest(file.contents.data(), file.contents.size());
+        // foo/link/../bar.h and foo/bar.h end up in the same place on the builder
+        const auto inserted = mHashes.emplace(file.path, file.hash);
+        if (!inserted.second && inserted.first->second != file.hash) {
+            *reason = Client::format("%s and %s are different files", path.c_str(), file.path.c_str());
+            return false;
+        }
+        addDotDotDirs(path, &mDirs);
+
+        std::vector<Include> includes;
+        if (!scanDirectives(file.contents, &includes, reason)) {
+            *reason += " in " + path;
+            return false;
+        }
+        if (inserted.second)
+            mResult->files.push_back(std::move(file));
+
+        std::string dir;
+        Client::parsePath(path, nullptr, &dir);
+        if (!dir.empty() && dir.back() == '/')
+            dir.pop_back();
+        for (const Include &include : includes) {
+            for (const std::string &found : resolve(include, dir)) {
+                if (!add(found, reason))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Every file the include could refer to, not just the first one. That
+    // covers #include_next and whichever branch of an #if ends up being used.
+    // A header that can't be found here can't be found by the builder either.
+    const std::vector<std::string> &resolve(const Include &include, const std::string &includer)
+    {
+        if (include.name[0] == '/') {
+            auto &ret = mResolved[include.name];
+            if (ret.empty() && isType(include.name, S_IFREG))
+                ret.push_back(include.name);
+            return ret;
+        }
+
+        const std::string key = include.angled ? include.name : includer + '\0' + include.name;
+        auto it = mResolved.find(key);
+        if (it != mResolved.end())
+            return it->second;
+
+        std::vector<std::string> &ret = mResolved[key];
+        auto check = [&](const std::string &dir) {
+            std::string path = dir + '/' + include.name;
+            if (isType(path, S_IFREG))
+                ret.push_back(std::move(path));
+        };
+        if (!include.angled) {
+            check(includer);
+            for (const std::string &dir : mQuote)
+                check(dir);
+        }
+        for (const std::string &dir : mBracket)
+            check(dir);
+        return ret;
+    }
+
+    void finish()
+    {
+        mDirs.insert(normalize(mCwd));
+        addDotDotDirs(mCwd, &mDirs);
+        mResult->dirs.assign(mDirs.begin(), mDirs.end());
+    }
+
+private:
+    const std::string mCwd;
+    IncludeScanner::Result *mResult;
+    std::vector<std::string> mQuote, mBracket;
+    std::unordered_set<std::string> mVisited;
+    std::unordered_map<std::string, std::string> mHashes;
+    std::unordered_map<std::string, std::vector<std::string>> mResolved;
+    std::set<std::string> mDirs;
+};
+} // namespace
+
+bool IncludeScanner::scan(const std::string &compiler, const CompilerArgs &args, bool gcc, Result *result, std::string *reason)
+{
+    const unsigned long long started = Client::mono();
+    const CompilerArgs::Flag language = static_cast<CompilerArgs::Flag>(args.flags & CompilerArgs::LanguageMask);
+    switch (language) {
+    case CompilerArgs::C:
+    case CompilerArgs::CPlusPlus:
+    case CompilerArgs::ObjectiveC:
+    case CompilerArgs::ObjectiveCPlusPlus:
+        break;
+    default:
+        *reason = "not a C family source file";
+        return false;
+    }
+    // These become part of the search path
+    for (const char *env : { "CPATH", "C_INCLUDE_PATH", "CPLUS_INCLUDE_PATH", "OBJC_INCLUDE_PATH" }) {
+        const char *value = getenv(env);
+        if (value && *value) {
+            *reason = env;
+            return false;
+        }
+    }
+
+    result->cwd = Client::cwd();
+    if (result->cwd.empty()) {
+        *reason = "no working directory";
+        return false;
+    }
+
+    SearchPath searchPath;
+    std::vector<std::string> probeArgs, forced;
+    bool hosted = true;
+    if (!parseArguments(args, result->cwd, &searchPath, &probeArgs, &forced, &hosted, reason))
+        return false;
+    if (!systemIncludes(compiler, CompilerArgs::languageName(language), probeArgs, &result->systemIncludes, reason))
+        return false;
+    // The compiler's own directories go between -isystem and -idirafter but
+    // the order doesn't matter for the scanner
+    searchPath.bracket.insert(searchPath.bracket.end(), result->systemIncludes.begin(), result->systemIncludes.end());
+
+    Scanner scanner(result->cwd, result);
+    scanner.setSearchPath(std::move(searchPath));
+    if (!scanner.add(absolute(args.sourceFile(), result->cwd), reason))
+        return false;
+
+    // -include is looked up in the working directory instead of the source
+    // file's directory
+    for (const std::string &name : forced) {
+        const std::vector<std::string> &found = scanner.resolve({ name, false }, result->cwd);
+        if (found.empty()) {
+            *reason = "can't find " + name;
+            return false;
+        }
+        for (const std::string &path : found) {
+            if (!scanner.add(path, reason))
+                return false;
+        }
+    }
+
+    // GCC includes this before anything else unless -nostdinc or
+    // -ffreestanding. The builder has to compile with -nostdinc so it gets
+    // told to include it explicitly.
+    if (gcc && hosted && std::find(probeArgs.begin(), probeArgs.end(), "-nostdinc") == probeArgs.end()) {
+        const std::vector<std::string> &found = scanner.resolve({ "stdc-predef.h", true }, std::string());
+        if (!found.empty()) {
+            result->preinclude = normalize(found.front());
+            for (const std::string &path : found) {
+                if (!scanner.add(path, reason))
+                    return false;
+            }
+        }
+    }
+    scanner.finish();
+
+    size_t bytes = 0;
+    for (const File &file : result->files)
+        bytes += file.contents.size();
+    DEBUG("Scanned %s in %llums, %zu files, %zu bytes", args.sourceFile().c_str(), Client::mono() - started, result->files.size(), bytes);
+    return true;
+}
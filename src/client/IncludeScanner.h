@@ -0,0 +1,47 @@
+#ifndef INCLUDESCANNER_H
+#define INCLUDESCANNER_H
+
+#include <string>
+#include <vector>
+
+struct CompilerArgs;
+
+// Pump mode. Instead of preprocessing locally the client finds every file the
+// translation unit can include and ships those, the builder mirrors them under
+// a private root and runs the preprocessor itself. Headers are keyed by their
+// content so each one is only uploaded once per builder.
+//
+// The scanner follows #include, #include_next, #import and __has_include
+// through the same search path the compiler would use. It doesn't evaluate
+// conditionals and ships every match along the search path rather than the
+// first one, so it finds a superset of what the preprocessor reads. Anything
+// that would need macro expansion to resolve, like computed includes, makes
+// it give up and the client preprocesses as usual.
+namespace IncludeScanner {
+struct File
+{
+    // Absolute and lexically normalized, that's where the builder puts it
+    std::string path;
+    std::string contents;
+    // sha256 of contents in hex
+    std::string hash;
+};
+
+struct Result
+{
+    // The source file comes first
+    std::vector<File> files;
+    // The compiler's built in search path, the builder compiles with
+    // -nostdinc and passes these instead
+    std::vector<std::string> systemIncludes;
+    // Directories that have to exist for paths with .. in them to resolve
+    std::vector<std::string> dirs;
+    std::string cwd;
+    // GCC's implicit stdc-predef.h, -nostdinc turns that off too
+    std::string preinclude;
+};
+
+bool scan(const std::string &compiler, const CompilerArgs &args, bool gcc, Result *result, std::string *reason);
+} // namespace IncludeScanner
+
+#endif /* INCLUDESCANNER_H */
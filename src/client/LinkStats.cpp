@@ -0,0 +1,148 @@
+#include "LinkStats.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <sys/file.h>
+#include <unistd.h>
+
+namespace {
+// Rough single threaded deflate speed and output ratio for preprocessed
+// C/C++ at the levels worth considering.
+struct Level
+{
+    int level;
+    double bytesPerMs;
+    double ratio;
+};
+
+const Level levels[] = {
+    { 0, 1500000, 1.0 },
+    { 1, 90000, 0.22 },
+    { 3, 60000, 0.19 },
+    { 6, 25000, 0.16 },
+    { 9, 8000, 0.155 }
+};
+
+enum
+{
+    // Smaller uploads are dominated by latency and say little about throughput
+    MinThroughputSampleSize = 256 * 1024
+};
+
+std::string statsPath()
+{
+    const std::string dir = Config::cacheDir;
+    if (dir.empty())
+        return dir;
+    return dir + "links.json";
+}
+
+nlohmann::json readStats(int fd)
+{
+    std::string contents;
+    char buf[4096];
+    ssize_t r;
+    while (true) {
+        EINTRWRAP(r, ::read(fd, buf, sizeof(buf)));
+        if (r <= 0)
+            break;
+        contents.append(buf, r);
+    }
+    nlohmann::json ret = nlohmann::json::parse(contents, nullptr, false);
+    if (!ret.is_object())
+        ret = nlohmann::json::object();
+    return ret;
+}
+} // namespace
+
+bool LinkStats::load(const std::string &key, Link *link)
+{
+    const std::string path = statsPath();
+    if (path.empty())
+        return false;
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    flock(fd, LOCK_SH);
+    const nlohmann::json stats = readStats(fd);
+    flock(fd, LOCK_UN);
+    ::close(fd);
+
+    std::string k = key;
+    if (k.empty()) {
+        const auto last = stats.find("last");
+        if (last == stats.end() || !last->is_string())
+            return false;
+        k = last->get<std::string>();
+    }
+    const auto links = stats.find("links");
+    if (links == stats.end() || !links->is_object())
+        return false;
+    const auto it = links->find(k);
+    if (it == links->end() || !it->is_object())
+        return false;
+    link->bytesPerMs = it->value("bytesPerMs", 0.0);
+    link->rttMs = it->value("rttMs", 0.0);
+    link->samples = it->value("samples", 0ull);
+    return link->samples > 0;
+}
+
+void LinkStats::record(const std::string &key, size_t bytes, unsigned long long uploadMs, unsigned long long connectMs)
+{
+    const std::string path = statsPath();
+    if (path.empty() || !Client::recursiveMkdir(Config::cacheDir))
+        return;
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+        ERROR("Failed to open %s for link stats %d %s", path.c_str(), errno, strerror(errno));
+        return;
+    }
+    int ret;
+    EINTRWRAP(ret, flock(fd, LOCK_EX));
+    nlohmann::json stats = readStats(fd);
+    nlohmann::json &link = stats["links"][key];
+    if (!link.is_object())
+        link = nlohmann::json::object();
+
+    // Connecting is a TCP handshake followed by the websocket upgrade
+    const double rtt = connectMs / 2.0;
+    double rttMs = link.value("rttMs", 0.0);
+    rttMs = rttMs > 0 ? (rttMs * 3 + rtt) / 4 : rtt;
+    link["rttMs"] = rttMs;
+
+    if (bytes >= MinThroughputSampleSize) {
+        const double throughput = bytes / std::max(1.0, uploadMs - rttMs);
+        const unsigned long long samples = link.value("samples", 0ull);
+        const double bytesPerMs = link.value("bytesPerMs", 0.0);
+        link["bytesPerMs"] = samples ? (bytesPerMs * 3 + throughput) / 4 : throughput;
+        link["samples"] = samples + 1;
+        DEBUG("Link to %s: %.0f bytes/ms, rtt %.1fms", key.c_str(), link["bytesPerMs"].get<double>(), rttMs);
+    }
+    stats["last"] = key;
+
+    const std::string json = stats.dump();
+    if (ftruncate(fd, 0) || pwrite(fd, json.c_str(), json.size(), 0) != static_cast<ssize_t>(json.size())) {
+        ERROR("Failed to write link stats to %s %d %s", path.c_str(), errno, strerror(errno));
+    }
+    flock(fd, LOCK_UN);
+    ::close(fd);
+}
+
+int LinkStats::compressionLevel(const Link &link, size_t threads)
+{
+    if (!link.samples || link.bytesPerMs <= 0)
+        return -1;
+
+    // Both compressing and uploading are linear in the size of the
+    // translation unit so the cheapest level per byte wins regardless of size
+    int best = -1;
+    double bestCost = 0;
+    for (const Level &level : levels) {
+        const double cost = 1.0 / (level.bytesPerMs * threads) + level.ratio / link.bytesPerMs;
+        if (best == -1 || cost < bestCost) {
+            best = level.level;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,25 @@
+#ifndef LINKSTATS_H
+#define LINKSTATS_H
+
+#include <string>
+
+// Per builder estimates of upload throughput and round trip time, kept in
+// Config::cacheDir + "links.json" and shared by all fiskc processes. Used to
+// pick the compression level that minimizes compress plus upload time.
+namespace LinkStats {
+struct Link
+{
+    double bytesPerMs { 0 };
+    double rttMs { 0 };
+    unsigned long long samples { 0 };
+};
+
+// key is empty for the most recently used builder
+bool load(const std::string &key, Link *link);
+void record(const std::string &key, size_t bytes, unsigned long long uploadMs, unsigned long long connectMs);
+
+// Returns a zlib level, 0 meaning stored, or -1 if there's nothing to go on
+int compressionLevel(const Link &link, size_t threads);
+} // namespace LinkStats
+
+#endif /* LINKSTATS_H */
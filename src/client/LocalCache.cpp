@@ -0,0 +1,389 @@
+#include "LocalCache.h"
+#include "Client.h"
+#include "Config.h"
+#include "Log.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace {
+enum
+{
+    Magic = 0x31434c46, // "FLC1"
+    Capacity = 16384, // power of two
+    MaxKeyLength = 64,
+    // Probe sequences stay short below this load
+    MaxCount = Capacity / 4 * 3
+};
+
+struct Header
+{
+    uint32_t magic;
+    uint32_t capacity;
+    uint64_t count;
+    uint64_t totalSize;
+    uint64_t reserved[5];
+};
+
+struct Slot
+{
+    uint8_t key[MaxKeyLength];
+    uint32_t keyLength; // 0 means empty
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t lastUsed;
+};
+
+static_assert(sizeof(Header) == 64, "Header must be 64 bytes");
+static_assert(sizeof(Slot) == 88, "Slot must be 88 bytes");
+
+const size_t IndexSize = sizeof(Header) + sizeof(Slot) * Capacity;
+
+std::string cacheDir()
+{
+    return Config::cacheDir.get() + "objects/";
+}
+
+bool keyFromHex(const std::string &hex, std::string *key)
+{
+    if (hex.empty() || hex.size() % 2 || hex.size() / 2 > MaxKeyLength)
+        return false;
+    key->resize(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        unsigned int byte;
+        if (sscanf(hex.c_str() + i, "%2x", &byte) != 1)
+            return false;
+        (*key)[i / 2] = static_cast<char>(byte);
+    }
+    return true;
+}
+
+class Index
+{
+public:
+    ~Index()
+    {
+        if (mHeader)
+            munmap(mHeader, IndexSize);
+        if (mFD != -1) {
+            flock(mFD, LOCK_UN);
+            ::close(mFD);
+        }
+    }
+
+    // A shared lock only succeeds if another process already set the index up
+    bool open(int lock)
+    {
+        const std::string path = cacheDir() + "index";
+        mFD = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (mFD == -1) {
+            DEBUG("Failed to open local cache index %s %d %s", path.c_str(), errno, strerror(errno));
+            return false;
+        }
+        int ret;
+        EINTRWRAP(ret, flock(mFD, lock));
+        if (ret)
+            return false;
+
+        struct stat st;
+        if (fstat(mFD, &st))
+            return false;
+        bool valid = static_cast<size_t>(st.st_size) == IndexSize;
+        if (!valid) {
+            if (lock != LOCK_EX)
+                return false;
+            // Start over, whatever is in objects/ is unreachable and gets
+            // overwritten as keys come back
+            if (ftruncate(mFD, 0) || ftruncate(mFD, IndexSize)) {
+                ERROR("Failed to resize local cache index %s %d %s", path.c_str(), errno, strerror(errno));
+                return false;
+            }
+        }
+
+        void *mapped = mmap(nullptr, IndexSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFD, 0);
+        if (mapped == MAP_FAILED) {
+            ERROR("Failed to mmap local cache index %s %d %s", path.c_str(), errno, strerror(errno));
+            return false;
+        }
+        mHeader = static_cast<Header *>(mapped);
+        mSlots = reinterpret_cast<Slot *>(mHeader + 1);
+        if (mHeader->magic != Magic || mHeader->capacity != Capacity) {
+            if (lock != LOCK_EX)
+                return false;
+            memset(mapped, 0, IndexSize);
+            mHeader->magic = Magic;
+            mHeader->capacity = Capacity;
+        }
+        return true;
+    }
+
+    Header *header() const
+    {
+        return mHeader;
+    }
+
+    // Returns the slot holding key or the empty slot where it would go
+    Slot *find(const std::string &key) const
+    {
+        size_t idx = home(key.c_str());
+        while (true) {
+            Slot *slot = mSlots + idx;
+            if (!slot->keyLength || (slot->keyLength == key.size() && !memcmp(slot->key, key.c_str(), key.size())))
+                return slot;
+            idx = (idx + 1) & (Capacity - 1);
+        }
+    }
+
+    Slot *leastRecentlyUsed() const
+    {
+        Slot *ret = nullptr;
+        for (size_t i = 0; i < Capacity; ++i) {
+            if (mSlots[i].keyLength && (!ret || mSlots[i].lastUsed < ret->lastUsed))
+                ret = mSlots + i;
+        }
+        return ret;
+    }
+
+    // Backward shift deletion so lookups never need tombstones
+    void remove(Slot *slot)
+    {
+        --mHeader->count;
+        mHeader->totalSize -= slot->size;
+        size_t idx = slot - mSlots;
+        size_t next = idx;
+        while (true) {
+            mSlots[idx].keyLength = 0;
+            while (true) {
+                next = (next + 1) & (Capacity - 1);
+                if (!mSlots[next].keyLength)
+                    return;
+                const size_t wanted = home(mSlots[next].key);
+                // Leave it if its home is cyclically in (idx, next]
+                if (idx <= next ? (idx < wanted && wanted <= next) : (idx < wanted || wanted <= next))
+                    continue;
+                break;
+            }
+            mSlots[idx] = mSlots[next];
+            idx = next;
+        }
+    }
+
+private:
+    static size_t home(const void *key)
+    {
+        // Keys are digests already
+        uint32_t hash;
+        memcpy(&hash, key, sizeof(hash));
+        return hash & (Capacity - 1);
+    }
+
+    int mFD { -1 };
+    Header *mHeader { nullptr };
+    Slot *mSlots { nullptr };
+};
+
+bool copyFile(const std::string &from, const std::string &to, size_t *size = nullptr)
+{
+    int in;
+    EINTRWRAP(in, ::open(from.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in == -1)
+        return false;
+    // Never write through an existing inode, it might be shared with something else
+    unlink(to.c_str());
+    int out;
+    EINTRWRAP(out, ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666));
+    if (out == -1) {
+        ::close(in);
+        return false;
+    }
+
+    bool ok = true;
+#ifdef FICLONE
+    // Shares the blocks on filesystems with reflinks (btrfs, xfs)
+    if (ioctl(out, FICLONE, in)) {
+#endif
+        char buf[256 * 1024];
+        while (true) {
+            ssize_t r;
+            EINTRWRAP(r, ::read(in, buf, sizeof(buf)));
+            if (r <= 0) {
+                ok = !r;
+                break;
+            }
+            ssize_t written = 0;
+            while (written < r) {
+                ssize_t w;
+                EINTRWRAP(w, ::write(out, buf + written, r - written));
+                if (w <= 0) {
+                    ok = false;
+                    break;
+                }
+                written += w;
+            }
+            if (!ok)
+                break;
+        }
+#ifdef FICLONE
+    }
+#endif
+    if (ok && size) {
+        struct stat st;
+        ok = !fstat(out, &st);
+        *size = st.st_size;
+    }
+    ::close(in);
+    ::close(out);
+    if (!ok)
+        unlink(to.c_str());
+    return ok;
+}
+} // namespace
+
+bool LocalCache::enabled()
+{
+    return Config::objectCache && Config::localCacheSize > 0 && !Config::cacheDir.get().empty();
+}
+
+bool LocalCache::load(const std::string &hex, Entry *entry)
+{
+    std::string key;
+    if (!keyFromHex(hex, &key))
+        return false;
+
+    // Eviction takes the lock exclusively so the entry stays put while we copy it out
+    Index index;
+    if (!index.open(LOCK_SH))
+        return false;
+    Slot *slot = index.find(key);
+    if (!slot->keyLength)
+        return false;
+
+    const std::string dir = cacheDir() + hex + '/';
+    std::string contents;
+    if (!Client::readFile(dir + "manifest.json", contents))
+        return false;
+    const nlohmann::json manifest = nlohmann::json::parse(contents, nullptr, false);
+    if (!manifest.is_object())
+        return false;
+    const auto files = manifest.find("files");
+    if (files == manifest.end() || !files->is_array())
+        return false;
+    entry->exitCode = manifest.value("exitCode", 0);
+    entry->stdOut = manifest.value("stdout", std::string());
+    entry->stdErr = manifest.value("stderr", std::string());
+    entry->files.clear();
+    for (const nlohmann::json &file : *files) {
+        if (!file.is_string())
+            return false;
+        entry->files.push_back(file.get<std::string>());
+    }
+
+    for (size_t i = 0; i < entry->files.size(); ++i) {
+        if (!copyFile(dir + std::to_string(i), entry->files[i])) {
+            ERROR("Failed to copy %s from the local cache %d %s", entry->files[i].c_str(), errno, strerror(errno));
+            return false;
+        }
+    }
+    // Racing with other readers here is fine, any of the values will do
+    __atomic_store_n(&slot->lastUsed, static_cast<uint64_t>(Client::milliseconds_since_epoch), __ATOMIC_RELAXED);
+    DEBUG("Local cache hit for %s, %zu files", hex.c_str(), entry->files.size());
+    return true;
+}
+
+void LocalCache::store(const std::string &hex, const Entry &entry, bool replace)
+{
+    std::string key;
+    if (!keyFromHex(hex, &key))
+        return;
+
+    const std::string root = cacheDir();
+    if (!Client::recursiveMkdir(root))
+        return;
+
+    // Copy everything into a private directory first so the index lock is
+    // only held for the rename and the bookkeeping
+    const std::string tmp = Client::format("%s%s.%d/", root.c_str(), hex.c_str(), getpid());
+    Client::recursiveRmdir(tmp);
+    if (mkdir(tmp.c_str(), S_IRWXU)) {
+        ERROR("Failed to create %s for the local cache %d %s", tmp.c_str(), errno, strerror(errno));
+        return;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < entry.files.size(); ++i) {
+        size_t size;
+        if (!copyFile(entry.files[i], tmp + std::to_string(i), &size)) {
+            ERROR("Failed to copy %s into the local cache %d %s", entry.files[i].c_str(), errno, strerror(errno));
+            Client::recursiveRmdir(tmp);
+            return;
+        }
+        total += size;
+    }
+    const std::string manifest = nlohmann::json({ { "exitCode", entry.exitCode },
+                                                  { "stdout", entry.stdOut },
+                                                  { "stderr", entry.stdErr },
+                                                  { "files", entry.files } })
+                                     .dump();
+    FILE *f = fopen((tmp + "manifest.json").c_str(), "w");
+    if (!f || fwrite(manifest.c_str(), 1, manifest.size(), f) != manifest.size()) {
+        ERROR("Failed to write local cache manifest in %s", tmp.c_str());
+        if (f)
+            fclose(f);
+        Client::recursiveRmdir(tmp);
+        return;
+    }
+    fclose(f);
+    total += manifest.size();
+
+    const unsigned long long maxSize = Config::localCacheSize;
+    Index index;
+    if (total > maxSize || !index.open(LOCK_EX)) {
+        Client::recursiveRmdir(tmp);
+        return;
+    }
+
+    Header *header = index.header();
+    Slot *slot = index.find(key);
+    if (slot->keyLength) {
+        if (!replace) {
+            // Someone else got here first
+            Client::recursiveRmdir(tmp);
+            return;
+        }
+        index.remove(slot);
+    }
+
+    while (header->count && (header->count >= MaxCount || header->totalSize + total > maxSize)) {
+        Slot *evict = index.leastRecentlyUsed();
+        const std::string evictDir = root + Client::toHex(evict->key, evict->keyLength) + '/';
+        DEBUG("Evicting %s from the local cache", evictDir.c_str());
+        Client::recursiveRmdir(evictDir);
+        index.remove(evict);
+    }
+
+    const std::string dir = root + hex;
+    Client::recursiveRmdir(dir);
+    if (rename(tmp.substr(0, tmp.size() - 1).c_str(), dir.c_str())) {
+        ERROR("Failed to rename %s to %s %d %s", tmp.c_str(), dir.c_str(), errno, strerror(errno));
+        Client::recursiveRmdir(tmp);
+        return;
+    }
+
+    // Evicting may have moved things around
+    slot = index.find(key);
+    memcpy(slot->key, key.c_str(), key.size());
+    slot->keyLength = static_cast<uint32_t>(key.size());
+    slot->size = total;
+    slot->lastUsed = Client::milliseconds_since_epoch;
+    ++header->count;
+    header->totalSize += total;
+    DEBUG("Stored %s in the local cache, %zu bytes, %llu entries using %llu bytes",
+          hex.c_str(),
+          total,
+          static_cast<unsigned long long>(header->count),
+          static_cast<unsigned long long>(header->totalSize));
+}
@@ -0,0 +1,28 @@
+#ifndef LOCALCACHE_H
+#define LOCALCACHE_H
+
+#include <string>
+#include <vector>
+
+// Compiler output kept in Config::cacheDir + "objects/", keyed by the same
+// digest the scheduler's object cache uses. Entries are found through an
+// mmap'd open addressing index shared by all fiskc processes and the least
+// recently used ones are evicted once Config::localCacheSize is exceeded.
+namespace LocalCache {
+struct Entry
+{
+    int exitCode { 0 };
+    std::string stdOut, stdErr;
+    std::vector<std::string> files;
+};
+
+bool enabled();
+
+// key is the hex digest. On a hit the cached files have been written to the
+// paths they were stored from.
+bool load(const std::string &key, Entry *entry);
+// An existing entry for key is left alone unless replace is set
+void store(const std::string &key, const Entry &entry, bool replace = false);
+} // namespace LocalCache
+
+#endif /* LOCALCACHE_H */
@@ -1,9 +1,391 @@
 #include "Preprocessed.h"
 #include "Client.h"
 #include "DaemonSocket.h"
-#include <process.hpp>
+#include "DirectMode.h"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <openssl/evp.h>
+#include <string.h>
 #define ZLIB_CONST
 #include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+// Feeds preprocessed output to the object cache SHA1, leaving out "# <digit>"
+// line markers (up to, not including, the newline) and stopping at the first
+// NUL. Data can be fed in arbitrary chunks, up to two bytes of a potential
+// marker are held back until the next chunk decides what they are. The file
+// names in the markers are collected in includes if there is one.
+class LineMarkerFilter
+{
+public:
+    explicit LineMarkerFilter(std::set<std::string> *includes)
+        : mIncludes(includes)
+    {
+    }
+
+    void feed(const unsigned char *data, size_t len)
+    {
+        if (mState == Finished)
+            return;
+        // Only '#', '\n' and NUL matter to the filter so let memchr do the
+        // scanning, everything in between is hashed in one go.
+        const unsigned char *const nul = static_cast<const unsigned char *>(memchr(data, '\0', len));
+        const unsigned char *const end = nul ? nul : data + len;
+        const unsigned char *ch = data;
+        const unsigned char *last = data;
+        while (ch < end) {
+            switch (mState) {
+                case Normal:
+                    ch = static_cast<const unsigned char *>(memchr(ch, '#', end - ch));
+                    if (!ch) {
+                        ch = end;
+                        continue;
+                    }
+                    mState = Hash;
+                    break;
+                case Hash:
+                    if (*ch == ' ') {
+                        mState = HashSpace;
+                        break;
+                    }
+                    reject();
+                    continue;
+                case HashSpace:
+                    if (std::isdigit(*ch)) {
+                        // the marker started two bytes ago, some of which may have been held back
+                        update(last, ch - (2 - mHeldBack.size()) - last);
+                        mHeldBack.clear();
+                        mState = Marker;
+                        break;
+                    }
+                    reject();
+                    continue;
+                case Marker: {
+                    const unsigned char *const newline = static_cast<const unsigned char *>(memchr(ch, '\n', end - ch));
+                    if (mIncludes)
+                        mMarker.append(reinterpret_cast<const char *>(ch), (newline ? newline : end) - ch);
+                    if (!newline) {
+                        ch = end;
+                        continue;
+                    }
+                    if (mIncludes) {
+                        addInclude();
+                        mMarker.clear();
+                    }
+                    ch = last = newline;
+                    mState = Normal;
+                    break;
+                }
+                case Finished:
+                    assert(0);
+                    return;
+            }
+            ++ch;
+        }
+
+        switch (mState) {
+            case Normal:
+                update(last, end - last);
+                break;
+            case Hash:
+            case HashSpace: {
+                const size_t tentative = (mState == Hash ? 1 : 2) - mHeldBack.size();
+                update(last, end - tentative - last);
+                mHeldBack.append(reinterpret_cast<const char *>(end - tentative), tentative);
+                break;
+            }
+            case Marker:
+            case Finished:
+                break;
+        }
+        if (nul)
+            finish();
+    }
+
+    void finish()
+    {
+        if (mState == Hash || mState == HashSpace)
+            update(reinterpret_cast<const unsigned char *>(mHeldBack.data()), mHeldBack.size());
+        mHeldBack.clear();
+        mState = Finished;
+    }
+
+private:
+    // mMarker is what follows the first digit, e.g. 2 "/usr/include/stdio.h" 1 3 4
+    void addInclude()
+    {
+        const size_t quote = mMarker.find('"');
+        if (quote == std::string::npos)
+            return;
+        std::string path;
+        for (size_t i = quote + 1; i < mMarker.size(); ++i) {
+            char ch = mMarker[i];
+            if (ch == '"') {
+                // <built-in>, <command-line> and friends
+                if (!path.empty() && path[0] != '<')
+                    mIncludes->insert(std::move(path));
+                return;
+            }
+            if (ch == '\\' && i + 1 < mMarker.size()) {
+                ch = mMarker[++i];
+                if (ch >= '0' && ch <= '7') {
+                    // non-printable characters are written as octal escapes
+                    int value = 0;
+                    for (int digits = 0; digits < 3 && i < mMarker.size() && mMarker[i] >= '0' && mMarker[i] <= '7'; ++digits)
+                        value = value * 8 + (mMarker[i++] - '0');
+                    --i;
+                    ch = static_cast<char>(value);
+                }
+            }
+            path += ch;
+        }
+    }
+
+    void reject()
+    {
+        // bytes held back from a previous chunk turned out not to be a
+        // marker, nothing from the current chunk has been hashed yet
+        if (!mHeldBack.empty()) {
+            update(reinterpret_cast<const unsigned char *>(mHeldBack.data()), mHeldBack.size());
+            mHeldBack.clear();
+        }
+        mState = Normal;
+    }
+
+    static void update(const unsigned char *data, size_t len)
+    {
+        if (len) {
+            VERBOSE("Adding to SHA1:\n%.*s\n", static_cast<int>(len), data);
+            Client::data().sha1Update(data, len);
+        }
+    }
+
+    enum State
+    {
+        Normal,
+        Hash,
+        HashSpace,
+        Marker,
+        Finished
+    } mState { Normal };
+    std::string mHeldBack;
+    std::set<std::string> *mIncludes;
+    std::string mMarker;
+};
+
+// Compresses one block as a complete gzip member or zstd frame. The
+// builder's decompressors handle concatenated members/frames so blocks can
+// be compressed independently.
+std::vector<unsigned char> compressBlock(std::vector<unsigned char> block, bool zstd, int level)
+{
+#ifdef HAVE_ZSTD
+    if (zstd) {
+        std::vector<unsigned char> ret(ZSTD_compressBound(block.size()));
+        const size_t written = ZSTD_compress(ret.data(), ret.size(), block.data(), block.size(), Config::zstdLevel);
+        assert(!ZSTD_isError(written));
+        ret.resize(written);
+        return ret;
+    }
+#else
+    assert(!zstd);
+    static_cast<void>(zstd);
+#endif
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    int r = deflateInit2(&strm, level, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY);
+    assert(r == Z_OK);
+    std::vector<unsigned char> ret(deflateBound(&strm, block.size()));
+    strm.next_in = block.data();
+    strm.avail_in = static_cast<uint32_t>(block.size());
+    strm.next_out = ret.data();
+    strm.avail_out = static_cast<uint32_t>(ret.size());
+    r = deflate(&strm, Z_FINISH);
+    assert(r == Z_STREAM_END);
+    static_cast<void>(r);
+    ret.resize(ret.size() - strm.avail_out);
+    deflateEnd(&strm);
+    return ret;
+}
+
+// Runs compressBlock on up to a fixed number of threads, started as blocks
+// come in so small outputs don't start all of them
+class CompressPool
+{
+public:
+    explicit CompressPool(size_t threads)
+        : mMaxThreads(threads)
+    {
+    }
+
+    ~CompressPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mStopped = true;
+        }
+        mCond.notify_all();
+        for (std::thread &thread : mThreads)
+            thread.join();
+    }
+
+    std::future<std::vector<unsigned char>> add(std::vector<unsigned char> &&block, bool zstd, int level)
+    {
+        std::packaged_task<std::vector<unsigned char>()> task([block = std::move(block), zstd, level]() mutable {
+            return compressBlock(std::move(block), zstd, level);
+        });
+        std::future<std::vector<unsigned char>> ret = task.get_future();
+        {
+            std::unique_lock<std::mutex> lock(mMutex);
+            mTasks.push_back(std::move(task));
+            if (mThreads.size() < mMaxThreads)
+                mThreads.emplace_back(&CompressPool::run, this);
+        }
+        mCond.notify_one();
+        return ret;
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        while (true) {
+            while (mTasks.empty() && !mStopped)
+                mCond.wait(lock);
+            if (mTasks.empty())
+                return;
+            std::packaged_task<std::vector<unsigned char>()> task = std::move(mTasks.front());
+            mTasks.pop_front();
+            lock.unlock();
+            task();
+            lock.lock();
+        }
+    }
+
+    const size_t mMaxThreads;
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::deque<std::packaged_task<std::vector<unsigned char>()>> mTasks;
+    std::vector<std::thread> mThreads;
+    bool mStopped { false };
+};
+
+// 1 for a line marker entering a file, 2 for one returning to a file and 0
+// for anything else, e.g. # 12 "/usr/include/stdio.h" 2 3 4
+int markerFlag(const unsigned char *line, const unsigned char *end)
+{
+    if (end - line < 3 || line[0] != '#' || line[1] != ' ' || !std::isdigit(line[2]))
+        return 0;
+    const unsigned char *ch = line + 3;
+    while (ch < end && std::isdigit(*ch))
+        ++ch;
+    if (end - ch < 2 || ch[0] != ' ' || ch[1] != '"')
+        return 0;
+    for (ch += 2; ch < end && *ch != '"'; ++ch) {
+        if (*ch == '\\' && ch + 1 < end)
+            ++ch;
+    }
+    if (end - ch < 3 || ch[1] != ' ' || (end - ch > 3 && ch[3] != ' '))
+        return 0;
+    return ch[2] == '1' ? 1 : ch[2] == '2' ? 2 : 0;
+}
+
+std::vector<Preprocessed::Segment> split(const std::vector<unsigned char> &data)
+{
+    std::vector<Preprocessed::Segment> ret;
+    const unsigned char *const begin = data.data();
+    const unsigned char *const end = begin + data.size();
+    auto add = [&ret, begin](const unsigned char *from, const unsigned char *to) {
+        unsigned char buf[EVP_MAX_MD_SIZE];
+        unsigned int size = 0;
+        if (!EVP_Digest(from, to - from, buf, &size, EVP_sha256(), nullptr))
+            return false;
+        ret.push_back({ static_cast<size_t>(from - begin), static_cast<size_t>(to - from), Client::toHex(buf, size) });
+        return true;
+    };
+
+    const unsigned char *start = begin;
+    int depth = 0;
+    for (const unsigned char *line = begin; line < end;) {
+        const unsigned char *newline = static_cast<const unsigned char *>(memchr(line, '\n', end - line));
+        if (!newline)
+            newline = end;
+        if (*line == '#') {
+            const int flag = markerFlag(line, newline);
+            const int before = depth;
+            if (flag == 1) {
+                ++depth;
+            } else if (flag == 2 && depth) {
+                --depth;
+            }
+            if (flag && std::min(before, depth) < Preprocessed::MaxSegmentDepth && line > start) {
+                if (!add(start, line))
+                    return std::vector<Preprocessed::Segment>();
+                start = line;
+            }
+        }
+        line = newline + 1;
+    }
+    if (start < end && !add(start, end))
+        return std::vector<Preprocessed::Segment>();
+    return ret;
+}
+
+} // namespace
+
+size_t Preprocessed::compressThreads()
+{
+    return Config::compressThreads > 0 ? static_cast<size_t>(Config::compressThreads) : std::max(1u, std::thread::hardware_concurrency());
+}
+
+void Preprocessed::setCompressionLevel(int level)
+{
+    mCompressionLevel = level;
+}
+
+bool Preprocessed::supportsZstd()
+{
+#ifdef HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+const std::vector<unsigned char> &Preprocessed::raw() const
+{
+    return Config::compress ? uncompressed : stdOut;
+}
+
+std::vector<unsigned char> Preprocessed::compress(const std::vector<unsigned char> &data, bool zstd, int level)
+{
+    std::vector<std::future<std::vector<unsigned char>>> blocks;
+    std::vector<unsigned char> ret;
+    const size_t threads = compressThreads();
+    CompressPool pool(threads);
+    for (size_t offset = 0; offset < data.size(); offset += CompressBlockSize) {
+        if (blocks.size() == threads) {
+            for (std::future<std::vector<unsigned char>> &block : blocks) {
+                const std::vector<unsigned char> compressed = block.get();
+                ret.insert(ret.end(), compressed.begin(), compressed.end());
+            }
+            blocks.clear();
+        }
+        const size_t len = std::min<size_t>(CompressBlockSize, data.size() - offset);
+        blocks.push_back(pool.add(std::vector<unsigned char>(data.begin() + offset, data.begin() + offset + len), zstd, level));
+    }
+    for (std::future<std::vector<unsigned char>> &block : blocks) {
+        const std::vector<unsigned char> compressed = block.get();
+        ret.insert(ret.end(), compressed.begin(), compressed.end());
+    }
+    return ret;
+}
 
 Preprocessed::Preprocessed()
 {
@@ -34,17 +416,55 @@ bool Preprocessed::done() const
     return mDone;
 }
 
+bool Preprocessed::takeChunks(std::vector<std::vector<unsigned char>> &chunks)
+{
+    assert(mStream);
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (chunks.empty()) {
+        chunks = std::move(mChunks);
+    } else {
+        for (std::vector<unsigned char> &chunk : mChunks) {
+            chunks.push_back(std::move(chunk));
+        }
+    }
+    mChunks.clear();
+    return mDone;
+}
+
 std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args, Select *select,
-                                                   DaemonSocket *daemonSocket)
+                                                   DaemonSocket *daemonSocket, bool stream)
 {
     const unsigned long long started = Client::mono();
     Preprocessed *ptr = new Preprocessed;
+    ptr->mStream = stream;
     std::unique_ptr<Preprocessed> ret(ptr);
     ret->mThread = std::thread([ptr, args, compiler, started, daemonSocket, select] {
         std::string out, err;
         ptr->stdOut.reserve(1024 * 1024);
         std::string commandLine = args->preprocessCommandLine(compiler);
 
+        // Wire data (compressed if Config::compress) is either collected in
+        // one buffer or, when streaming, handed to the main thread in
+        // StreamChunkSize pieces as soon as they are produced.
+        std::vector<unsigned char> pending;
+        auto flushPending = [ptr, select, &pending]() {
+            if (pending.empty())
+                return;
+            {
+                std::unique_lock<std::mutex> lock(ptr->mMutex);
+                ptr->mChunks.push_back(std::move(pending));
+            }
+            pending.clear();
+            if (select)
+                select->wakeup();
+        };
+        auto output = [ptr, &pending, &flushPending](const unsigned char *bytes, size_t len) {
+            pending.insert(pending.end(), bytes, bytes + len);
+            if (ptr->mStream && pending.size() >= StreamChunkSize) {
+                flushPending();
+            }
+        };
+
         DEBUG("Acquiring preprocess slot: %s", commandLine.c_str());
 
         if (daemonSocket && !daemonSocket->waitForCppSlot()) {
@@ -55,96 +475,71 @@ std::unique_ptr<Preprocessed> Preprocessed::create(const std::string &compiler,
             if (args->flags & (CompilerArgs::CPreprocessed | CompilerArgs::ObjectiveCPreprocessed | CompilerArgs::ObjectiveCPlusPlusPreprocessed | CompilerArgs::CPlusPlusPreprocessed)) {
                 DEBUG("Already preprocessed. No need to do it");
                 ptr->exitStatus = Client::readFile(args->sourceFile(), ptr->stdOut) ? 0 : 1;
+                if (ptr->mStream)
+                    output(ptr->stdOut.data(), ptr->stdOut.size());
             } else {
-                z_stream strm;
-                std::vector<unsigned char> compressed;
-                size_t compressOffset = 0;
+                // Output is cut into CompressBlockSize blocks that are
+                // compressed on up to compressThreads threads and written out
+                // in order.
+                std::deque<std::future<std::vector<unsigned char>>> blocks;
+                size_t blockOffset = 0;
+                size_t threads = 1;
                 if (Config::compress) {
-                    strm.zalloc = Z_NULL;
-                    strm.zfree = Z_NULL;
-                    strm.opaque = Z_NULL;
-                    const int r = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 9, Z_DEFAULT_STRATEGY);
-                    assert(r == Z_OK);
-                    static_cast<void>(r);
-                    compressed.reserve(1024 * 1024);
+                    threads = compressThreads();
+                    ptr->zstd = Config::compression.get() == "zstd" && supportsZstd();
+                    pending.reserve(ptr->mStream ? StreamChunkSize * 2 : 1024 * 1024);
                 }
+                CompressPool pool(threads);
+                auto compress = [ptr, &blocks, &blockOffset, &output, &pool, threads](bool finish) {
+                    while (ptr->stdOut.size() - blockOffset >= CompressBlockSize || (finish && blockOffset < ptr->stdOut.size())) {
+                        const size_t len = std::min<size_t>(CompressBlockSize, ptr->stdOut.size() - blockOffset);
+                        std::vector<unsigned char> block(ptr->stdOut.begin() + blockOffset, ptr->stdOut.begin() + blockOffset + len);
+                        blockOffset += len;
+                        if (blocks.size() >= threads) {
+                            const std::vector<unsigned char> compressed = blocks.front().get();
+                            blocks.pop_front();
+                            output(compressed.data(), compressed.size());
+                        }
+                        blocks.push_back(pool.add(std::move(block), ptr->zstd, ptr->mCompressionLevel.load()));
+                    }
+                    while (!blocks.empty() && (finish || blocks.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+                        const std::vector<unsigned char> compressed = blocks.front().get();
+                        blocks.pop_front();
+                        output(compressed.data(), compressed.size());
+                    }
+                };
+                LineMarkerFilter sha1Filter(DirectMode::enabled() ? &ptr->includes : nullptr);
+                const bool sha1 = Config::objectCache || Config::dumpSha1;
                 DEBUG("Executing:\n%s", commandLine.c_str());
-                TinyProcessLib::Process proc(
-                    commandLine,
-                    std::string(),
-                    [ptr, &strm, &compressed, &compressOffset](const char *bytes, size_t n) {
+                ptr->exitStatus = Client::spawn(args->preprocessArguments(compiler), ptr->stdOut, [ptr, &output, &compress, &sha1Filter, sha1](size_t offset) {
+                    const unsigned char *bytes = ptr->stdOut.data() + offset;
+                    const size_t n = ptr->stdOut.size() - offset;
                     VERBOSE("Preprocess appending %zu bytes to stdout", n);
-                    ptr->stdOut.insert(ptr->stdOut.end(), reinterpret_cast<const unsigned char *>(bytes), reinterpret_cast<const unsigned char *>(bytes) + n);
+                    if (sha1)
+                        sha1Filter.feed(bytes, n);
                     if (Config::compress) {
-                        unsigned char outBuf[16384];
-                        strm.avail_in = static_cast<uint32_t>(ptr->stdOut.size() - compressOffset);
-                        strm.next_in = ptr->stdOut.data() + compressOffset;
-                        int r;
-                        do {
-                            strm.next_out = outBuf;
-                            strm.avail_out = sizeof(outBuf);
-                            r = deflate(&strm, Z_NO_FLUSH);
-                            const size_t written = sizeof(outBuf) - strm.avail_out;
-                            compressed.insert(compressed.end(), outBuf, outBuf + written);
-                        } while (r != Z_STREAM_END && r != Z_BUF_ERROR);
-                        compressOffset = ptr->stdOut.size() - strm.avail_in;
+                        compress(false);
+                    } else if (ptr->mStream) {
+                        output(bytes, n);
                     }
-                },
-                    [ptr](const char *bytes, size_t n) {
-                    VERBOSE("Preprocess appending %zu bytes to stderr", n);
-                    ptr->stdErr.append(bytes, n);
-                });
-                VERBOSE("Preprocess calling get_status");
-                ptr->exitStatus = proc.get_exit_status();
-                if (Config::compress) {
-                    unsigned char outBuf[16384];
-                    strm.avail_in = static_cast<uint32_t>(ptr->stdOut.size() - compressOffset);
-                    strm.next_in = ptr->stdOut.data() + compressOffset;
-                    int r;
-                    do {
-                        strm.next_out = outBuf;
-                        strm.avail_out = sizeof(outBuf);
-                        r = deflate(&strm, Z_FINISH);
-                        const size_t written = sizeof(outBuf) - strm.avail_out;
-                        compressed.insert(compressed.end(), outBuf, outBuf + written);
-                        // printf("GOT RET %d %zu\n", ret, written);
-                    } while (r != Z_STREAM_END && r != Z_BUF_ERROR);
-                    compressOffset = ptr->stdOut.size() - strm.avail_in;
-                    assert(compressOffset == ptr->stdOut.size());
-                    deflateEnd(&strm);
-                }
+                }, ptr->stdErr);
+                if (Config::compress)
+                    compress(true);
                 DEBUG("Preprocess got status %d", ptr->exitStatus);
-                if (Config::objectCache || Config::dumpSha1) {
-                    // FILE *f = fopen("/tmp/preproc.i", "w");
-                    const unsigned char *ch = ptr->stdOut.data();
-                    const unsigned char *last = ch;
-                    while (*ch) {
-                        // VERBOSE("GETTING CHAR [%c]", *ch);
-                        if (*ch == '#' && ch[1] == ' ' && std::isdigit(ch[2])) {
-                            if (ch > last) {
-                                VERBOSE("Adding to SHA1:\n%.*s\n", static_cast<int>(ch - last), last);
-                                Client::data().sha1Update(last, ch - last);
-                                // fwrite(last, 1, ch - last, f);
-                            }
-                            while (*ch && *ch != '\n')
-                                ++ch;
-                            last = ch;
-                        } else {
-                            ++ch;
-                        }
-                    }
-                    if (last < ch) {
-                        VERBOSE("Adding to SHA1:\n%.*s\n", static_cast<int>(ch - last), last);
-                        Client::data().sha1Update(last, ch - last);
-                        // fwrite(last, 1, ch - last, f);
-                    }
-                    // fclose(f);
-                }
-                if (Config::compress) {
-                    ptr->stdOut = std::move(compressed);
+                if (sha1)
+                    sha1Filter.finish();
+                if (Config::compress && !ptr->mStream) {
+                    // builders without zstd support get the output gzipped instead
+                    if (ptr->zstd || Config::dedupSegments)
+                        ptr->uncompressed = std::move(ptr->stdOut);
+                    ptr->stdOut = std::move(pending);
                 }
+                if (Config::dedupSegments && !ptr->mStream && !ptr->exitStatus)
+                    ptr->segments = split(ptr->raw());
             }
         }
+        if (ptr->mStream)
+            flushPending();
         {
             std::unique_lock<std::mutex> lock(ptr->mMutex);
             ptr->mDone = true;
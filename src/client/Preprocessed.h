@@ -2,8 +2,10 @@
 #define PREPROCESSED_H
 
 #include "Select.h"
+#include <atomic>
 #include <condition_variable>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
 
@@ -17,15 +19,62 @@ public:
     void wait();
     bool done() const;
 
+    // Only valid for streaming instances. Moves the wire chunks produced so
+    // far into chunks and returns true once the last chunk has been handed
+    // out.
+    bool takeChunks(std::vector<std::vector<unsigned char>> &chunks);
+    bool streaming() const
+    {
+        return mStream;
+    }
+
+    enum
+    {
+        StreamChunkSize = 256 * 1024,
+        CompressBlockSize = 256 * 1024,
+        // Segments are cut where the preprocessor enters or leaves a file
+        // this far down the include stack, deeper headers stay inside the
+        // segment of the one that included them
+        MaxSegmentDepth = 4
+    };
+
+    // A piece of the preprocessed output, most of them are the expansion of
+    // a header and come out the same for other translation units
+    struct Segment
+    {
+        size_t offset;
+        size_t size;
+        // sha256 in hex
+        std::string hash;
+    };
+
     std::vector<unsigned char> stdOut;
+    // zstd compressed output also keeps the preprocessed data around (in
+    // uncompressed, or stdOut when streaming) in case the builder can't
+    // handle zstd. So does compressed output with Config::dedupSegments.
+    bool zstd { false };
+    std::vector<unsigned char> uncompressed;
+    // Only collected with Config::dedupSegments when not streaming, they
+    // cover all of raw()
+    std::vector<Segment> segments;
     std::string stdErr;
+    // Files named by the line markers, only collected for DirectMode
+    std::set<std::string> includes;
     size_t cppSize { 0 };
     int exitStatus { -1 };
     unsigned long long duration { 0 };
     unsigned long long slotDuration { 0 };
 
+    static bool supportsZstd();
+    static size_t compressThreads();
+    // The preprocessor's output before compression
+    const std::vector<unsigned char> &raw() const;
+    // zlib level for blocks compressed from now on, can be called from any thread
+    void setCompressionLevel(int level);
+    // level is the zlib level, zstd uses --zstd-level
+    static std::vector<unsigned char> compress(const std::vector<unsigned char> &data, bool zstd, int level);
     static std::unique_ptr<Preprocessed> create(const std::string &compiler, const std::shared_ptr<CompilerArgs> &args, Select *select,
-                                                DaemonSocket *daemonSocket);
+                                                DaemonSocket *daemonSocket, bool stream = false);
 
 private:
     Preprocessed();
@@ -34,6 +83,9 @@ private:
     std::thread mThread;
     bool mDone { false };
     bool mJoined { false };
+    bool mStream { false };
+    std::atomic<int> mCompressionLevel { -1 };
+    std::vector<std::vector<unsigned char>> mChunks;
 };
 
 #endif /* PREPROCESSED_H */
@@ -3,6 +3,24 @@
 void SchedulerWebSocket::onConnected()
 {
     Client::data().watchdog->transition(Watchdog::ConnectedToScheduler);
+    if (handshakeResponseHeader("x-fisk-sha1-deferred") == "true") {
+        waitingForSha1 = true;
+        done = true;
+    }
+}
+
+void SchedulerWebSocket::sendSha1(const std::string &sha1, const std::string &algorithm)
+{
+    assert(waitingForSha1);
+    nlohmann::json msg = nlohmann::json::object();
+    msg["type"] = "sha1";
+    msg["sha1"] = sha1;
+    if (algorithm != "sha1")
+        msg["algorithm"] = algorithm;
+    const std::string json = msg.dump();
+    waitingForSha1 = false;
+    done = false;
+    send(WebSocket::Text, json.c_str(), json.size());
 }
 
 void SchedulerWebSocket::onMessage(MessageType type, const void *bytes, size_t len)
@@ -15,7 +15,12 @@ public:
     virtual void onMessage(MessageType type, const void *bytes, size_t len) override;
     virtual bool connectFinished() override;
 
+    // Only valid after the scheduler agreed to wait for it, see waitingForSha1
+    void sendSha1(const std::string &sha1, const std::string &algorithm);
+
     bool done { false };
+    // The scheduler holds off on picking a builder until we send the sha1
+    bool waitingForSha1 { false };
     bool needsEnvironment { false };
     int jobId { 0 };
     std::string environment;
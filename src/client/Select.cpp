@@ -8,25 +8,37 @@ Socket::~Socket()
 }
 
 int Select::exec(int timeoutMs) const
+{
+#ifdef __linux__
+    if (mEpoll != -1)
+        return execEpoll(timeoutMs);
+#endif
+    return execSelect(timeoutMs);
+}
+
+int Select::execSelect(int timeoutMs) const
 {
     fd_set rMaster, wMaster;
     FD_ZERO(&rMaster);
     FD_ZERO(&wMaster);
     int max = mPipe[0];
     FD_SET(mPipe[0], &rMaster);
-    std::vector<int> timeouts;
     const unsigned long long before = Client::mono();
     for (Socket *socket : mSockets) {
         const int to = socket->timeout();
         if (to != -1 && (timeoutMs == -1 || to < timeoutMs))
             timeoutMs = to;
-        timeouts.push_back(to);
+        socket->mTimeout = to;
         const int fd = socket->fd();
         if (fd == -1)
             continue;
         const unsigned int mode = socket->mode();
         if (!mode)
             continue;
+        if (fd >= FD_SETSIZE) {
+            ERROR("Socket %d doesn't fit in an fd_set", fd);
+            return -1;
+        }
         max = std::max(fd, max);
         if (mode & Socket::Read) {
             FD_SET(fd, &rMaster);
@@ -59,7 +71,6 @@ int Select::exec(int timeoutMs) const
     const unsigned long long after = Client::mono();
     VERBOSE("Woke up from select timeout %dms after %llums with %d sockets fired", timeoutMs, after - before, ret);
 
-    size_t idx = 0;
     if (FD_ISSET(mPipe[0], &r)) {
         --ret;
         char ch;
@@ -70,12 +81,8 @@ int Select::exec(int timeoutMs) const
     }
     for (Socket *socket : mSockets) {
         if (!ret) {
-            if (timeouts[idx] >= 0) {
-                const unsigned long long socketTimeout = timeouts[idx] + before;
-                if (after >= socketTimeout)
-                    socket->onTimeout();
-            }
-            ++idx;
+            if (socket->mTimeout >= 0 && after >= socket->mTimeout + before)
+                socket->onTimeout();
         } else {
             const int fd = socket->fd();
             if (fd != -1) {
@@ -90,6 +97,130 @@ int Select::exec(int timeoutMs) const
     return ret;
 }
 
+#ifdef __linux__
+void Select::update(Socket *socket) const
+{
+    const int fd = socket->fd();
+    const unsigned int mode = fd == -1 ? 0u : socket->mode();
+    if (fd == socket->mRegisteredFd && mode == socket->mRegisteredMode)
+        return;
+
+    if (socket->mRegisteredFd != -1 && (fd != socket->mRegisteredFd || !mode))
+        unregister(socket);
+    if (!mode)
+        return;
+
+    epoll_event event = {};
+    if (mode & Socket::Read)
+        event.events |= EPOLLIN;
+    if (mode & Socket::Write)
+        event.events |= EPOLLOUT;
+    event.data.ptr = socket;
+    int op = socket->mRegisteredFd == -1 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    int ret = epoll_ctl(mEpoll, op, fd, &event);
+    if (ret == -1 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+        // The fd was closed and reopened behind our back
+        op = EPOLL_CTL_ADD;
+        ret = epoll_ctl(mEpoll, op, fd, &event);
+    } else if (ret == -1 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+        op = EPOLL_CTL_MOD;
+        ret = epoll_ctl(mEpoll, op, fd, &event);
+    }
+    if (ret == -1) {
+        ERROR("Failed to %s %d in epoll %d %s", op == EPOLL_CTL_ADD ? "add" : "modify", fd, errno, strerror(errno));
+        return;
+    }
+    socket->mRegisteredFd = fd;
+    socket->mRegisteredMode = mode;
+}
+
+void Select::unregister(Socket *socket) const
+{
+    if (socket->mRegisteredFd == -1)
+        return;
+    // Closing the fd already dropped it from the epoll set so EBADF and
+    // ENOENT are expected here.
+    epoll_ctl(mEpoll, EPOLL_CTL_DEL, socket->mRegisteredFd, nullptr);
+    socket->mRegisteredFd = -1;
+    socket->mRegisteredMode = Socket::None;
+}
+
+int Select::execEpoll(int timeoutMs) const
+{
+    enum
+    {
+        MaxEvents = 32
+    };
+    const unsigned long long before = Client::mono();
+    for (Socket *socket : mSockets) {
+        const int to = socket->timeout();
+        if (to != -1 && (timeoutMs == -1 || to < timeoutMs))
+            timeoutMs = to;
+        socket->mTimeout = to;
+        update(socket);
+    }
+
+    epoll_event events[MaxEvents];
+    int ret;
+    EINTRWRAP(ret, epoll_wait(mEpoll, events, MaxEvents, timeoutMs));
+    if (ret == -1) {
+        ERROR("epoll_wait failed %d %s", errno, strerror(errno));
+        return -1;
+    }
+
+    const unsigned long long after = Client::mono();
+    VERBOSE("Woke up from epoll timeout %dms after %llums with %d sockets fired", timeoutMs, after - before, ret);
+
+    int fired = ret;
+    for (int i = 0; i < ret; ++i) {
+        if (!events[i].data.ptr) {
+            --fired;
+            char ch;
+            ssize_t readRet;
+            EINTRWRAP(readRet, ::read(mPipe[0], &ch, 1));
+            break;
+        }
+    }
+
+    if (!fired) {
+        for (Socket *socket : mSockets) {
+            if (socket->mTimeout >= 0 && after >= socket->mTimeout + before)
+                socket->onTimeout();
+        }
+        return 0;
+    }
+
+    for (int i = 0; i < ret; ++i) {
+        Socket *socket = static_cast<Socket *>(events[i].data.ptr);
+        if (!socket)
+            continue;
+        // Errors and hangups are reported regardless of interest, select()
+        // flags them as readable and writable.
+        const uint32_t flags = events[i].events;
+        const unsigned int mode = socket->mRegisteredMode;
+        if (mode & Socket::Read && flags & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            socket->onRead();
+        if (mode & Socket::Write && flags & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            socket->onWrite();
+    }
+
+    return fired;
+}
+#else
+void Select::update(Socket *) const
+{
+}
+
+void Select::unregister(Socket *) const
+{
+}
+
+int Select::execEpoll(int timeoutMs) const
+{
+    return execSelect(timeoutMs);
+}
+#endif
+
 void Select::wakeup()
 {
     if (mPipe[1] != -1) {
@@ -10,6 +10,9 @@
 #include <string.h>
 #include <sys/select.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 class Select;
 
@@ -34,6 +37,11 @@ struct Socket
 
 private:
     Select *mSelect { nullptr };
+    // What the epoll set currently holds for this socket. A socket that
+    // closes its fd must report -1 from fd() before reusing the slot.
+    int mRegisteredFd { -1 };
+    unsigned int mRegisteredMode { None };
+    int mTimeout { -1 };
     friend class Select;
 };
 
@@ -53,6 +61,19 @@ public:
         if (pipe2(mPipe, O_CLOEXEC) == -1) {
             mPipe[0] = mPipe[1] = -1;
         }
+        mEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (mEpoll == -1) {
+            WARN("Failed to create epoll fd, falling back to select %d %s", errno, strerror(errno));
+        } else if (mPipe[0] != -1) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = nullptr;
+            if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, mPipe[0], &event) == -1) {
+                WARN("Failed to add wakeup pipe to epoll, falling back to select %d %s", errno, strerror(errno));
+                ::close(mEpoll);
+                mEpoll = -1;
+            }
+        }
 #endif
     }
 
@@ -62,9 +83,13 @@ public:
             ::close(mPipe[0]);
         if (mPipe[1] != -1)
             ::close(mPipe[1]);
+        if (mEpoll != -1)
+            ::close(mEpoll);
         for (Socket *socket : mSockets) {
             assert(socket->mSelect == this);
             socket->mSelect = nullptr;
+            socket->mRegisteredFd = -1;
+            socket->mRegisteredMode = Socket::None;
         }
     }
 
@@ -78,6 +103,7 @@ public:
     void remove(Socket *socket)
     {
         assert(socket->mSelect == this);
+        unregister(socket);
         socket->mSelect = nullptr;
         mSockets.erase(socket);
     }
@@ -86,8 +112,14 @@ public:
     void wakeup();
 
 private:
+    int execSelect(int timeoutMs) const;
+    int execEpoll(int timeoutMs) const;
+    void update(Socket *socket) const;
+    void unregister(Socket *socket) const;
+
     std::set<Socket *> mSockets;
     int mPipe[2];
+    int mEpoll { -1 };
 };
 
 inline void Socket::wakeup()
@@ -8,7 +8,7 @@ Watchdog::Watchdog()
 {
     mTransitionTime = Watchdog::timings[Initial] = Client::mono();
     if (Config::objectCache) {
-        stages = { Initial, ConnectedToDaemon, PreprocessFinished, ConnectedToScheduler, AcquiredBuilder, ConnectedToBuilder, UploadedJob, Finished };
+        stages = { Initial, ConnectedToDaemon, ConnectedToScheduler, PreprocessFinished, AcquiredBuilder, ConnectedToBuilder, UploadedJob, Finished };
     } else {
         stages = { Initial, ConnectedToDaemon, ConnectedToScheduler, AcquiredBuilder, ConnectedToBuilder, PreprocessFinished, UploadedJob, Finished };
     }
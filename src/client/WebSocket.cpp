@@ -13,6 +13,7 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 static inline std::string create_acceptkey(const std::string &clientkey)
@@ -45,38 +46,50 @@ WebSocket::WebSocket()
     memset(&mCallbacks, 0, sizeof(mCallbacks));
     mCallbacks.recv_callback = [](wslay_event_context *ctx, uint8_t *buf, size_t len, int /*flags*/, void *user_data) -> ssize_t {
         WebSocket *ws = static_cast<WebSocket *>(user_data);
-        if (ws->mRecvBuffer.empty()) {
+        const size_t available = ws->mRecvBuffer.size() - ws->mRecvBufferOffset;
+        if (!available) {
             wslay_event_set_error(ctx, WSLAY_ERR_WOULDBLOCK);
             return -1;
         }
-        const ssize_t ret = std::min<ssize_t>(ws->mRecvBuffer.size(), len);
-        memcpy(buf, &ws->mRecvBuffer[0], ret);
-        ws->mRecvBuffer.erase(ws->mRecvBuffer.begin(), ws->mRecvBuffer.begin() + ret);
+        const size_t ret = std::min(available, len);
+        memcpy(buf, &ws->mRecvBuffer[ws->mRecvBufferOffset], ret);
+        ws->mRecvBufferOffset += ret;
         return ret;
     };
 
     mCallbacks.send_callback = [](wslay_event_context * /*ctx*/, const uint8_t *data, size_t len, int /*flags*/, void *user_data) -> ssize_t {
         WebSocket *ws = static_cast<WebSocket *>(user_data);
-        ws->mSendBuffer.resize(ws->mSendBuffer.size() + len);
-        memcpy(&ws->mSendBuffer[ws->mSendBuffer.size() - len], data, len);
+        ws->appendToSendQueue(data, len);
         return len;
     };
     mCallbacks.genmask_callback = [](wslay_event_context *, uint8_t *buf, size_t len, void *) -> int {
         return random(buf, len) == len ? 0 : -1;
     };
-    mCallbacks.on_msg_recv_callback = [](wslay_event_context *ctx, const struct wslay_event_on_msg_recv_arg *arg, void *user_data) -> void {
+    // wslay doesn't buffer data messages (see acceptUpgrade) so they're
+    // only seen here, on_msg_recv_callback only gets control frames
+    mCallbacks.on_frame_recv_start_callback = [](wslay_event_context *, const struct wslay_event_on_frame_recv_start_arg *arg, void *user_data) -> void {
         WebSocket *ws = static_cast<WebSocket *>(user_data);
-        assert(ws);
+        ws->mControlFrame = arg->opcode & 0x8;
+        if (ws->mControlFrame)
+            return;
+        ws->mFinalFrame = arg->fin;
+        if (arg->opcode != WSLAY_CONTINUATION_FRAME)
+            ws->onMessageBegin(arg->opcode == WSLAY_TEXT_FRAME ? Text : Binary, arg->payload_length);
+    };
+    mCallbacks.on_frame_recv_chunk_callback = [](wslay_event_context *, const struct wslay_event_on_frame_recv_chunk_arg *arg, void *user_data) -> void {
+        WebSocket *ws = static_cast<WebSocket *>(user_data);
+        if (!ws->mControlFrame && arg->data_length)
+            ws->onMessageData(arg->data, arg->data_length);
+    };
+    mCallbacks.on_frame_recv_end_callback = [](wslay_event_context *, void *user_data) -> void {
+        WebSocket *ws = static_cast<WebSocket *>(user_data);
+        if (!ws->mControlFrame && ws->mFinalFrame)
+            ws->onMessageEnd();
+    };
+    mCallbacks.on_msg_recv_callback = [](wslay_event_context *ctx, const struct wslay_event_on_msg_recv_arg *arg, void *) -> void {
         switch (arg->opcode) {
-            case WSLAY_TEXT_FRAME:
-                ws->onMessage(Text, arg->msg, arg->msg_length);
-                break;
-            case WSLAY_BINARY_FRAME:
-                ws->onMessage(Binary, arg->msg, arg->msg_length);
-                break;
             case WSLAY_PING:
             case WSLAY_PONG:
-            case WSLAY_CONTINUATION_FRAME:
                 wslay_event_send(ctx);
                 break;
         }
@@ -124,8 +137,19 @@ bool WebSocket::connect(const std::string &url,
     sockaddr_in literalSockAddr;
     memset(&literalSockAddr, 0, sizeof(literalSockAddr));
     int ret;
-    if (inet_aton(mHost.c_str(), &literal)) {
-        DEBUG("Got literal ip address: %s", mHost.c_str());
+    // Only trust the daemon's address once, a retry does its own lookup
+    std::string address = mHost;
+    {
+        std::unordered_map<std::string, std::string> &hostAddresses = Client::data().hostAddresses;
+        auto it = hostAddresses.find(mHost);
+        if (it != hostAddresses.end()) {
+            DEBUG("Using address %s for %s from daemon", it->second.c_str(), mHost.c_str());
+            address = std::move(it->second);
+            hostAddresses.erase(it);
+        }
+    }
+    if (inet_aton(address.c_str(), &literal)) {
+        DEBUG("Got literal ip address: %s", address.c_str());
         memset(&stackRes, 0, sizeof(stackRes));
         res = &stackRes;
         res->ai_family = PF_INET;
@@ -251,8 +275,8 @@ bool WebSocket::requestUpgrade()
                                               extraHeaders.c_str());
         DEBUG("Sending headers:\n%s", reqHeader);
 
-        assert(mSendBuffer.empty());
-        mSendBuffer = std::vector<unsigned char>(reqHeader, reqHeader + reqHeaderSize);
+        assert(mSendQueue.empty());
+        appendToSendQueue(reqHeader, reqHeaderSize);
         mState = WaitingForUpgrade;
     }
     send();
@@ -302,10 +326,30 @@ void WebSocket::acceptUpgrade()
         return;
     }
     assert(mContext);
+    wslay_event_config_set_no_buffering(mContext, 1);
     mState = ConnectedWebSocket;
     onConnected();
 }
 
+void WebSocket::onMessageBegin(MessageType type, size_t len)
+{
+    mMessageType = type;
+    mMessage.clear();
+    mMessage.reserve(len);
+}
+
+void WebSocket::onMessageData(const void *data, size_t len)
+{
+    mMessage.insert(mMessage.end(), static_cast<const unsigned char *>(data), static_cast<const unsigned char *>(data) + len);
+}
+
+void WebSocket::onMessageEnd()
+{
+    std::vector<unsigned char> message;
+    std::swap(message, mMessage);
+    onMessage(mMessageType, message.data(), message.size());
+}
+
 bool WebSocket::send(MessageType type, const void *msg, size_t len)
 {
     assert(msg);
@@ -316,6 +360,64 @@ bool WebSocket::send(MessageType type, const void *msg, size_t len)
     return !wslay_event_queue_msg(mContext, &wmsg) && !wslay_event_send(mContext);
 }
 
+bool WebSocket::sendNoCopy(const void *msg, size_t len)
+{
+    assert(msg);
+    assert(len);
+    assert(mContext);
+    // Flush whatever wslay has queued so our frame ends up after it. Our
+    // send_callback never blocks so wslay never holds a partial frame.
+    if (wslay_event_send(mContext))
+        return false;
+    if (wslay_event_get_close_sent(mContext))
+        return false;
+
+    // Client frames have to be masked with a fresh key (RFC 6455 5.3). An all
+    // zero key leaves the payload as is so it can go straight from the
+    // caller's buffer, that's opt in since proxies along the way may rely on
+    // the masking.
+    SendSegment segment;
+    segment.external = static_cast<const unsigned char *>(msg);
+    segment.externalSize = len;
+    if (!Config::zeroMaskUploads) {
+        if (random(segment.mask, sizeof(segment.mask)) != sizeof(segment.mask))
+            return false;
+        segment.masked = true;
+    }
+
+    unsigned char header[14];
+    size_t headerSize = 2;
+    header[0] = 0x80 | WSLAY_BINARY_FRAME;
+    if (len < 126) {
+        header[1] = 0x80 | static_cast<unsigned char>(len);
+    } else if (len <= 0xffff) {
+        header[1] = 0x80 | 126;
+        header[2] = static_cast<unsigned char>(len >> 8);
+        header[3] = static_cast<unsigned char>(len);
+        headerSize = 4;
+    } else {
+        header[1] = 0x80 | 127;
+        for (int i = 0; i < 8; ++i) {
+            header[2 + i] = static_cast<unsigned char>(static_cast<uint64_t>(len) >> (56 - (i * 8)));
+        }
+        headerSize = 10;
+    }
+    memcpy(header + headerSize, segment.mask, sizeof(segment.mask));
+    headerSize += sizeof(segment.mask);
+    appendToSendQueue(header, headerSize);
+    mSendQueue.push_back(std::move(segment));
+    send();
+    return mState != Error;
+}
+
+void WebSocket::appendToSendQueue(const void *data, size_t len)
+{
+    if (mSendQueue.empty() || mSendQueue.back().external)
+        mSendQueue.emplace_back();
+    std::vector<unsigned char> &buf = mSendQueue.back().data;
+    buf.insert(buf.end(), static_cast<const unsigned char *>(data), static_cast<const unsigned char *>(data) + len);
+}
+
 void WebSocket::close(const char *reason)
 {
     wslay_event_queue_close(mContext, 1000, reinterpret_cast<const uint8_t *>(reason), reason ? strlen(reason) : 0);
@@ -381,16 +483,28 @@ void WebSocket::onWrite()
 
 void WebSocket::onRead()
 {
-    const bool sendBufferWasEmpty = mSendBuffer.empty();
+    enum
+    {
+        ReadSize = 64 * 1024
+    };
+
+    const bool sendBufferWasEmpty = mSendQueue.empty();
+    // Consumed data is dropped once here rather than on every recv_callback
+    if (mRecvBufferOffset) {
+        mRecvBuffer.erase(mRecvBuffer.begin(), mRecvBuffer.begin() + mRecvBufferOffset);
+        mRecvBufferOffset = 0;
+    }
     while (true) {
-        char buf[BUFSIZ];
-        const ssize_t r = ::read(mFD, buf, sizeof(buf));
+        const size_t size = mRecvBuffer.size();
+        mRecvBuffer.resize(size + ReadSize);
+        const ssize_t r = ::read(mFD, &mRecvBuffer[size], ReadSize);
+        mRecvBuffer.resize(size + std::max<ssize_t>(r, 0));
         VERBOSE("Read %zd bytes", r);
         if (!r) {
             mState = Closed;
             break;
         } else if (r > 0) {
-            mRecvBuffer.insert(mRecvBuffer.end(), buf, buf + r);
+            continue;
         } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
             break;
         } else if (errno != EINTR) {
@@ -409,17 +523,21 @@ void WebSocket::onRead()
     }
     if (mState == ConnectedWebSocket) {
         while (true) {
-            const size_t last = mRecvBuffer.size();
+            const size_t last = mRecvBufferOffset;
             const int r = wslay_event_recv(mContext);
             if (r) {
                 setError(Client::format("Got wslay_event_recv error: %d", r));
                 return;
             }
-            if (mRecvBuffer.empty() || last == mRecvBuffer.size())
+            if (mRecvBufferOffset == mRecvBuffer.size() || last == mRecvBufferOffset)
                 break;
         }
+        if (mRecvBufferOffset == mRecvBuffer.size()) {
+            mRecvBuffer.clear();
+            mRecvBufferOffset = 0;
+        }
 
-        if (sendBufferWasEmpty && !mSendBuffer.empty())
+        if (sendBufferWasEmpty && !mSendQueue.empty())
             send();
         wslay_event_send(mContext);
     }
@@ -427,15 +545,53 @@ void WebSocket::onRead()
 
 void WebSocket::send()
 {
-    // Use larger write chunks for better throughput (64KB instead of BUFSIZ which is often 8KB)
-    static constexpr size_t writeChunkSize = 64 * 1024;
+    enum
+    {
+        MaxSegments = 64,
+        StagingSize = 256 * 1024
+    };
 
-    while (mSendBufferOffset < mSendBuffer.size()) {
-        const size_t remaining = mSendBuffer.size() - mSendBufferOffset;
-        const ssize_t r = ::write(mFD, &mSendBuffer[mSendBufferOffset], std::min<size_t>(writeChunkSize, remaining));
+    while (!mSendQueue.empty()) {
+        iovec iov[MaxSegments];
+        int count = 0;
+        size_t offset = mSendQueueOffset;
+        for (auto it = mSendQueue.begin(); it != mSendQueue.end() && count < MaxSegments; ++it) {
+            if (it->masked) {
+                // Only one piece is masked at a time so this is the last
+                // segment for this write
+                if (mStagingSegment != &*it || offset < mStagingOffset || offset >= mStagingOffset + mStaging.size()) {
+                    mStagingSegment = &*it;
+                    mStagingOffset = offset;
+                    mStaging.reserve(StagingSize);
+                    mStaging.resize(std::min<size_t>(StagingSize, it->size() - offset));
+                    for (size_t i = 0; i < mStaging.size(); ++i)
+                        mStaging[i] = it->external[offset + i] ^ it->mask[(offset + i) & 3];
+                }
+                iov[count].iov_base = mStaging.data() + (offset - mStagingOffset);
+                iov[count].iov_len = mStaging.size() - (offset - mStagingOffset);
+                ++count;
+                break;
+            }
+            iov[count].iov_base = const_cast<unsigned char *>(it->bytes() + offset);
+            iov[count].iov_len = it->size() - offset;
+            offset = 0;
+            ++count;
+        }
+        ssize_t r = ::writev(mFD, iov, count);
         VERBOSE("Wrote %zd bytes\n", r);
         if (r > 0) {
-            mSendBufferOffset += r;
+            while (r > 0) {
+                const size_t remaining = mSendQueue.front().size() - mSendQueueOffset;
+                if (static_cast<size_t>(r) < remaining) {
+                    mSendQueueOffset += r;
+                    break;
+                }
+                r -= remaining;
+                if (mStagingSegment == &mSendQueue.front())
+                    mStagingSegment = nullptr;
+                mSendQueue.pop_front();
+                mSendQueueOffset = 0;
+            }
         } else if (errno == EWOULDBLOCK || errno == EAGAIN) {
             break;
         } else if (errno != EINTR) {
@@ -447,9 +603,4 @@ void WebSocket::send()
             break;
         }
     }
-    // Only compact buffer when we've consumed a significant portion (avoid O(n) erase on every write)
-    if (mSendBufferOffset > 0 && (mSendBufferOffset >= mSendBuffer.size() || mSendBufferOffset >= 256 * 1024)) {
-        mSendBuffer.erase(mSendBuffer.begin(), mSendBuffer.begin() + mSendBufferOffset);
-        mSendBufferOffset = 0;
-    }
 }
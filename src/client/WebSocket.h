@@ -3,6 +3,7 @@
 
 #include "Select.h"
 #include <LUrlParser.h>
+#include <deque>
 #include <functional>
 #include <map>
 #include <string>
@@ -25,11 +26,15 @@ public:
                  const std::map<std::string, std::string> &headers,
                  const std::string &iface);
     bool send(MessageType mode, const void *data, size_t len);
+    // Sends a binary message without copying all of the payload up front, it's
+    // masked a piece at a time as the socket drains. data has to stay valid
+    // until hasPendingSendData() returns false.
+    bool sendNoCopy(const void *data, size_t len);
     void close(const char *reason);
 
     bool hasPendingSendData() const
     {
-        return mSendBufferOffset < mSendBuffer.size();
+        return !mSendQueue.empty();
     }
 
     enum State
@@ -88,6 +93,11 @@ public:
 
 protected:
     virtual void onMessage(MessageType mode, const void *data, size_t len) = 0;
+    // Data messages are delivered as they come off the socket. The default
+    // implementation collects the whole message and calls onMessage.
+    virtual void onMessageBegin(MessageType mode, size_t len);
+    virtual void onMessageData(const void *data, size_t len);
+    virtual void onMessageEnd();
     virtual void onConnected() = 0;
 
     // Socket
@@ -114,6 +124,7 @@ private:
     bool requestUpgrade();
     void acceptUpgrade();
     void send();
+    void appendToSendQueue(const void *data, size_t len);
     std::string mUrl, mHost, mClientKey;
     int mPort { -1 };
     LUrlParser::ParseURL mParsedUrl;
@@ -123,8 +134,42 @@ private:
     wslay_event_context *mContext { nullptr };
     std::string mError;
 
-    std::vector<unsigned char> mRecvBuffer, mSendBuffer;
-    size_t mSendBufferOffset { 0 };
+    std::vector<unsigned char> mRecvBuffer;
+    size_t mRecvBufferOffset { 0 };
+
+    // state of the frame currently being received
+    bool mControlFrame { false };
+    bool mFinalFrame { false };
+    MessageType mMessageType { Text };
+    std::vector<unsigned char> mMessage;
+
+    // Pending writes in order, either owned bytes from wslay and the
+    // handshake or payloads passed to sendNoCopy
+    struct SendSegment
+    {
+        std::vector<unsigned char> data;
+        const unsigned char *external { nullptr };
+        size_t externalSize { 0 };
+        // external goes out through mStaging, XOR'ed with this
+        bool masked { false };
+        unsigned char mask[4] {};
+
+        const unsigned char *bytes() const
+        {
+            return external ? external : data.data();
+        }
+
+        size_t size() const
+        {
+            return external ? externalSize : data.size();
+        }
+    };
+    std::deque<SendSegment> mSendQueue;
+    size_t mSendQueueOffset { 0 };
+    // The masked bytes of mStagingSegment from mStagingOffset on
+    std::vector<unsigned char> mStaging;
+    const SendSegment *mStagingSegment { nullptr };
+    size_t mStagingOffset { 0 };
     std::vector<std::string> mHandshakeResponseHeaders;
     State mState { None };
 };
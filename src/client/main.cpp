@@ -1,9 +1,12 @@
+#include <algorithm>
+#include <arpa/inet.h>
 #include <climits>
 #include <csignal>
 #include <cstdlib>
 #include <cstring>
 #include <execinfo.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <variant>
 #ifdef __linux__
 #include <sys/prctl.h>
@@ -14,6 +17,10 @@
 #include "CompilerArgs.h"
 #include "Config.h"
 #include "DaemonSocket.h"
+#include "DirectMode.h"
+#include "IncludeScanner.h"
+#include "LinkStats.h"
+#include "LocalCache.h"
 #include "Log.h"
 #include "Preprocessed.h"
 #include "SchedulerWebSocket.h"
@@ -25,6 +32,8 @@ static unsigned long long preprocessedDuration = 0;
 static unsigned long long preprocessedSlotDuration = 0;
 extern "C" const char *npm_version;
 static std::string schedulerUrl();
+static void writeDiagnostics(const std::string &str);
+static std::string localCacheKey(const std::string &cacheKey);
 static int clientVerify();
 
 template <typename T>
@@ -163,6 +172,12 @@ int main(int argc, char **argv)
     data.watchdog = new Watchdog;
     data.argv = argv;
     data.argc = argc;
+    std::string hashAlgorithm = Config::hashAlgorithm;
+    std::transform(hashAlgorithm.begin(), hashAlgorithm.end(), hashAlgorithm.begin(), [](unsigned char c) { return std::tolower(c); });
+    if (!data.initHash(hashAlgorithm)) {
+        ERROR("Unsupported hash algorithm %s, only sha1, blake2s256 and blake2b512 work. Using sha1", hashAlgorithm.c_str());
+        hashAlgorithm = "sha1";
+    }
     auto signalHandler = [](int signal) {
         if (signal != SIGINT && signal != SIGTERM) {
             fprintf(stderr, "fiskc: Caught signal %d\n", signal);
@@ -279,6 +294,7 @@ int main(int argc, char **argv)
         return 0; // unreachable
     }
 
+    std::vector<std::string> sources;
     {
         std::vector<std::string> args(data.argc);
         for (int i = 0; i < data.argc; ++i) {
@@ -286,7 +302,12 @@ int main(int argc, char **argv)
             args[i] = data.argv[i];
         }
 
-        data.compilerArgs = CompilerArgs::create(std::move(args), &data.localReason);
+        data.compilerArgs = CompilerArgs::create(std::move(args), &data.localReason, Config::splitSources ? &sources : nullptr);
+    }
+    if (!data.compilerArgs && sources.size() > 1) {
+        // Each one goes through the daemon and the scheduler on its own
+        data.watchdog->stop();
+        Client::runSplit(sources);
     }
     if (!data.compilerArgs) {
         DEBUG("Have to run locally");
@@ -294,8 +315,18 @@ int main(int argc, char **argv)
         return 0; // unreachable
     }
 
-    daemonSocket.sendAcquireSlot(data.resolvedCompiler);
+    const std::string url = schedulerUrl();
+    {
+        // Have the daemon hand us the scheduler's address along with the slot
+        std::vector<std::string> resolve;
+        const LUrlParser::ParseURL parsed = LUrlParser::ParseURL::parseURL(url);
+        in_addr literal;
+        if (parsed.isValid() && !inet_aton(parsed.host_.c_str(), &literal))
+            resolve.push_back(parsed.host_);
+        daemonSocket.sendAcquireSlot(data.resolvedCompiler, resolve, data.compilerArgs->nativeArgs);
+    }
     daemonSocket.waitForSlot(select);
+    data.hostAddresses = daemonSocket.hosts();
 
     if (daemonSocket.compilerInfo().hash.empty()) {
         DEBUG("Daemon returned no compiler info, running locally");
@@ -308,7 +339,10 @@ int main(int argc, char **argv)
     // CONTRACT (see CompilerArgs.cpp): finalize(info) MUST run after CompilerArgs::create and
     // BEFORE any preprocess-side sha1Update. Preprocessed::create below is what starts the
     // preprocess pipeline, so finalize has to happen here.
-    data.compilerArgs->finalize(info);
+    if (!data.compilerArgs->finalize(info)) {
+        data.localReason = CompilerArgs::Local_NativeArch;
+        runLocal("native arch");
+    }
 
     if (daemonSocket.hasLocalSlot()) {
         DEBUG("Got local compile slot, running locally");
@@ -323,9 +357,37 @@ int main(int argc, char **argv)
         Client::runLocal("slot acquisition failure");
     }
 
-    // Got a cpp slot - proceed with remote compilation
-    data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, &select, &daemonSocket);
-    assert(data.preprocessed);
+    // Got a cpp slot - proceed with remote compilation. In direct mode the
+    // preprocessor only runs if the included files changed or the builder
+    // turns out not to have the object after all.
+    std::string directKey;
+    DirectMode::Entry direct;
+    if (DirectMode::enabled()) {
+        directKey = DirectMode::key();
+        data.directMode = !directKey.empty() && DirectMode::lookup(directKey, &direct);
+    }
+    // Pump mode skips it too as long as the includes can be found without it
+    std::unique_ptr<IncludeScanner::Result> pump;
+    if (!data.directMode && Config::pump) {
+        pump = std::make_unique<IncludeScanner::Result>();
+        std::string reason;
+        if (!IncludeScanner::scan(data.compiler, *data.compilerArgs, info.type == Client::CompilerType::GCC, pump.get(), &reason)) {
+            VERBOSE("Not using pump mode for %s: %s", data.compilerArgs->sourceFile().c_str(), reason.c_str());
+            pump.reset();
+        }
+    }
+    data.pump = pump != nullptr;
+    if (!data.directMode && !pump) {
+        data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, &select, &daemonSocket, Config::streamUpload && !Config::objectCache);
+        assert(data.preprocessed);
+    }
+
+    // Until we know which builder we get, compress for the one we used last
+    const bool adaptiveCompression = Config::adaptiveCompression && Config::compress && Config::compression.get() != "zstd";
+    LinkStats::Link link;
+    if (data.preprocessed && adaptiveCompression && LinkStats::load(std::string(), &link)) {
+        data.preprocessed->setCompressionLevel(LinkStats::compressionLevel(link, Preprocessed::compressThreads()));
+    }
 
     std::map<std::string, std::string> headers;
     {
@@ -360,7 +422,6 @@ int main(int argc, char **argv)
         if (!hostname.empty())
             headers["x-fisk-client-hostname"] = std::move(hostname);
     }
-    const std::string url = schedulerUrl();
 
     bool releaseCppSlotOnCppFinished = true;
     {
@@ -374,30 +435,94 @@ int main(int argc, char **argv)
         }
     }
 
-    if (Config::objectCache) {
-        DEBUG("Waiting for preprocessed");
-        while (!data.preprocessed->done() && daemonSocket.state() == DaemonSocket::Connected && !data.watchdog->timedOut()) {
-            select.exec();
-        }
-        if (data.watchdog->timedOut()) {
-            ERROR("Have to run locally because we timed out waiting for preprocessing");
-            runLocal("watchdog preprocessing");
+    Client::data().builderHasJSONDiagnostics = ((Config::jsonDiagnostics || Config::jsonDiagnosticsRaw) && info.type == Client::CompilerType::GCC && info.version.major >= 10);
+
+    std::string cacheKey, localKey;
+    LocalCache::Entry cached;
+    // Hits in the local cache don't need the scheduler, or the network at all
+    auto loadLocal = [&]() {
+        if (localKey.empty() || !LocalCache::enabled() || !LocalCache::load(localKey, &cached))
+            return false;
+        data.localCache = true;
+        data.exitCode = cached.exitCode;
+        data.watchdog->stop();
+        writeDiagnostics(data.preprocessed ? data.preprocessed->stdErr : direct.stdErr);
+        fwrite(cached.stdOut.c_str(), 1, cached.stdOut.size(), stdout);
+        writeDiagnostics(cached.stdErr);
+        return true;
+    };
+    if (data.directMode && Config::objectCache) {
+        cacheKey = direct.objectKey;
+        localKey = localCacheKey(cacheKey);
+        if (loadLocal()) {
+            Client::writeStatistics();
+            return data.exitCode;
         }
-        if (releaseCppSlotOnCppFinished)
-            daemonSocket.send(DaemonSocket::ReleaseCppSlot);
-        data.watchdog->transition(Watchdog::PreprocessFinished);
-        DEBUG("Preprocessed finished");
-        preprocessedDuration = data.preprocessed->duration;
-        preprocessedSlotDuration = data.preprocessed->slotDuration;
+    }
 
-        if (data.preprocessed->exitStatus != 0) {
-            ERROR("Failed to preprocess. Running locally");
-            runLocal("preprocess error 2");
+    // The object cache key needs the preprocessed output so ask the scheduler
+    // to wait for it rather than connecting after preprocessing is done
+    if (Config::objectCache)
+        headers["x-fisk-sha1-deferred"] = "true";
+
+    std::variant<std::unique_ptr<SchedulerWebSocket>, std::string> schedulerWebsocketResult = connectWebSocketWithRetry<SchedulerWebSocket>(
+        select,
+        url + "/compile",
+        Config::schedulerInterface,
+        headers,
+        "scheduler");
+
+    std::unique_ptr<SchedulerWebSocket> schedulerWebsocket;
+    std::string schedulerError;
+    if (std::holds_alternative<std::string>(schedulerWebsocketResult)) {
+        schedulerError = std::get<std::string>(schedulerWebsocketResult);
+        // Not fatal until the local cache has had a look
+        if (!Config::objectCache || !LocalCache::enabled() || data.directMode) {
+            ERROR("Have to run locally because scheduler connect failed: %s", schedulerError.c_str());
+            runLocal(schedulerError);
         }
+        DEBUG("Scheduler connect failed: %s, checking the local cache", schedulerError.c_str());
+    } else {
+        schedulerWebsocket = std::get<std::unique_ptr<SchedulerWebSocket>>(std::move(schedulerWebsocketResult));
+    }
 
-        if (data.preprocessed->stdOut.empty()) {
-            ERROR("Empty preprocessed output. Running locally");
-            runLocal("preprocess error 3");
+    if (data.directMode) {
+        data.watchdog->transition(Watchdog::PreprocessFinished);
+    } else if (Config::objectCache) {
+        if (pump) {
+            // The files stand in for the preprocessed output. The cpp slot is
+            // kept in case the builder turns out not to support pump mode.
+            data.watchdog->transition(Watchdog::PreprocessFinished);
+            Client::data().sha1Update(pump->cwd.c_str(), pump->cwd.size() + 1);
+            for (const IncludeScanner::File &file : pump->files) {
+                Client::data().sha1Update(file.path.c_str(), file.path.size() + 1);
+                Client::data().sha1Update(file.hash.c_str(), file.hash.size());
+            }
+        } else {
+            DEBUG("Waiting for preprocessed");
+            while (!data.preprocessed->done() && daemonSocket.state() == DaemonSocket::Connected && !data.watchdog->timedOut()) {
+                select.exec();
+            }
+            if (!data.preprocessed->done() && data.watchdog->timedOut()) {
+                ERROR("Have to run locally because we timed out waiting for preprocessing");
+                runLocal("watchdog preprocessing");
+            }
+            if (releaseCppSlotOnCppFinished)
+                daemonSocket.send(DaemonSocket::ReleaseCppSlot);
+            data.watchdog->transition(Watchdog::PreprocessFinished);
+            DEBUG("Preprocessed finished");
+            preprocessedDuration = data.preprocessed->duration;
+            preprocessedSlotDuration = data.preprocessed->slotDuration;
+
+            if (data.preprocessed->exitStatus != 0) {
+                ERROR("Failed to preprocess. Running locally");
+                runLocal("preprocess error 2");
+            }
+
+            if (data.preprocessed->stdOut.empty()) {
+                ERROR("Empty preprocessed output. Running locally");
+                runLocal("preprocess error 3");
+            }
         }
 
         VERBOSE("SHA1'ing compiler hash [%s]", data.hash.c_str());
@@ -407,25 +532,86 @@ int main(int argc, char **argv)
         VERBOSE("SHA1'ing object cache tag [%s]", tag.c_str());
         Client::data().sha1Update(tag.c_str(), tag.size());
 
-        unsigned char sha1Buf[SHA_DIGEST_LENGTH];
-        Client::data().sha1Final(sha1Buf);
-        std::string sha1 = Client::toHex(sha1Buf, sizeof(sha1Buf));
-        WARN("Got sha1: %s", sha1.c_str());
-        headers["x-fisk-sha1"] = std::move(sha1);
+        unsigned char sha1Buf[EVP_MAX_MD_SIZE];
+        const size_t sha1Len = Client::data().sha1Final(sha1Buf);
+        cacheKey = Client::toHex(sha1Buf, sha1Len);
     }
 
-    std::variant<std::unique_ptr<SchedulerWebSocket>, std::string> schedulerWebsocketResult = connectWebSocketWithRetry<SchedulerWebSocket>(
-        select,
-        url + "/compile",
-        Config::schedulerInterface,
-        headers,
-        "scheduler");
+    if (Config::objectCache) {
+        WARN("Got sha1: %s", cacheKey.c_str());
+        headers["x-fisk-sha1"] = cacheKey;
+        if (hashAlgorithm != "sha1")
+            headers["x-fisk-sha1-algorithm"] = hashAlgorithm;
+        headers.erase("x-fisk-sha1-deferred");
+
+        localKey = localCacheKey(cacheKey);
+
+        // Recording the includes means reading them again so it happens
+        // while waiting for someone else
+        auto storeDirect = [&]() {
+            if (directKey.empty() || data.directMode)
+                return;
+            if (pump) {
+                std::set<std::string> includes;
+                for (const IncludeScanner::File &file : pump->files)
+                    includes.insert(file.path);
+                DirectMode::store(directKey, { cacheKey, std::string() }, includes);
+            } else {
+                DirectMode::store(directKey, { cacheKey, data.preprocessed->stdErr }, data.preprocessed->includes);
+            }
+        };
+
+        // Direct mode looked before connecting
+        if (!data.directMode && loadLocal()) {
+            if (schedulerWebsocket)
+                schedulerWebsocket->close("localcachehit");
+            storeDirect();
+            Client::writeStatistics();
+            return data.exitCode;
+        }
+        if (!schedulerWebsocket) {
+            ERROR("Have to run locally because scheduler connect failed: %s", schedulerError.c_str());
+            runLocal(schedulerError);
+        }
 
-    if (std::holds_alternative<std::string>(schedulerWebsocketResult)) {
-        ERROR("Have to run locally because scheduler connect failed: %s", std::get<std::string>(schedulerWebsocketResult).c_str());
-        runLocal(std::get<std::string>(schedulerWebsocketResult));
+        if (!schedulerWebsocket->waitingForSha1 && schedulerWebsocket->handshakeResponseHeader("x-fisk-object-cache") == "true") {
+            // Schedulers from before x-fisk-sha1-deferred picked a builder
+            // without looking in the cache, ask again now that there's a key
+            DEBUG("Scheduler didn't wait for the sha1, reconnecting with it");
+            schedulerWebsocket->close("sha1");
+            select.remove(schedulerWebsocket.get());
+            schedulerWebsocket.reset();
+            schedulerWebsocketResult = connectWebSocketWithRetry<SchedulerWebSocket>(
+                select,
+                url + "/compile",
+                Config::schedulerInterface,
+                headers,
+                "scheduler");
+            if (std::holds_alternative<std::string>(schedulerWebsocketResult)) {
+                ERROR("Have to run locally because scheduler connect failed: %s", std::get<std::string>(schedulerWebsocketResult).c_str());
+                runLocal(std::get<std::string>(schedulerWebsocketResult));
+            }
+            schedulerWebsocket = std::get<std::unique_ptr<SchedulerWebSocket>>(std::move(schedulerWebsocketResult));
+        }
+
+        const bool deferred = schedulerWebsocket->waitingForSha1;
+        if (deferred)
+            schedulerWebsocket->sendSha1(headers["x-fisk-sha1"], hashAlgorithm);
+        storeDirect();
+        if (deferred) {
+            while (!schedulerWebsocket->done && !data.watchdog->timedOut() && schedulerWebsocket->state() == WebSocket::ConnectedWebSocket) {
+                select.exec();
+            }
+            if (data.watchdog->timedOut()) {
+                ERROR("Have to run locally because we timed out waiting for the scheduler");
+                runLocal("watchdog scheduler");
+            }
+            if (!schedulerWebsocket->done && schedulerWebsocket->error().empty()) {
+                ERROR("Have to run locally because the scheduler went away");
+                runLocal("scheduler closed");
+            }
+        }
     }
-    std::unique_ptr<SchedulerWebSocket> schedulerWebsocket = std::get<std::unique_ptr<SchedulerWebSocket>>(std::move(schedulerWebsocketResult));
 
     if (!schedulerWebsocket->error().empty()) {
         DEBUG("Have to run locally because no server: %s", schedulerWebsocket->error().c_str());
@@ -447,10 +633,8 @@ int main(int argc, char **argv)
 
     const bool objectCache = schedulerWebsocket->handshakeResponseHeader("x-fisk-object-cache") == "true";
     if (!objectCache && Config::objectCache) {
-        const auto it = headers.find("x-fisk-sha1");
-        if (it != headers.end()) {
-            headers.erase(it);
-        }
+        headers.erase("x-fisk-sha1");
+        headers.erase("x-fisk-sha1-algorithm");
     }
 
     if ((data.builderHostname.empty() && data.builderIp.empty()) || !data.builderPort) {
@@ -463,7 +647,6 @@ int main(int argc, char **argv)
 
     // usleep(1000 * 1000 * 16);
     data.watchdog->transition(Watchdog::AcquiredBuilder);
-    Client::data().builderHasJSONDiagnostics = ((Config::jsonDiagnostics || Config::jsonDiagnosticsRaw) && info.type == Client::CompilerType::GCC && info.version.major >= 10);
     headers["x-fisk-job-id"] = std::to_string(schedulerWebsocket->jobId);
     headers["x-fisk-builder-ip"] = data.builderIp;
 
@@ -478,6 +661,19 @@ int main(int argc, char **argv)
         data.builderPort);
     DEBUG("Connecting to builder %s", builderUrl.c_str());
 
+    const std::string linkKey = Client::format("%s:%d", data.builderIp.empty() ? data.builderHostname.c_str() : data.builderIp.c_str(), data.builderPort);
+    int compressionLevel = -1;
+    if (adaptiveCompression && LinkStats::load(linkKey, &link)) {
+        compressionLevel = LinkStats::compressionLevel(link, Preprocessed::compressThreads());
+        DEBUG("Using compression level %d for %s", compressionLevel, linkKey.c_str());
+        if (data.preprocessed)
+            data.preprocessed->setCompressionLevel(compressionLevel);
+    }
+    // Even when the daemon handed it out, that's what keeps it from expiring
+    if (!data.builderHostname.empty())
+        daemonSocket.sendResolveHost(data.builderHostname);
+    const unsigned long long builderConnectStarted = Client::mono();
+
     std::variant<std::unique_ptr<BuilderWebSocket>, std::string> builderWebSocketResult = connectWebSocketWithRetry<BuilderWebSocket>(
         select,
         builderUrl,
@@ -490,9 +686,33 @@ int main(int argc, char **argv)
         runLocal(std::get<std::string>(builderWebSocketResult));
     }
     std::unique_ptr<BuilderWebSocket> builderWebSocket = std::get<std::unique_ptr<BuilderWebSocket>>(std::move(builderWebSocketResult));
+    const unsigned long long builderConnectDuration = Client::mono() - builderConnectStarted;
 
     data.watchdog->transition(Watchdog::ConnectedToBuilder);
-    if (!Config::objectCache) {
+    const bool pumped = pump && builderWebSocket->handshakeResponseHeader("x-fisk-pump") == "true";
+    bool zstd = false, stream = false;
+    if (data.preprocessed) {
+        zstd = data.preprocessed->zstd && builderWebSocket->handshakeResponseHeader("x-fisk-zstd") == "true";
+        stream = data.preprocessed->streaming() && builderWebSocket->handshakeResponseHeader("x-fisk-stream-upload") == "true" && zstd == data.preprocessed->zstd;
+    } else if (!pumped) {
+        // A streamed upload doesn't need its size up front so direct mode
+        // can hold off preprocessing until the builder asks for the data.
+        // Pump mode ends up here if the builder doesn't support it.
+        const bool wantZstd = Config::compress && Config::compression.get() == "zstd" && Preprocessed::supportsZstd();
+        zstd = wantZstd && builderWebSocket->handshakeResponseHeader("x-fisk-zstd") == "true";
+        stream = builderWebSocket->handshakeResponseHeader("x-fisk-stream-upload") == "true" && zstd == wantZstd;
+        if (!stream) {
+            DEBUG("Builder doesn't support streamed uploads, preprocessing after all");
+            data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, &select, &daemonSocket);
+            data.preprocessed->setCompressionLevel(compressionLevel);
+        }
+    }
+    if (pumped) {
+        if (releaseCppSlotOnCppFinished)
+            daemonSocket.send(DaemonSocket::ReleaseCppSlot);
+        if (!Config::objectCache)
+            data.watchdog->transition(Watchdog::PreprocessFinished);
+    } else if ((!Config::objectCache || data.directMode || pump) && !stream) {
         DEBUG("Waiting for preprocessed");
         while (!data.preprocessed->done() && daemonSocket.state() == DaemonSocket::Connected && !data.watchdog->timedOut()) {
             select.exec();
@@ -504,7 +724,8 @@ int main(int argc, char **argv)
 
         if (releaseCppSlotOnCppFinished)
             daemonSocket.send(DaemonSocket::ReleaseCppSlot);
-        data.watchdog->transition(Watchdog::PreprocessFinished);
+        if (!Config::objectCache)
+            data.watchdog->transition(Watchdog::PreprocessFinished);
         DEBUG("Preprocessed finished");
         preprocessedDuration = data.preprocessed->duration;
         preprocessedSlotDuration = data.preprocessed->slotDuration;
@@ -520,6 +741,32 @@ int main(int argc, char **argv)
         }
     }
 
+    // Builders with a header cache only get the segments they haven't seen,
+    // compressed at the level picked for this builder like the rest would have been
+    const bool segmented = !stream && data.preprocessed && !data.preprocessed->segments.empty() && builderWebSocket->handshakeResponseHeader("x-fisk-segments") == "true";
+    std::vector<std::vector<unsigned char>> chunks;
+    if (segmented) {
+        DEBUG("Sending preprocessed data in %zu segments", data.preprocessed->segments.size());
+    } else if (data.preprocessed && data.preprocessed->zstd && !zstd) {
+        DEBUG("Builder doesn't support zstd, sending gzipped preprocessed data");
+        if (data.preprocessed->streaming()) {
+            data.preprocessed->takeChunks(chunks);
+            chunks.clear();
+            data.preprocessed->stdOut = Preprocessed::compress(data.preprocessed->stdOut, false, compressionLevel);
+        } else {
+            data.preprocessed->stdOut = Preprocessed::compress(data.preprocessed->uncompressed, false, compressionLevel);
+        }
+    } else if (data.preprocessed && data.preprocessed->streaming() && !stream) {
+        DEBUG("Builder doesn't support streamed uploads, sending preprocessed data in one message");
+        data.preprocessed->takeChunks(chunks);
+        std::vector<unsigned char> wire;
+        for (const std::vector<unsigned char> &chunk : chunks) {
+            wire.insert(wire.end(), chunk.begin(), chunk.end());
+        }
+        chunks.clear();
+        data.preprocessed->stdOut = std::move(wire);
+    }
+
     std::vector<std::string> args = data.compilerArgs->commandLine;
     args[0] = data.builderCompiler;
     if (!schedulerWebsocket->extraArguments.empty()) {
@@ -535,9 +782,32 @@ int main(int argc, char **argv)
         { "commandLine", args },
         { "argv0", data.compiler },
         { "wait", wait },
-        { "compressed", Config::compress.get() },
-        { "bytes", static_cast<int>(data.preprocessed->stdOut.size()) }
+        { "compressed", Config::compress.get() }
     };
+    if (zstd)
+        msg["compression"] = "zstd";
+    if (pumped) {
+        // The builder answers with the hashes it doesn't have
+        nlohmann::json files = nlohmann::json::array();
+        for (const IncludeScanner::File &file : pump->files)
+            files.push_back({ { "path", file.path }, { "hash", file.hash }, { "size", file.contents.size() } });
+        msg["pump"] = { { "cwd", pump->cwd },
+                        { "dirs", pump->dirs },
+                        { "systemIncludes", pump->systemIncludes },
+                        { "files", std::move(files) } };
+        if (!pump->preinclude.empty())
+            msg["pump"]["preinclude"] = pump->preinclude;
+    } else if (segmented) {
+        // Answered the same way as pump mode
+        nlohmann::json segments = nlohmann::json::array();
+        for (const Preprocessed::Segment &segment : data.preprocessed->segments)
+            segments.push_back({ { "hash", segment.hash }, { "size", segment.size } });
+        msg["segments"] = std::move(segments);
+    } else if (stream) {
+        msg["stream"] = true;
+    } else {
+        msg["bytes"] = static_cast<int>(data.preprocessed->stdOut.size());
+    }
 
     const std::string json = msg.dump();
     DEBUG("Sending to builder:\n%s\n", json.c_str());
@@ -549,20 +819,13 @@ int main(int argc, char **argv)
         }
         if (builderWebSocket->done) {
             if (builderWebSocket->error.empty()) {
-                if (!data.preprocessed->stdErr.empty()) {
-                    if (Client::data().builderHasJSONDiagnostics) {
-                        const std::string formatted = Client::formatJSONDiagnostics(data.preprocessed->stdErr);
-                        if (!formatted.empty()) {
-                            fwrite(formatted.c_str(), sizeof(char), formatted.size(), stderr);
-                        }
-                    } else {
-                        fwrite(data.preprocessed->stdErr.c_str(), sizeof(char), data.preprocessed->stdErr.size(), stderr);
-                    }
-                }
+                writeDiagnostics(data.preprocessed ? data.preprocessed->stdErr : direct.stdErr);
                 data.watchdog->transition(Watchdog::UploadedJob);
                 data.watchdog->transition(Watchdog::Finished);
                 data.watchdog->stop();
                 schedulerWebsocket->close("cachehit");
+                if (!localKey.empty() && !data.exitCode && LocalCache::enabled())
+                    LocalCache::store(localKey, builderWebSocket->output);
 
                 Client::writeStatistics();
                 return data.exitCode;
@@ -583,13 +846,117 @@ int main(int argc, char **argv)
     }
 
     assert(!builderWebSocket->wait);
-    builderWebSocket->send(WebSocket::Binary, data.preprocessed->stdOut.data(), data.preprocessed->stdOut.size());
-    if (!Config::storePreprocessedDataOnError)
-        data.preprocessed->stdOut.clear();
+    if (!data.preprocessed && !pumped) {
+        DEBUG("Builder doesn't have the object, preprocessing after all");
+        data.preprocessed = Preprocessed::create(data.compiler, data.compilerArgs, &select, &daemonSocket, true);
+        data.preprocessed->setCompressionLevel(compressionLevel);
+    }
+    // Streamed uploads are paced by the preprocessor so only plain uploads
+    // say anything about the link
+    unsigned long long uploadStarted = 0;
+    size_t uploadSize = 0;
+    // sendNoCopy reads from the chunks until they're written so they have to live that long
+    std::vector<std::vector<unsigned char>> sent;
+    std::vector<unsigned char> needed;
+    if (pumped || segmented) {
+        while (!data.watchdog->timedOut() && !builderWebSocket->needReceived && !builderWebSocket->done && builderWebSocket->state() == WebSocket::ConnectedWebSocket) {
+            select.exec();
+        }
+        if (data.watchdog->timedOut()) {
+            DEBUG("Have to run locally because we timed out waiting for builder");
+            runLocal("watchdog need");
+        }
+        if (!builderWebSocket->needReceived) {
+            DEBUG("Have to run locally because the builder didn't say what it needs");
+            runLocal("builder need error");
+        }
+
+        std::unordered_map<std::string, std::pair<const unsigned char *, size_t>> byHash;
+        if (pumped) {
+            for (const IncludeScanner::File &file : pump->files)
+                byHash[file.hash] = { reinterpret_cast<const unsigned char *>(file.contents.data()), file.contents.size() };
+        } else {
+            const std::vector<unsigned char> &raw = data.preprocessed->raw();
+            for (const Preprocessed::Segment &segment : data.preprocessed->segments)
+                byHash[segment.hash] = { raw.data() + segment.offset, segment.size };
+        }
+        for (const std::string &hash : builderWebSocket->need) {
+            auto it = byHash.find(hash);
+            if (it == byHash.end()) {
+                ERROR("Builder asked for something we didn't send %s", hash.c_str());
+                runLocal("builder need error 2");
+            }
+            needed.insert(needed.end(), it->second.first, it->second.first + it->second.second);
+        }
+        DEBUG("Sending %zu/%zu %s to the builder, %zu bytes", builderWebSocket->need.size(), byHash.size(), pumped ? "files" : "segments", needed.size());
+        if (Config::compress && !needed.empty())
+            needed = Preprocessed::compress(needed, zstd, compressionLevel);
+        const std::string header = nlohmann::json({ { "type", "needed" }, { "bytes", needed.size() } }).dump();
+        builderWebSocket->send(WebSocket::Text, header.c_str(), header.size());
+        if (!needed.empty()) {
+            uploadStarted = Client::mono();
+            uploadSize = needed.size();
+            builderWebSocket->sendNoCopy(needed.data(), needed.size());
+        }
+    } else if (stream) {
+        size_t uploaded = 0;
+        bool finished;
+        while (true) {
+            if (!builderWebSocket->hasPendingSendData())
+                sent.clear();
+            finished = data.preprocessed->takeChunks(chunks);
+            for (std::vector<unsigned char> &chunk : chunks) {
+                builderWebSocket->sendNoCopy(chunk.data(), chunk.size());
+                uploaded += chunk.size();
+                sent.push_back(std::move(chunk));
+            }
+            chunks.clear();
+            if (finished || data.watchdog->timedOut() || daemonSocket.state() != DaemonSocket::Connected || builderWebSocket->state() != WebSocket::ConnectedWebSocket)
+                break;
+            select.exec();
+        }
+        if (data.watchdog->timedOut()) {
+            ERROR("Have to run locally because we timed out waiting for preprocessing");
+            runLocal("watchdog preprocessing");
+        }
+        if (!finished) {
+            DEBUG("Have to run locally because something went wrong while streaming to the builder");
+            runLocal("builder stream error");
+        }
+
+        if (releaseCppSlotOnCppFinished)
+            daemonSocket.send(DaemonSocket::ReleaseCppSlot);
+        if (!Config::objectCache)
+            data.watchdog->transition(Watchdog::PreprocessFinished);
+        DEBUG("Preprocessed finished, streamed %zu bytes", uploaded);
+        preprocessedDuration = data.preprocessed->duration;
+        preprocessedSlotDuration = data.preprocessed->slotDuration;
+
+        if (data.preprocessed->exitStatus != 0) {
+            ERROR("Failed to preprocess. Running locally");
+            runLocal("preprocess error 6");
+        }
+
+        if (!uploaded) {
+            ERROR("Empty preprocessed output. Running locally");
+            runLocal("preprocess error 7");
+        }
+
+        const std::string uploadFinished = nlohmann::json({ { "type", "uploadFinished" }, { "bytes", uploaded } }).dump();
+        builderWebSocket->send(WebSocket::Text, uploadFinished.c_str(), uploadFinished.size());
+    } else {
+        uploadStarted = Client::mono();
+        uploadSize = data.preprocessed->stdOut.size();
+        builderWebSocket->sendNoCopy(data.preprocessed->stdOut.data(), data.preprocessed->stdOut.size());
+    }
 
     while (!data.watchdog->timedOut() && builderWebSocket->hasPendingSendData() && builderWebSocket->state() == WebSocket::ConnectedWebSocket) {
         select.exec();
     }
+    sent.clear();
+    needed.clear();
+    if (data.preprocessed && !Config::storePreprocessedDataOnError)
+        data.preprocessed->stdOut.clear();
 
     if (data.watchdog->timedOut()) {
         DEBUG("Have to run locally because we timed out waiting for builder");
@@ -602,6 +969,9 @@ int main(int argc, char **argv)
     }
 
     data.watchdog->transition(Watchdog::UploadedJob);
+    if (adaptiveCompression && uploadStarted) {
+        LinkStats::record(linkKey, uploadSize, Client::mono() - uploadStarted, builderConnectDuration);
+    }
     if (!releaseCppSlotOnCppFinished) {
         daemonSocket.send(DaemonSocket::ReleaseCppSlot);
     }
@@ -628,11 +998,49 @@ int main(int argc, char **argv)
     data.watchdog->transition(Watchdog::Finished);
     data.watchdog->stop();
     schedulerWebsocket->close("builderd");
+    if (!localKey.empty() && !data.exitCode && LocalCache::enabled())
+        LocalCache::store(localKey, builderWebSocket->output);
 
     Client::writeStatistics();
     return data.exitCode;
 }
 
+static void writeDiagnostics(const std::string &str)
+{
+    if (str.empty())
+        return;
+    if (Client::data().builderHasJSONDiagnostics) {
+        const std::string formatted = Client::formatJSONDiagnostics(str);
+        if (!formatted.empty()) {
+            fwrite(formatted.c_str(), sizeof(char), formatted.size(), stderr);
+        }
+    } else {
+        fwrite(str.c_str(), sizeof(char), str.size(), stderr);
+    }
+}
+
+// Objects from the builder get their source paths patched, or don't depend on
+// the checkout with --prefix-map. The ones we store locally keep whatever
+// paths they were built with so every checkout gets its own entries.
+static std::string localCacheKey(const std::string &cacheKey)
+{
+    if (cacheKey.empty())
+        return std::string();
+    const CompilerArgs &args = *Client::data().compilerArgs;
+    std::string key = cacheKey;
+    if (!args.sourceRoot.empty()) {
+        key += args.sourceRoot;
+    } else {
+        const std::string &source = args.sourceFile();
+        key += source[0] == '/' ? source : Client::cwd() + '/' + source;
+    }
+    unsigned char buf[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    if (!EVP_Digest(key.data(), key.size(), buf, &size, EVP_sha256(), nullptr))
+        return std::string();
+    return Client::toHex(buf, size);
+}
+
 static std::string schedulerUrl()
 {
     std::string url = Config::scheduler;
@@ -0,0 +1,10 @@
+// Hex digest length for each --hash-algorithm the client can use
+export const hashAlgorithms: Record<string, number> = {
+    sha1: 40,
+    blake2s256: 64,
+    blake2b512: 128
+};
+
+export function isCacheKey(name: string): boolean {
+    return Object.values(hashAlgorithms).includes(name.length) && /^[0-9a-f]+$/.test(name);
+}
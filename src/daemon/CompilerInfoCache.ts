@@ -232,9 +232,82 @@ export async function createCompilerInfo(exec: string): Promise<CompilerInfo> {
     return { hash, input, type, version };
 }
 
+// -march=native and friends are turned into explicit flags by comparing what
+// the driver passes to the compiler proper with and without them. The result
+// only holds for this machine's CPU so it stays out of the fingerprint.
+//
+//   gcc:   -march=sapphirerapids -mavx2 -mno-sse4a ... --param l1-cache-size=48
+//   clang: -target-cpu sapphirerapids -target-feature +avx2 ...
+
+// Driver output options that take their value as the next token
+const NATIVE_PAIRS: ReadonlySet<string> = new Set<string>(["--param", "-target-cpu", "-target-feature", "-tune-cpu"]);
+
+function tokenize(line: string): string[] {
+    const tokens: string[] = [];
+    const re = /"((?:[^"\\]|\\.)*)"|(\S+)/g;
+    let match: RegExpExecArray | null;
+    while ((match = re.exec(line))) {
+        tokens.push(match[1] !== undefined ? match[1].replace(/\\(.)/g, "$1") : match[2]);
+    }
+    return tokens;
+}
+
+async function driverOptions(exec: string, flags: readonly string[]): Promise<string[][]> {
+    const { stderr } = await execFileAsync(exec, ["-###", "-E", "-x", "c", ...flags, "/dev/null"], {
+        timeout: PROBE_TIMEOUT_MS,
+        maxBuffer: PROBE_MAX_BUFFER
+    });
+    const line = stderr
+        .split("\n")
+        .find((l: string) => l.startsWith(" ") && (l.includes('"-cc1"') || /\/cc1\w*[" ]/.test(l)));
+    if (!line) {
+        throw new Error(`No compiler invocation in ${exec} -### output`);
+    }
+    const tokens = tokenize(line);
+    const ret: string[][] = [];
+    for (let i = 0; i < tokens.length; ++i) {
+        if (NATIVE_PAIRS.has(tokens[i]) && i + 1 < tokens.length) {
+            ret.push([tokens[i], tokens[++i]]);
+        } else {
+            ret.push([tokens[i]]);
+        }
+    }
+    return ret;
+}
+
+export async function expandNative(exec: string, flags: readonly string[]): Promise<string[]> {
+    const [baseline, native] = await Promise.all([driverOptions(exec, []), driverOptions(exec, flags)]);
+    const seen = new Set<string>(baseline.map((option: string[]) => option.join("\0")));
+    // Outside of x86 clang's -march takes an architecture rather than a CPU
+    const cpu = flags.includes("-mcpu=native") ? "-mcpu" : "-march";
+    const ret: string[] = [];
+    for (const option of native) {
+        if (seen.has(option.join("\0"))) {
+            continue;
+        }
+        const [flag, value] = option;
+        if (flag === "-target-cpu") {
+            ret.push(`${cpu}=${value}`);
+        } else if (flag === "-tune-cpu") {
+            ret.push(`-mtune=${value}`);
+        } else if (flag === "-target-feature") {
+            ret.push("-Xclang", "-target-feature", "-Xclang", value);
+        } else if (flag === "--param") {
+            ret.push(`--param=${value}`);
+        } else if (flag.startsWith("-m") && !flag.endsWith("=native")) {
+            ret.push(flag);
+        } else {
+            // Better to compile locally than to drop something
+            throw new Error(`Unexpected ${option.join(" ")} in ${exec} -### output`);
+        }
+    }
+    return ret;
+}
+
 export class CompilerInfoCache {
     private readonly cache: Map<string, CompilerInfo> = new Map<string, CompilerInfo>();
     private readonly pending: Map<string, Promise<CompilerInfo>> = new Map<string, Promise<CompilerInfo>>();
+    private readonly nativeFlags: Map<string, Promise<string[]>> = new Map<string, Promise<string[]>>();
 
     async get(compilerPath: string): Promise<CompilerInfo> {
         if (typeof compilerPath !== "string" || compilerPath.length === 0) {
@@ -275,6 +348,24 @@ export class CompilerInfoCache {
         return compute;
     }
 
+    // Keyed like get(), the CPU can't change under a running daemon
+    async native(compilerPath: string, flags: string[]): Promise<string[]> {
+        const absPath = await fsPromises.realpath(path.resolve(compilerPath));
+        const stat = await fsPromises.stat(absPath);
+        const key = `${absPath}:${stat.mtimeMs}:${flags.join(" ")}`;
+
+        let expanded = this.nativeFlags.get(key);
+        if (!expanded) {
+            expanded = expandNative(absPath, flags);
+            this.nativeFlags.set(key, expanded);
+            // Try again next time
+            expanded.catch(() => {
+                this.nativeFlags.delete(key);
+            });
+        }
+        return expanded;
+    }
+
     private static async compute(absPath: string): Promise<CompilerInfo> {
         return createCompilerInfo(absPath);
     }
@@ -0,0 +1,110 @@
+import { promises as dnsPromises } from "dns";
+
+// Every fiskc resolves the scheduler and, when the scheduler hands out a
+// hostname, the builder before it can connect. The daemon outlives them so it
+// keeps those lookups warm and hands the addresses out with each slot.
+//
+// Entries older than REFRESH_MS are still handed out but trigger a background
+// lookup, entries nobody asked for in EXPIRE_MS are dropped.
+
+const REFRESH_MS = 60 * 1000;
+const EXPIRE_MS = 10 * 60 * 1000;
+const MAX_HOSTS = 64;
+
+interface Entry {
+    address?: string;
+    resolved: number;
+    used: number;
+    pending?: Promise<string | undefined>;
+}
+
+export class HostCache {
+    private readonly hosts: Map<string, Entry> = new Map<string, Entry>();
+
+    constructor(private readonly debug: boolean) {}
+
+    // Resolves once host has an address (or failed to get one). This is also
+    // what marks host as used, addresses() doesn't
+    resolve(host: string): Promise<string | undefined> {
+        const now = Date.now();
+        let entry = this.hosts.get(host);
+        if (!entry) {
+            if (this.hosts.size >= MAX_HOSTS) {
+                this.expire(now, true);
+            }
+            entry = { resolved: 0, used: now };
+            this.hosts.set(host, entry);
+        }
+        entry.used = now;
+        if (entry.address) {
+            if (now - entry.resolved >= REFRESH_MS) {
+                this.lookup(host, entry);
+            }
+            return Promise.resolve(entry.address);
+        }
+        return this.lookup(host, entry);
+    }
+
+    // All known addresses, refreshing the ones that are getting old
+    addresses(): Record<string, string> {
+        const now = Date.now();
+        this.expire(now, false);
+        const ret: Record<string, string> = {};
+        for (const [host, entry] of this.hosts) {
+            if (entry.address) {
+                ret[host] = entry.address;
+                if (now - entry.resolved >= REFRESH_MS) {
+                    this.lookup(host, entry);
+                }
+            }
+        }
+        return ret;
+    }
+
+    private lookup(host: string, entry: Entry): Promise<string | undefined> {
+        if (entry.pending) {
+            return entry.pending;
+        }
+        // fiskc only connects over IPv4
+        entry.pending = dnsPromises
+            .lookup(host, { family: 4 })
+            .then(
+                (result: { address: string }) => {
+                    if (this.debug) {
+                        console.log("HostCache resolved", host, result.address);
+                    }
+                    entry.address = result.address;
+                    entry.resolved = Date.now();
+                    return entry.address;
+                },
+                (err: Error) => {
+                    if (this.debug) {
+                        console.log("HostCache failed to resolve", host, err.message);
+                    }
+                    // Keep handing out the last good address, fiskc falls
+                    // back to its own lookup if that one doesn't work either
+                    return entry.address;
+                }
+            )
+            .finally(() => {
+                entry.pending = undefined;
+            });
+        return entry.pending;
+    }
+
+    private expire(now: number, oldest: boolean): void {
+        let oldestHost: string | undefined;
+        let oldestUsed = now;
+        for (const [host, entry] of this.hosts) {
+            if (now - entry.used >= EXPIRE_MS) {
+                this.hosts.delete(host);
+            } else if (entry.used <= oldestUsed) {
+                oldestHost = host;
+                oldestUsed = entry.used;
+            }
+        }
+        if (oldest && oldestHost !== undefined && this.hosts.size >= MAX_HOSTS) {
+            this.hosts.delete(oldestHost);
+        }
+    }
+}
@@ -2,6 +2,7 @@
 
 import { CompilerInfoCache } from "./CompilerInfoCache";
 import { Constants } from "./Constants";
+import { HostCache } from "./HostCache";
 import { Server } from "./Server";
 import { Slots } from "./Slots";
 import { common as commonFunc } from "../common";
@@ -69,6 +70,7 @@ const localSlots = new Slots(localSlotCount, "local", debug);
 const localSlotsMaxLoad = (option("local-slots-max-load") as number) || 0;
 
 const compilerInfoCache = new CompilerInfoCache();
+const hostCache = new HostCache(debug);
 
 interface CompilerInfoResult {
     info: CompilerInfo | null;
@@ -219,7 +221,15 @@ server.on("compile", (compile) => {
         }
     });
 
-    compile.on("acquireSlot", (msg?: { type?: string; compiler?: unknown }) => {
+    compile.on("resolveHost", (msg?: { type?: string; host?: unknown }) => {
+        // Sent for every builder fiskc connects to, a new one gets looked up
+        // for the next compile and a known one counts as used
+        if (msg && typeof msg.host === "string" && msg.host.length > 0) {
+            hostCache.resolve(msg.host);
+        }
+    });
+
+    compile.on("acquireSlot", (msg?: { type?: string; compiler?: unknown; resolve?: unknown; native?: unknown }) => {
         if (debug) {
             console.log("acquireSlot", msg);
         }
@@ -240,8 +250,26 @@ server.on("compile", (compile) => {
               )
             : Promise.resolve<CompilerInfoResult>({ info: null, error: "acquireSlot missing compiler path" });
 
-        infoResult
-            .then(({ info, error }) => {
+        const resolve: string[] =
+            msg && Array.isArray(msg.resolve)
+                ? msg.resolve.filter((host: unknown): host is string => typeof host === "string" && host.length > 0)
+                : [];
+
+        // -march=native and friends, fiskc compiles locally if they can't be expanded
+        const native: string[] =
+            msg && Array.isArray(msg.native)
+                ? msg.native.filter((flag: unknown): flag is string => typeof flag === "string" && flag.length > 0)
+                : [];
+        const nativeResult: Promise<string[] | null> =
+            compilerPath && native.length
+                ? compilerInfoCache.native(compilerPath, native).catch((err: unknown) => {
+                      console.log("acquireSlot -> failed to expand", native, err instanceof Error ? err.message : err);
+                      return null;
+                  })
+                : Promise.resolve(null);
+
+        Promise.all([infoResult, nativeResult, Promise.all(resolve.map((host: string) => hostCache.resolve(host)))])
+            .then(([{ info, error }, expanded]) => {
                 if (compileClosed) {
                     return;
                 }
@@ -249,8 +277,12 @@ server.on("compile", (compile) => {
                     const response: Record<string, unknown> = {
                         type: "slotAcquired",
                         slot,
-                        compilerInfo: info
+                        compilerInfo: info,
+                        hosts: hostCache.addresses()
                     };
+                    if (expanded) {
+                        response.native = expanded;
+                    }
                     if (error) {
                         response.error = error;
                     }
@@ -10,7 +10,7 @@ export class Compile extends Client {
         ip: string,
         readonly environment: string,
         readonly sourcePath: string,
-        readonly sha1?: string,
+        public sha1?: string,
         option?: Options
     ) {
         super(ClientType.Compile, ws, ip, option);
@@ -1,6 +1,7 @@
 import { Builder } from "./Builder";
 import { Client, ClientType } from "./Client";
 import { Compile } from "./Compile";
+import { hashAlgorithms } from "../common/HashAlgorithms";
 import EventEmitter from "events";
 import Url from "url-parse";
 import WebSocket from "ws";
@@ -22,6 +23,13 @@ function header(req: express.Request, name: string): string | undefined {
     return String(ret);
 }
 
+// With the object cache on, fiskc connects while it's still preprocessing
+// and sends the sha1 in a follow-up message. We hold off on picking a builder
+// until it arrives.
+function defersSha1(req: express.Request, objectCache: boolean): boolean {
+    return objectCache && !header(req, "x-fisk-sha1") && header(req, "x-fisk-sha1-deferred") === "true";
+}
+
 export class Server extends EventEmitter {
     private id: number;
     private app?: express.Express;
@@ -150,6 +158,9 @@ export class Server extends EventEmitter {
             this.ws.on("headers", (headers: string[], request: express.Request) => {
                 const url = new Url(request.url, this.baseUrl);
                 headers.push("x-fisk-object-cache: " + (this.objectCache ? "true" : "false"));
+                if (url.pathname === "/compile" && defersSha1(request, this.objectCache)) {
+                    headers.push("x-fisk-sha1-deferred: true");
+                }
                 if (url.pathname === "/monitor") {
                     const nonce = crypto.randomBytes(256).toString("base64");
                     headers.push(`x-fisk-nonce: ${nonce}`);
@@ -188,8 +199,11 @@ export class Server extends EventEmitter {
             return;
         }
         const sha1 = header(req, "x-fisk-sha1");
+        const sha1Algorithm = header(req, "x-fisk-sha1-algorithm") || "sha1";
 
-        if (sha1 && sha1.length !== 40) {
+        // All accepted digests have different lengths so keys from different
+        // algorithms can share the object cache without colliding
+        if (sha1 && sha1.length !== hashAlgorithms[sha1Algorithm]) {
             ws.send(`{"error": "Bad sha1 sum: ${sha1}"}`);
             ws.close();
             return;
@@ -219,7 +233,10 @@ export class Server extends EventEmitter {
         if (clientHostname) {
             client.hostname = clientHostname;
         }
-        this.emit("compile", client);
+        let pendingSha1 = defersSha1(req, this.objectCache);
+        if (!pendingSha1) {
+            this.emit("compile", client);
+        }
         const remaining: { bytes?: number; type?: string } = {};
         client.ws.on("error", (err) => client.emit("error", err));
         client.ws.on("close", (code, reason) => {
@@ -257,6 +274,21 @@ export class Server extends EventEmitter {
                         client.emit("log", json);
                         return;
                     }
+                    if (json.type === "sha1") {
+                        if (!pendingSha1) {
+                            client.error("Unexpected sha1 message");
+                            return;
+                        }
+                        const algorithm = typeof json.algorithm === "string" ? json.algorithm : "sha1";
+                        if (typeof json.sha1 !== "string" || json.sha1.length !== hashAlgorithms[algorithm]) {
+                            client.error(`Bad sha1 sum: ${json.sha1}`);
+                            return;
+                        }
+                        pendingSha1 = false;
+                        client.sha1 = json.sha1;
+                        this.emit("compile", client);
+                        return;
+                    }
                     if (json.type !== "uploadEnvironment") {
                         client.error('Expected type: "uploadEnvironment"');
                         return;